@@ -0,0 +1,652 @@
+/* The MIT License (MIT)
+ * 
+ * Copyright (c) 2013 Yannick Scherer
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <multiplex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+// ----------------------------------------------------------------------
+//
+//   BENCHMARK
+//
+// ----------------------------------------------------------------------
+// Measures throughput (frames/s, MB/s) and round-trip latency of
+// multiplexed connections, for every combination of the given transports,
+// message sizes, channel counts and sender/receiver thread counts.
+// Results are written to stdout as CSV (default) or JSON:
+//
+//     bench --sizes 16,4096,1048576 --channels 1,64 --senders 1,4 --format json
+//
+// Side A sends (and measures round trips), side B receives (and echoes).
+// Pipes are unidirectional, so each side uses two multiplexers there.
+
+#define MAX_LIST 32
+#define MAX_CHANNELS 65536
+
+typedef struct List {
+    long values[MAX_LIST];
+    int count;
+} List;
+
+typedef struct Options {
+    char const * transports[MAX_LIST];
+    int transportCount;
+    List sizes;
+    List channels;
+    List senders;
+    List receivers;
+    int throughput;      // 1 = run the throughput test
+    int latency;         // 1 = run the latency test
+    long bytes;          // payload bytes per throughput run (at least 16 frames)
+    long frames;         // maximum number of frames per throughput run
+    long iterations;     // round trips per latency run (and thread)
+    int engine;          // MULTIPLEX_ENGINE_*
+    int coalesceBytes;   // 'multiplex_set_coalescing' threshold (0 = off)
+    int coalesceUs;      // 'multiplex_set_coalescing' delay
+    int json;            // 1 = JSON, 0 = CSV
+} Options;
+
+typedef struct Side {
+    Multiplex * in;      // receives
+    Multiplex * out;     // sends (the same as 'in' unless it is a pipe)
+    int fds[2];          // fds to close
+} Side;
+
+typedef struct Run {
+    Options const * options;
+    Side a, b;
+    int size;
+    int channels;
+    int senders;
+    int receivers;
+    long frames;         // frames to send (throughput) or round trips per sender (latency)
+    char * payload;      // 'size' bytes
+    long received;       // payload bytes received by side B (throughput)
+    long sent;           // frames sent by side A (throughput)
+    double finished;     // time the last payload byte arrived (throughput)
+    int done;            // 1 = receivers/echo threads can stop
+    int failed;          // 1 = a thread saw an error or timeout
+    double * samples;    // round trip times in microseconds (latency)
+    long * expected;     // bytes sent per channel index (latency)
+    long * echoed;       // bytes echoed per channel index (latency)
+    pthread_mutex_t echoMutex;  // protects 'echoed'
+    pthread_cond_t echoCond;    // signalled when echoed bytes arrive
+} Run;
+
+typedef struct Worker {
+    Run * run;
+    int index;
+} Worker;
+
+// ----------------------------------------------------------------------
+//
+//   UTILS
+//
+// ----------------------------------------------------------------------
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static unsigned int channel_id(int index) {
+    // channel IDs skip the control channel
+    return index < MULTIPLEX_CONTROL_CHANNEL ? (unsigned int)index : (unsigned int)index + 1;
+}
+
+static int channel_index(unsigned int channelId) {
+    return channelId < MULTIPLEX_CONTROL_CHANNEL ? (int)channelId : (int)channelId - 1;
+}
+
+static int parse_list(List * list, char const * text) {
+    char * end = 0;
+    list->count = 0;
+    while (*text && list->count < MAX_LIST) {
+        long value = strtol(text, &end, 10);
+        if (end == text || value <= 0) return 0;
+        if (*end == 'k' || *end == 'K') { value *= 1024; ++end; }
+        else if (*end == 'm' || *end == 'M') { value *= 1024 * 1024; ++end; }
+        list->values[list->count++] = value;
+        text = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != 0) return 0;
+    }
+    return list->count > 0;
+}
+
+static int compare_double(void const * a, void const * b) {
+    double x = *(double const *)a, y = *(double const *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(double const * sorted, long count, double p) {
+    return count > 0 ? sorted[(long)((count - 1) * p)] : 0;
+}
+
+// ----------------------------------------------------------------------
+//
+//   TRANSPORTS
+//
+// ----------------------------------------------------------------------
+static int open_tcp(int * client, int * server) {
+    struct sockaddr_in addr;
+    socklen_t length = sizeof(addr);
+    int listener = socket(AF_INET, SOCK_STREAM, 0), one = 1;
+    if (listener < 0) return 0;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 1) != 0 ||
+        getsockname(listener, (struct sockaddr *)&addr, &length) != 0) {
+        close(listener);
+        return 0;
+    }
+    *client = socket(AF_INET, SOCK_STREAM, 0);
+    if (*client < 0 || connect(*client, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(listener);
+        return 0;
+    }
+    *server = accept(listener, 0, 0);
+    close(listener);
+    if (*server < 0) return 0;
+    setsockopt(*client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(*server, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return 1;
+}
+
+typedef struct Opening {
+    int fd;
+    int engine;
+    Multiplex * m;
+} Opening;
+
+static void * open_thread(void * ptr) {
+    // the shared memory engine waits for the peer to set up its side
+    Opening * o = (Opening *)ptr;
+    o->m = multiplex_new_engine(o->fd, o->engine);
+    return 0;
+}
+
+static int open_sides(Run * run, char const * transport) {
+    int engine = run->options->engine;
+    int fds[4];
+    memset(&(run->a), 0, sizeof(Side));
+    memset(&(run->b), 0, sizeof(Side));
+    if (engine == MULTIPLEX_ENGINE_SHM) {
+        pthread_t thread;
+        Opening peer;
+        if (strcmp(transport, "socketpair") != 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return 0;
+        peer.fd = fds[1];
+        peer.engine = engine;
+        pthread_create(&thread, 0, open_thread, &peer);
+        run->a.in = run->a.out = multiplex_new_engine(fds[0], engine);
+        pthread_join(thread, 0);
+        run->b.in = run->b.out = peer.m;
+        run->a.fds[0] = fds[0]; run->a.fds[1] = -1;
+        run->b.fds[0] = fds[1]; run->b.fds[1] = -1;
+        return run->a.in != 0 && run->b.in != 0;
+    }
+    if (strcmp(transport, "pipe") == 0) {
+        // A writes fds[1] -> B reads fds[0], B writes fds[3] -> A reads fds[2]
+        if (pipe(fds) != 0 || pipe(fds + 2) != 0) return 0;
+        run->a.in = multiplex_new_engine(fds[2], engine);
+        run->a.out = multiplex_new_engine(fds[1], engine);
+        run->b.in = multiplex_new_engine(fds[0], engine);
+        run->b.out = multiplex_new_engine(fds[3], engine);
+        run->a.fds[0] = fds[1]; run->a.fds[1] = fds[2];
+        run->b.fds[0] = fds[0]; run->b.fds[1] = fds[3];
+        return 1;
+    }
+    if (strcmp(transport, "socketpair") == 0) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return 0;
+    }
+    else if (strcmp(transport, "tcp") == 0) {
+        if (!open_tcp(fds, fds + 1)) return 0;
+    }
+    else return 0;
+    run->a.in = run->a.out = multiplex_new_engine(fds[0], engine);
+    run->b.in = run->b.out = multiplex_new_engine(fds[1], engine);
+    run->a.fds[0] = fds[0]; run->a.fds[1] = -1;
+    run->b.fds[0] = fds[1]; run->b.fds[1] = -1;
+    return 1;
+}
+
+static void close_side(Side * side) {
+    if (side->out != side->in) multiplex_free(side->out);
+    multiplex_free(side->in);
+    if (side->fds[0] >= 0) close(side->fds[0]);
+    if (side->fds[1] >= 0) close(side->fds[1]);
+}
+
+static void * negotiate_thread(void * ptr) {
+    return (void *)(long)multiplex_negotiate((Multiplex *)ptr, 2000);
+}
+
+static int prepare(Run * run) {
+    // enable channels (negotiating protocol v2 if IDs above 255 are needed)
+    Options const * o = run->options;
+    unsigned int last = channel_id(run->channels - 1);
+    void * peer = 0;
+    if (last > 255) {
+        pthread_t thread;
+        int version = 0;
+        if (run->a.in != run->a.out) return 0;
+        pthread_create(&thread, 0, negotiate_thread, run->b.in);
+        version = multiplex_negotiate(run->a.in, 2000);
+        pthread_join(thread, &peer);
+        if (version < 2 || (long)peer < 2) return 0;
+    }
+    if (last < MULTIPLEX_CONTROL_CHANNEL) {
+        multiplex_enable_range(run->a.in, 0, last, 0);
+        multiplex_enable_range(run->b.in, 0, last, 0);
+    }
+    else {
+        multiplex_enable_range(run->a.in, 0, MULTIPLEX_CONTROL_CHANNEL - 1, 0);
+        multiplex_enable_range(run->b.in, 0, MULTIPLEX_CONTROL_CHANNEL - 1, 0);
+        multiplex_enable_range(run->a.in, MULTIPLEX_CONTROL_CHANNEL + 1, last, 0);
+        multiplex_enable_range(run->b.in, MULTIPLEX_CONTROL_CHANNEL + 1, last, 0);
+    }
+    multiplex_set_concurrent(run->a.in, run->senders > 1);
+    multiplex_set_concurrent(run->b.in, run->receivers > 1);
+    if (o->coalesceBytes > 0) {
+        multiplex_set_coalescing(run->a.out, o->coalesceBytes, o->coalesceUs);
+        multiplex_set_coalescing(run->b.out, o->coalesceBytes, o->coalesceUs);
+    }
+    return 1;
+}
+
+// ----------------------------------------------------------------------
+//
+//   THROUGHPUT
+//
+// ----------------------------------------------------------------------
+// Senders spread 'frames' frames over all channels, receivers read
+// whatever channel 'select' reports until all payload bytes arrived.
+#define BUFFER_SIZE 1048576
+
+static void * send_thread(void * ptr) {
+    Worker * w = (Worker *)ptr;
+    Run * run = w->run;
+    long f = 0;
+    for (f = w->index; f < run->frames && !__atomic_load_n(&(run->failed), __ATOMIC_RELAXED); f += run->senders) {
+        if (multiplex_send(run->a.out, channel_id(f % run->channels), run->payload, run->size) < 0) {
+            __atomic_store_n(&(run->failed), 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    return 0;
+}
+
+static void * receive_thread(void * ptr) {
+    Worker * w = (Worker *)ptr;
+    Run * run = w->run;
+    long total = run->frames * run->size;
+    char * buffer = (char *)malloc(BUFFER_SIZE);
+    int idle = 0, n = 0;
+    while (buffer != 0 && !__atomic_load_n(&(run->done), __ATOMIC_ACQUIRE)) {
+        int ch = multiplex_select(run->b.in, 100);
+        if (ch == CHANNEL_CLOSED || (ch < 0 && ++idle > 100)) {
+            // closed, or nothing received for 10 seconds
+            __atomic_store_n(&(run->failed), 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&(run->done), 1, __ATOMIC_RELEASE);
+            break;
+        }
+        if (ch < 0) continue;
+        idle = 0;
+        while ((n = multiplex_read(run->b.in, ch, buffer, 0, BUFFER_SIZE)) > 0) {
+            if (__atomic_add_fetch(&(run->received), n, __ATOMIC_ACQ_REL) == total) {
+                run->finished = now_us();
+                __atomic_store_n(&(run->done), 1, __ATOMIC_RELEASE);
+            }
+        }
+    }
+    free(buffer);
+    return 0;
+}
+
+// ----------------------------------------------------------------------
+//
+//   LATENCY
+//
+// ----------------------------------------------------------------------
+// Every sender sends a frame, then waits until the echo of all of its
+// bytes has arrived on the same channel; receivers echo everything. Side
+// A reads echoes in a thread of its own: a sender that read them itself
+// could not do so while blocked sending a frame larger than the socket
+// buffers, and neither could side B, blocked echoing to it.
+static void * collect_thread(void * ptr) {
+    Run * run = (Run *)ptr;
+    char * buffer = (char *)malloc(BUFFER_SIZE);
+    int n = 0;
+    while (buffer != 0 && !__atomic_load_n(&(run->done), __ATOMIC_ACQUIRE)) {
+        int ch = multiplex_select(run->a.in, 100);
+        if (ch == CHANNEL_CLOSED) {
+            __atomic_store_n(&(run->failed), 1, __ATOMIC_RELAXED);
+            break;
+        }
+        if (ch < 0) continue;
+        while ((n = multiplex_read(run->a.in, ch, buffer, 0, BUFFER_SIZE)) > 0) {
+            pthread_mutex_lock(&(run->echoMutex));
+            run->echoed[channel_index(ch)] += n;
+            pthread_cond_broadcast(&(run->echoCond));
+            pthread_mutex_unlock(&(run->echoMutex));
+        }
+    }
+    pthread_mutex_lock(&(run->echoMutex));
+    pthread_cond_broadcast(&(run->echoCond));
+    pthread_mutex_unlock(&(run->echoMutex));
+    free(buffer);
+    return 0;
+}
+
+static void * ping_thread(void * ptr) {
+    Worker * w = (Worker *)ptr;
+    Run * run = w->run;
+    long i = 0;
+    for (; i < run->frames && !__atomic_load_n(&(run->failed), __ATOMIC_RELAXED); ++i) {
+        int index = (int)((w->index + i * run->senders) % run->channels);
+        long target = __atomic_add_fetch(&(run->expected[index]), run->size, __ATOMIC_RELAXED);
+        double start = now_us();
+        struct timespec deadline;
+        int timedOut = 0;
+        if (multiplex_send(run->a.out, channel_id(index), run->payload, run->size) < 0) break;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 10;
+        pthread_mutex_lock(&(run->echoMutex));
+        while (run->echoed[index] < target && !timedOut && !__atomic_load_n(&(run->failed), __ATOMIC_RELAXED))
+            timedOut = pthread_cond_timedwait(&(run->echoCond), &(run->echoMutex), &deadline) != 0;
+        timedOut = run->echoed[index] < target;
+        pthread_mutex_unlock(&(run->echoMutex));
+        if (timedOut) break;
+        run->samples[w->index * run->frames + i] = now_us() - start;
+    }
+    if (i < run->frames) __atomic_store_n(&(run->failed), 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void * echo_thread(void * ptr) {
+    Worker * w = (Worker *)ptr;
+    Run * run = w->run;
+    char * buffer = (char *)malloc(BUFFER_SIZE);
+    int n = 0;
+    while (buffer != 0 && !__atomic_load_n(&(run->done), __ATOMIC_ACQUIRE)) {
+        int ch = multiplex_select(run->b.in, 100);
+        if (ch == CHANNEL_CLOSED) break;
+        if (ch < 0) continue;
+        while ((n = multiplex_read(run->b.in, ch, buffer, 0, BUFFER_SIZE)) > 0) {
+            if (multiplex_send(run->b.out, ch, buffer, n) < 0) break;
+        }
+    }
+    free(buffer);
+    return 0;
+}
+
+// ----------------------------------------------------------------------
+//
+//   RUNS
+//
+// ----------------------------------------------------------------------
+static char const * engine_name(Multiplex * m) {
+    switch (multiplex_engine(m)) {
+        case MULTIPLEX_ENGINE_URING: return "uring";
+        case MULTIPLEX_ENGINE_SHM: return "shm";
+        default: return "poll";
+    }
+}
+
+static void report(Options const * o, char const * test, char const * transport, Run const * run,
+                   double seconds, double const * samples, long sampleCount) {
+    static int rows = 0;
+    long frames = samples != 0 ? sampleCount : run->frames;
+    double fps = seconds > 0 ? frames / seconds : 0;
+    double mbps = seconds > 0 ? frames * (double)run->size / seconds / 1e6 : 0;
+    char latency[96] = "";
+    if (samples != 0) {
+        snprintf(latency, sizeof(latency), o->json ? "%.1f, \"p99_us\": %.1f, \"p999_us\": %.1f" : "%.1f,%.1f,%.1f",
+                 percentile(samples, sampleCount, 0.5), percentile(samples, sampleCount, 0.99),
+                 percentile(samples, sampleCount, 0.999));
+    }
+    else snprintf(latency, sizeof(latency), o->json ? "null, \"p99_us\": null, \"p999_us\": null" : ",,");
+    if (o->json) {
+        printf("%s  {\"test\": \"%s\", \"transport\": \"%s\", \"engine\": \"%s\", \"size\": %d, \"channels\": %d, "
+               "\"senders\": %d, \"receivers\": %d, \"frames\": %ld, \"seconds\": %.6f, \"frames_per_sec\": %.1f, "
+               "\"mb_per_sec\": %.2f, \"ok\": %s, \"p50_us\": %s}",
+               rows > 0 ? ",\n" : "", test, transport, engine_name(run->a.in),
+               run->size, run->channels, run->senders, run->receivers, frames, seconds, fps, mbps,
+               run->failed ? "false" : "true", latency);
+    }
+    else {
+        printf("%s,%s,%s,%d,%d,%d,%d,%ld,%.6f,%.1f,%.2f,%d,%s\n", test, transport,
+               engine_name(run->a.in),
+               run->size, run->channels, run->senders, run->receivers, frames, seconds, fps, mbps,
+               !run->failed, latency);
+    }
+    fflush(stdout);
+    ++rows;
+}
+
+static void start_threads(Run * run, pthread_t * threads, Worker * workers, int count, void * (*fn)(void *)) {
+    int i = 0;
+    for (; i < count; ++i) {
+        workers[i].run = run;
+        workers[i].index = i;
+        pthread_create(&threads[i], 0, fn, &workers[i]);
+    }
+}
+
+static void join_threads(pthread_t * threads, int count) {
+    int i = 0;
+    for (; i < count; ++i) pthread_join(threads[i], 0);
+}
+
+static void bench(Options const * o, char const * transport, int latency,
+                  int size, int channels, int senders, int receivers) {
+    pthread_t sendThreads[MAX_LIST * 4], receiveThreads[MAX_LIST * 4], collector;
+    Worker sendWorkers[MAX_LIST * 4], receiveWorkers[MAX_LIST * 4];
+    Run run;
+    long budget = o->bytes / size;
+    double start = 0, seconds = 0;
+
+    //
+    memset(&run, 0, sizeof(run));
+    run.options = o;
+    run.size = size;
+    run.channels = channels;
+    run.senders = senders;
+    run.receivers = receivers;
+    if (latency) budget /= senders;
+    if (budget < 16) budget = 16;
+    run.frames = latency ? (o->iterations < budget ? o->iterations : budget) : (o->frames < budget ? o->frames : budget);
+    run.payload = (char *)malloc(size);
+    if (latency) {
+        run.samples = (double *)calloc(run.frames * senders, sizeof(double));
+        run.expected = (long *)calloc(channels, sizeof(long));
+        run.echoed = (long *)calloc(channels, sizeof(long));
+    }
+    if (run.payload == 0 || (latency && (run.samples == 0 || run.expected == 0 || run.echoed == 0)) ||
+        !open_sides(&run, transport)) {
+        fprintf(stderr, "bench: cannot set up %s\n", transport);
+        free(run.payload);
+        free(run.samples);
+        free(run.expected);
+        free(run.echoed);
+        return;
+    }
+    memset(run.payload, 'x', size);
+    if (!prepare(&run)) {
+        fprintf(stderr, "bench: skipping %d channels over %s (needs protocol v2)\n", channels, transport);
+        close_side(&(run.a));
+        close_side(&(run.b));
+        free(run.payload);
+        free(run.samples);
+        free(run.expected);
+        free(run.echoed);
+        return;
+    }
+    pthread_mutex_init(&(run.echoMutex), 0);
+    pthread_cond_init(&(run.echoCond), 0);
+
+    //
+    start = now_us();
+    start_threads(&run, receiveThreads, receiveWorkers, receivers, latency ? echo_thread : receive_thread);
+    if (latency) pthread_create(&collector, 0, collect_thread, &run);
+    start_threads(&run, sendThreads, sendWorkers, senders, latency ? ping_thread : send_thread);
+    join_threads(sendThreads, senders);
+    if (latency) {
+        run.finished = now_us();
+        __atomic_store_n(&(run.done), 1, __ATOMIC_RELEASE);
+        pthread_join(collector, 0);
+    }
+    join_threads(receiveThreads, receivers);
+    seconds = ((run.finished > 0 ? run.finished : now_us()) - start) / 1e6;
+
+    //
+    if (latency) {
+        qsort(run.samples, run.frames * senders, sizeof(double), compare_double);
+        report(o, "latency", transport, &run, seconds, run.samples, run.frames * senders);
+    }
+    else report(o, "throughput", transport, &run, seconds, 0, 0);
+    close_side(&(run.a));
+    close_side(&(run.b));
+    pthread_cond_destroy(&(run.echoCond));
+    pthread_mutex_destroy(&(run.echoMutex));
+    free(run.payload);
+    free(run.samples);
+    free(run.expected);
+    free(run.echoed);
+}
+
+// ----------------------------------------------------------------------
+//
+//   MAIN
+//
+// ----------------------------------------------------------------------
+static void usage(void) {
+    fprintf(stderr,
+        "usage: bench [options]   (lists are comma-separated, sizes accept k/m suffixes)\n"
+        "  --transport LIST   socketpair, pipe, tcp (default: socketpair)\n"
+        "  --sizes LIST       message sizes in bytes (default: 16,256,4k,64k,1m,16m)\n"
+        "  --channels LIST    active channels (default: 1)\n"
+        "  --senders LIST     sending threads (default: 1)\n"
+        "  --receivers LIST   receiving threads (default: 1)\n"
+        "  --test NAME        throughput, latency or all (default: all)\n"
+        "  --bytes N          payload bytes per run (default: 256m)\n"
+        "  --frames N         maximum frames per throughput run (default: 1000000)\n"
+        "  --iterations N     maximum round trips per latency run and sender (default: 10000)\n"
+        "  --engine NAME      poll, uring or shm (socketpair only) (default: poll)\n"
+        "  --coalesce N,US    coalesce sends (threshold in bytes, delay in microseconds)\n"
+        "  --format NAME      csv or json (default: csv)\n");
+}
+
+static int parse_options(Options * o, int argc, char * argv[]) {
+    int i = 1;
+    List values;
+    char * transports = 0;
+    memset(o, 0, sizeof(Options));
+    o->transports[o->transportCount++] = "socketpair";
+    parse_list(&(o->sizes), "16,256,4k,64k,1m,16m");
+    parse_list(&(o->channels), "1");
+    parse_list(&(o->senders), "1");
+    parse_list(&(o->receivers), "1");
+    o->throughput = o->latency = 1;
+    o->bytes = 256L * 1024 * 1024;
+    o->frames = 1000000;
+    o->iterations = 10000;
+    o->engine = MULTIPLEX_ENGINE_POLL;
+    for (; i + 1 < argc; i += 2) {
+        char const * name = argv[i], * value = argv[i + 1];
+        if (strcmp(name, "--transport") == 0) {
+            char * token = 0;
+            transports = strdup(value);
+            o->transportCount = 0;
+            for (token = strtok(transports, ","); token != 0 && o->transportCount < MAX_LIST; token = strtok(0, ","))
+                o->transports[o->transportCount++] = token;
+        }
+        else if (strcmp(name, "--sizes") == 0) { if (!parse_list(&(o->sizes), value)) return 0; }
+        else if (strcmp(name, "--channels") == 0) { if (!parse_list(&(o->channels), value)) return 0; }
+        else if (strcmp(name, "--senders") == 0) { if (!parse_list(&(o->senders), value)) return 0; }
+        else if (strcmp(name, "--receivers") == 0) { if (!parse_list(&(o->receivers), value)) return 0; }
+        else if (strcmp(name, "--test") == 0) {
+            o->throughput = strcmp(value, "latency") != 0;
+            o->latency = strcmp(value, "throughput") != 0;
+        }
+        else if (strcmp(name, "--bytes") == 0 || strcmp(name, "--frames") == 0 || strcmp(name, "--iterations") == 0) {
+            if (!parse_list(&values, value) || values.count != 1) return 0;
+            if (name[2] == 'b') o->bytes = values.values[0];
+            else if (name[2] == 'f') o->frames = values.values[0];
+            else o->iterations = values.values[0];
+        }
+        else if (strcmp(name, "--engine") == 0) {
+            o->engine = strcmp(value, "uring") == 0 ? MULTIPLEX_ENGINE_URING :
+                        strcmp(value, "shm") == 0 ? MULTIPLEX_ENGINE_SHM : MULTIPLEX_ENGINE_POLL;
+        }
+        else if (strcmp(name, "--coalesce") == 0) {
+            if (!parse_list(&values, value) || values.count != 2) return 0;
+            o->coalesceBytes = (int)values.values[0];
+            o->coalesceUs = (int)values.values[1];
+        }
+        else if (strcmp(name, "--format") == 0) o->json = strcmp(value, "json") == 0;
+        else return 0;
+    }
+    return i == argc;
+}
+
+int main(int argc, char * argv[]) {
+    Options o;
+    int t = 0, s = 0, c = 0, x = 0, r = 0, latency = 0;
+    if (!parse_options(&o, argc, argv)) {
+        usage();
+        return 1;
+    }
+    for (x = 0; x < o.senders.count; ++x) {
+        if (o.senders.values[x] > MAX_LIST * 4) o.senders.values[x] = MAX_LIST * 4;
+    }
+    for (x = 0; x < o.receivers.count; ++x) {
+        if (o.receivers.values[x] > MAX_LIST * 4) o.receivers.values[x] = MAX_LIST * 4;
+    }
+    for (c = 0; c < o.channels.count; ++c) {
+        if (o.channels.values[c] > MAX_CHANNELS) o.channels.values[c] = MAX_CHANNELS;
+    }
+
+    //
+    if (o.json) printf("[\n");
+    else printf("test,transport,engine,size,channels,senders,receivers,frames,seconds,frames_per_sec,mb_per_sec,ok,p50_us,p99_us,p999_us\n");
+    for (latency = 0; latency < 2; ++latency) {
+        if (latency ? !o.latency : !o.throughput) continue;
+        for (t = 0; t < o.transportCount; ++t)
+        for (s = 0; s < o.sizes.count; ++s)
+        for (c = 0; c < o.channels.count; ++c)
+        for (x = 0; x < o.senders.count; ++x)
+        for (r = 0; r < o.receivers.count; ++r)
+            bench(&o, o.transports[t], latency, (int)o.sizes.values[s], (int)o.channels.values[c],
+                  (int)o.senders.values[x], (int)o.receivers.values[r]);
+    }
+    if (o.json) printf("\n]\n");
+    return 0;
+}
@@ -0,0 +1,407 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2013 Yannick Scherer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <multiplex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+// ----------------------------------------------------------------------
+//
+//   REPLAY
+//
+// ----------------------------------------------------------------------
+// Plays a trace written by 'multiplex_record' against the library: side
+// A (the multiplexer under test) sends the frames recorded as sent, side
+// B (its peer) sends the frames recorded as received, each at the time
+// it was recorded (scaled by --speed, 0 = as fast as possible). Both are
+// connected by a socketpair, and every channel is in frame mode:
+//
+//     replay --speed 10 --format json trace.mxtr
+//
+// Traces hold no payload: frames are filled with the time they were sent
+// (if at least 8 bytes long), which gives the latency of every frame.
+// Fragments are replayed as separate frames.
+
+typedef struct Record {
+    uint64_t at;             // ns since the trace started
+    unsigned int channelId;
+    int length;
+    int kind;                // MULTIPLEX_TRACE_RECEIVED or MULTIPLEX_TRACE_SENT
+} Record;
+
+typedef struct Options {
+    char const * path;
+    double speed;            // 1 = recorded timing, 0 = no delays
+    int engine;              // MULTIPLEX_ENGINE_*
+    int json;                // 1 = JSON, 0 = CSV
+} Options;
+
+typedef struct Trace {
+    Record * records;
+    long count;
+    long frames[2];          // frames per kind
+    long bytes[2];           // payload bytes per kind
+    int maxLength;           // longest payload
+    unsigned int maxChannel;
+} Trace;
+
+typedef struct Run {
+    Options const * options;
+    Trace const * trace;
+    Multiplex * a;           // under test
+    Multiplex * b;           // peer
+    int fds[2];              // fds to close
+    double start;            // when playing started (us)
+    long received[2];        // payload bytes received per kind
+    int done;                // 1 = receivers can stop
+    int failed;              // 1 = a thread saw an error or timeout
+    double * samples;        // one-way latencies in microseconds
+    long sampleCount;
+} Run;
+
+typedef struct Player {
+    Run * run;
+    int kind;                // records to play
+} Player;
+
+// ----------------------------------------------------------------------
+//
+//   UTILS
+//
+// ----------------------------------------------------------------------
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void sleep_until_us(double at) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)(at / 1e6);
+    ts.tv_nsec = (long)((at - ts.tv_sec * 1e6) * 1e3);
+    if (ts.tv_nsec >= 1000000000L) ts.tv_nsec = 999999999L;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR);
+}
+
+static int compare_double(void const * a, void const * b) {
+    double x = *(double const *)a, y = *(double const *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(double const * sorted, long count, double p) {
+    return count > 0 ? sorted[(long)((count - 1) * p)] : 0;
+}
+
+// ----------------------------------------------------------------------
+//
+//   TRACE
+//
+// ----------------------------------------------------------------------
+static int read_varint(FILE * f, uint64_t * value) {
+    int shift = 0, ch = 0;
+    *value = 0;
+    for (; shift < 64 && (ch = fgetc(f)) != EOF; shift += 7) {
+        *value |= (uint64_t)(ch & 0x7F) << shift;
+        if ((ch & 0x80) == 0) return 1;
+    }
+    return 0;
+}
+
+static int load_trace(Trace * t, char const * path) {
+    // returns 0 if the file cannot be read or is not a trace
+    FILE * f = fopen(path, "rb");
+    char header[5];
+    long capacity = 0;
+    uint64_t at = 0, delta = 0, id = 0, length = 0;
+    int kind = 0;
+    memset(t, 0, sizeof(Trace));
+    if (f == 0) return 0;
+    if (fread(header, 1, 5, f) != 5 || memcmp(header, "MXTR", 4) != 0 || header[4] != MULTIPLEX_TRACE_VERSION) {
+        fclose(f);
+        return 0;
+    }
+    while ((kind = fgetc(f)) != EOF) {
+        Record * r = 0;
+        if (!read_varint(f, &delta) || !read_varint(f, &id) || !read_varint(f, &length)) break;
+        if (id >= MULTIPLEX_MAX_CHANNELS || length >= INT_MAX - 8) break;
+        at += delta;
+        if (t->count == capacity) {
+            Record * records = (Record *)realloc(t->records, (capacity = capacity * 2 + 4096) * sizeof(Record));
+            if (records == 0) break;
+            t->records = records;
+        }
+        r = &(t->records[t->count++]);
+        r->at = at;
+        r->channelId = (unsigned int)id;
+        r->length = (int)length;
+        r->kind = (kind & MULTIPLEX_TRACE_SENT) ? MULTIPLEX_TRACE_SENT : MULTIPLEX_TRACE_RECEIVED;
+        ++t->frames[r->kind];
+        t->bytes[r->kind] += r->length;
+        if (r->length > t->maxLength) t->maxLength = r->length;
+        if (r->channelId > t->maxChannel) t->maxChannel = r->channelId;
+    }
+    fclose(f);
+    return 1;
+}
+
+// ----------------------------------------------------------------------
+//
+//   PLAYING
+//
+// ----------------------------------------------------------------------
+// Records of one kind are played by one thread, so frames of a channel
+// arrive in the recorded order. Receivers read every frame of whatever
+// channel 'select' reports until all payload bytes of their kind arrived.
+static void * play_thread(void * ptr) {
+    Player * p = (Player *)ptr;
+    Run * run = p->run;
+    Trace const * t = run->trace;
+    Multiplex * m = p->kind == MULTIPLEX_TRACE_SENT ? run->a : run->b;
+    int capacity = t->maxLength > 8 ? t->maxLength : 8;
+    char * payload = (char *)calloc(1, capacity);
+    long i = 0;
+    for (; payload != 0 && i < t->count && !__atomic_load_n(&(run->failed), __ATOMIC_RELAXED); ++i) {
+        Record const * r = &(t->records[i]);
+        double sent = 0;
+        if (r->kind != p->kind) continue;
+        if (run->options->speed > 0) sleep_until_us(run->start + r->at / 1e3 / run->options->speed);
+        sent = now_us();
+        if (r->length >= 8) memcpy(payload, &sent, sizeof(double));
+        if (multiplex_send(m, r->channelId, payload, r->length) < 0) {
+            __atomic_store_n(&(run->failed), 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&(run->done), 1, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    free(payload);
+    return 0;
+}
+
+static void * receive_thread(void * ptr) {
+    Player * p = (Player *)ptr;
+    Run * run = p->run;
+    Trace const * t = run->trace;
+    Multiplex * m = p->kind == MULTIPLEX_TRACE_SENT ? run->b : run->a;
+    long total = t->bytes[p->kind], * received = &(run->received[p->kind]);
+    int capacity = t->maxLength > 8 ? t->maxLength : 8;
+    char * buffer = (char *)malloc(capacity);
+    int idle = 0, n = 0;
+    while (buffer != 0 && __atomic_load_n(received, __ATOMIC_ACQUIRE) < total &&
+           !__atomic_load_n(&(run->done), __ATOMIC_ACQUIRE)) {
+        int ch = multiplex_select(m, 100);
+        if (ch == CHANNEL_CLOSED || (ch < 0 && ++idle > 100)) {
+            // closed, or nothing received for 10 seconds
+            __atomic_store_n(&(run->failed), 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&(run->done), 1, __ATOMIC_RELEASE);
+            break;
+        }
+        if (ch < 0) continue;
+        idle = 0;
+        while ((n = multiplex_read(m, ch, buffer, 0, capacity)) > 0) {
+            double arrived = now_us(), sent = 0;
+            if (n >= 8) {
+                memcpy(&sent, buffer, sizeof(double));
+                run->samples[__atomic_fetch_add(&(run->sampleCount), 1, __ATOMIC_RELAXED)] = arrived - sent;
+            }
+            __atomic_add_fetch(received, n, __ATOMIC_ACQ_REL);
+        }
+    }
+    free(buffer);
+    return 0;
+}
+
+static void * negotiate_thread(void * ptr) {
+    return (void *)(long)multiplex_negotiate((Multiplex *)ptr, 2000);
+}
+
+static int prepare(Run * run) {
+    // connect A and B, enable the channels each one receives on
+    Trace const * t = run->trace;
+    unsigned char * enabled = 0;
+    long i = 0;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, run->fds) != 0) return 0;
+    run->a = multiplex_new_engine(run->fds[0], run->options->engine);
+    run->b = multiplex_new(run->fds[1]);
+    if (run->a == 0 || run->b == 0) return 0;
+    if (t->maxChannel > 255) {
+        pthread_t thread;
+        void * peer = 0;
+        int version = 0;
+        pthread_create(&thread, 0, negotiate_thread, run->b);
+        version = multiplex_negotiate(run->a, 2000);
+        pthread_join(thread, &peer);
+        if (version < 2 || (long)peer < 2) return 0;
+    }
+    if ((enabled = (unsigned char *)calloc(2, t->maxChannel + 1)) == 0) return 0;
+    for (; i < t->count; ++i) {
+        Record const * r = &(t->records[i]);
+        Multiplex * target = r->kind == MULTIPLEX_TRACE_SENT ? run->b : run->a;
+        if (r->channelId == MULTIPLEX_CONTROL_CHANNEL && t->maxChannel > 255) break;
+        if (enabled[r->kind * (t->maxChannel + 1) + r->channelId]++ != 0) continue;
+        multiplex_enable(target, r->channelId, 0);
+        multiplex_enable_frames(target, r->channelId);
+    }
+    free(enabled);
+    return i == t->count;
+}
+
+// ----------------------------------------------------------------------
+//
+//   REPORT
+//
+// ----------------------------------------------------------------------
+static char const * engine_name(Multiplex * m) {
+    switch (multiplex_engine(m)) {
+        case MULTIPLEX_ENGINE_URING: return "uring";
+        case MULTIPLEX_ENGINE_SHM: return "shm";
+        default: return "poll";
+    }
+}
+
+static void report(Run const * run, double seconds) {
+    Options const * o = run->options;
+    Trace const * t = run->trace;
+    long frames = t->frames[0] + t->frames[1], bytes = t->bytes[0] + t->bytes[1];
+    double fps = seconds > 0 ? frames / seconds : 0;
+    double mbps = seconds > 0 ? bytes / seconds / 1e6 : 0;
+    double p50 = percentile(run->samples, run->sampleCount, 0.5);
+    double p99 = percentile(run->samples, run->sampleCount, 0.99);
+    double p999 = percentile(run->samples, run->sampleCount, 0.999);
+    MultiplexStats stats;
+    struct rusage usage;
+    memset(&stats, 0, sizeof(stats));
+    multiplex_stats_all(run->a, &stats);
+    getrusage(RUSAGE_SELF, &usage);
+    if (o->json) {
+        printf("[\n  {\"trace\": \"%s\", \"engine\": \"%s\", \"speed\": %g, \"frames_in\": %ld, \"frames_out\": %ld, "
+               "\"bytes\": %ld, \"seconds\": %.6f, \"frames_per_sec\": %.1f, \"mb_per_sec\": %.2f, \"ok\": %s, "
+               "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"buffer_high_water\": %llu, "
+               "\"pool_high_water\": %lu, \"max_rss_kb\": %ld}\n]\n",
+               o->path, engine_name(run->a), o->speed, t->frames[MULTIPLEX_TRACE_RECEIVED],
+               t->frames[MULTIPLEX_TRACE_SENT], bytes, seconds, fps, mbps, run->failed ? "false" : "true",
+               p50, p99, p999, (unsigned long long)stats.highWater,
+               (unsigned long)run->a->pool->highWater, usage.ru_maxrss);
+    }
+    else {
+        printf("trace,engine,speed,frames_in,frames_out,bytes,seconds,frames_per_sec,mb_per_sec,ok,"
+               "p50_us,p99_us,p999_us,buffer_high_water,pool_high_water,max_rss_kb\n");
+        printf("%s,%s,%g,%ld,%ld,%ld,%.6f,%.1f,%.2f,%d,%.1f,%.1f,%.1f,%llu,%lu,%ld\n",
+               o->path, engine_name(run->a), o->speed, t->frames[MULTIPLEX_TRACE_RECEIVED],
+               t->frames[MULTIPLEX_TRACE_SENT], bytes, seconds, fps, mbps, !run->failed,
+               p50, p99, p999, (unsigned long long)stats.highWater,
+               (unsigned long)run->a->pool->highWater, usage.ru_maxrss);
+    }
+    fflush(stdout);
+}
+
+// ----------------------------------------------------------------------
+//
+//   MAIN
+//
+// ----------------------------------------------------------------------
+static void usage(void) {
+    fprintf(stderr,
+        "usage: replay [options] TRACE\n"
+        "  --speed X          timing factor: 1 = as recorded, 10 = ten times faster,\n"
+        "                     0 = as fast as possible (default: 1)\n"
+        "  --engine NAME      poll or uring, for the multiplexer under test (default: poll)\n"
+        "  --format NAME      csv or json (default: csv)\n");
+}
+
+static int parse_options(Options * o, int argc, char * argv[]) {
+    int i = 1;
+    memset(o, 0, sizeof(Options));
+    o->speed = 1;
+    o->engine = MULTIPLEX_ENGINE_POLL;
+    for (; i + 1 < argc; i += 2) {
+        char const * name = argv[i], * value = argv[i + 1];
+        if (strcmp(name, "--speed") == 0) {
+            char * end = 0;
+            o->speed = strtod(value, &end);
+            if (end == value || *end != 0 || o->speed < 0) return 0;
+        }
+        else if (strcmp(name, "--engine") == 0)
+            o->engine = strcmp(value, "uring") == 0 ? MULTIPLEX_ENGINE_URING : MULTIPLEX_ENGINE_POLL;
+        else if (strcmp(name, "--format") == 0) o->json = strcmp(value, "json") == 0;
+        else return 0;
+    }
+    if (i + 1 != argc) return 0;
+    o->path = argv[i];
+    return 1;
+}
+
+int main(int argc, char * argv[]) {
+    Options o;
+    Trace t;
+    Run run;
+    pthread_t threads[4];
+    Player players[2];
+    double finished = 0;
+    int k = 0, ok = 0;
+    if (!parse_options(&o, argc, argv)) {
+        usage();
+        return 1;
+    }
+    if (!load_trace(&t, o.path)) {
+        fprintf(stderr, "replay: cannot read trace %s\n", o.path);
+        return 1;
+    }
+
+    //
+    memset(&run, 0, sizeof(run));
+    run.options = &o;
+    run.fds[0] = run.fds[1] = -1;
+    run.trace = &t;
+    run.samples = (double *)malloc((t.count > 0 ? t.count : 1) * sizeof(double));
+    ok = run.samples != 0 && prepare(&run);
+    if (!ok) fprintf(stderr, "replay: cannot set up the multiplexers\n");
+    else {
+        run.start = now_us();
+        for (k = 0; k < 2; ++k) {
+            players[k].run = &run;
+            players[k].kind = k;
+            pthread_create(&threads[k], 0, receive_thread, &players[k]);
+            pthread_create(&threads[2 + k], 0, play_thread, &players[k]);
+        }
+        for (k = 0; k < 4; ++k) pthread_join(threads[k], 0);
+        finished = now_us();
+        qsort(run.samples, run.sampleCount, sizeof(double), compare_double);
+        report(&run, (finished - run.start) / 1e6);
+    }
+
+    //
+    multiplex_free(run.a);
+    multiplex_free(run.b);
+    if (run.fds[0] >= 0) close(run.fds[0]);
+    if (run.fds[1] >= 0) close(run.fds[1]);
+    free(run.samples);
+    free(t.records);
+    return ok && !run.failed ? 0 : 1;
+}
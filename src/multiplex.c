@@ -23,10 +23,58 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <time.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#if defined(__linux__) && !defined(NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_EXT_ARG
+#define MULTIPLEX_URING
+#endif
+#endif
+#endif
+#if defined(__linux__) && !defined(NO_SHM) && defined(__has_include)
+#if __has_include(<linux/memfd.h>)
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+#ifdef SYS_memfd_create
+#define MULTIPLEX_SHM
+#endif
+#endif
+#endif
+#if defined(__linux__) && !defined(NO_SPLICE)
+#include <sys/syscall.h>
+#ifdef SYS_splice
+#define MULTIPLEX_SPLICE
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE     1
+#define SPLICE_F_NONBLOCK 2
+#endif
+#endif
+#endif
 #include "multiplex.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 // ----------------------------------------------------------------------
 //
 //   CONCEPT
@@ -36,7 +84,8 @@
 // descriptor. By prefixing a packet with 4 bytes of length (aligned
 // right, zero left-padded, includes length of channel ID) and a single 
 // byte containing the channel ID, we can reassemble the packet and
-// decide which channel it belongs to.
+// decide which channel it belongs to. Protocol v2 (negotiated with the
+// peer) uses a varint channel ID instead of the single byte.
 //
 // Channels have to be activated before use, creating a receive buffer
 // that is dynamically extended and reduced when needed. Using a
@@ -45,16 +94,82 @@
 //
 // Error and status codes (e.g. "data was received on a channel that
 // is not active") are negative, while channel IDs are positive or zero.
+//
+// In concurrent mode, the thread that happens to need data while no
+// one else is reading becomes the owner of the file descriptor. It
+// releases the mutex while blocked in 'select'/'read' and hands over
+// ownership once it has received a frame; all other receivers wait on
+// the condition variable of their channel (or on 'readable' if they
+// do not care about the channel).
 
 // ----------------------------------------------------------------------
 //
 //   UTILS
 //
 // ----------------------------------------------------------------------
+// -- STATISTICS
+// Almost every counter (including the lock histograms) is only updated
+// by the thread holding the mutex or the send mutex, so a relaxed load
+// and store suffices; others only read them. Buffer capacities also
+// shrink on the consumer side, which needs a real atomic add. Lock hold
+// times do not include time spent waiting on a condition variable.
+#ifndef NO_STATS
+#define _count(ptr, v)        __atomic_store_n((ptr), __atomic_load_n((ptr), __ATOMIC_RELAXED) + (v), __ATOMIC_RELAXED)
+#define _count_shared(ptr, v) __atomic_add_fetch((ptr), (v), __ATOMIC_RELAXED)
+#else
+#define _count(ptr, v)        ((void)0)
+#define _count_shared(ptr, v) ((void)0)
+#endif
+
+static uint64_t _now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+#if !defined(NO_STATS) && !defined(NO_MUTEX)
+
+static void _histogram_add(uint64_t * histogram, uint64_t ns) {
+    // bucket i counts durations below 2^i microseconds, the last one all longer ones
+    uint64_t us = ns / 1000;
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if (bucket >= MULTIPLEX_LOCK_BUCKETS) bucket = MULTIPLEX_LOCK_BUCKETS - 1;
+    _count(&(histogram[bucket]), 1);
+}
+
+static int _lock_measured(pthread_mutex_t * mutex, uint64_t * lockedAt, uint64_t * waitHistogram) {
+    // the clock is only read twice if the mutex is contended
+    uint64_t start = 0;
+    int r = pthread_mutex_trylock(mutex);
+    if (r == EBUSY) {
+        start = _now_ns();
+        r = pthread_mutex_lock(mutex);
+    }
+    if (r != 0) return r;
+    *lockedAt = _now_ns();
+    _histogram_add(waitHistogram, start != 0 ? *lockedAt - start : 0);
+    return 0;
+}
+
+static int _unlock_measured(pthread_mutex_t * mutex, uint64_t const * lockedAt, uint64_t * holdHistogram) {
+    _histogram_add(holdHistogram, _now_ns() - *lockedAt);
+    return pthread_mutex_unlock(mutex);
+}
+
+// -- around condition variable waits (which release the mutex)
+#define _hold_pause(c, lockedAt, hist) _histogram_add((c)->stats.hist, _now_ns() - (c)->lockedAt)
+#define _hold_resume(c, lockedAt)      ((c)->lockedAt = _now_ns())
+#else
+#define _hold_pause(c, lockedAt, hist) ((void)0)
+#define _hold_resume(c, lockedAt)      ((void)0)
+#endif
+
 // -- MUTEX
 static int multiplex_lock(Multiplex * c) {
     if (c == 0) return 1;
-#ifndef NO_MUTEX
+#if !defined(NO_MUTEX) && !defined(NO_STATS)
+    return _lock_measured(&(c->mutex), &(c->lockedAt), c->stats.lockWait);
+#elif !defined(NO_MUTEX)
     return pthread_mutex_lock(&(c->mutex));
 #else
     return 0;
@@ -63,414 +178,5186 @@ static int multiplex_lock(Multiplex * c) {
 
 static int multiplex_unlock(Multiplex * c) {
     if (c == 0) return 1;
-#ifndef NO_MUTEX
+#if !defined(NO_MUTEX) && !defined(NO_STATS)
+    return _unlock_measured(&(c->mutex), &(c->lockedAt), c->stats.lockHold);
+#elif !defined(NO_MUTEX)
     return pthread_mutex_unlock(&(c->mutex));
 #else
     return 0;
 #endif
 }
 
-static int multiplex_lock_channel(Multiplex * c, unsigned char channelId) {
+#ifndef NO_MUTEX
+static int multiplex_cond_init(pthread_cond_t * cond) {
+    pthread_condattr_t attr;
+    int r = pthread_condattr_init(&attr);
+    if (r != 0) return r;
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    r = pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+    return r;
+}
+#endif
+
+static int multiplex_lock_send(Multiplex * c) {
+    if (c == 0) return 1;
+#if !defined(NO_MUTEX) && !defined(NO_STATS)
+    return _lock_measured(&(c->sendMutex), &(c->sendLockedAt), c->stats.sendWait);
+#elif !defined(NO_MUTEX)
+    return pthread_mutex_lock(&(c->sendMutex));
+#else
+    return 0;
+#endif
+}
+
+static int multiplex_unlock_send(Multiplex * c) {
+    if (c == 0) return 1;
+#if !defined(NO_MUTEX) && !defined(NO_STATS)
+    return _unlock_measured(&(c->sendMutex), &(c->sendLockedAt), c->stats.sendHold);
+#elif !defined(NO_MUTEX)
+    return pthread_mutex_unlock(&(c->sendMutex));
+#else
+    return 0;
+#endif
+}
+
+static ChannelBuffer * _channel(Multiplex * c, unsigned int channelId);
+
+static int multiplex_lock_channel(Multiplex * c, unsigned int channelId) {
     // lock the Multiplex, but return 0 only if the given channel exists
     int r = multiplex_lock(c);
     if (r != 0) return r;
-    if (c->channels[channelId] == 0) {
+    if (_channel(c, channelId) == 0) {
         multiplex_unlock(c);
         return 1;
     }
     return 0;
 }
 
-// ----------------------------------------------------------------------
-//
-//   BASICS
-//
-// ----------------------------------------------------------------------
-// -- CREATE
-Multiplex * multiplex_new(int fd) {
-    Multiplex * m = (Multiplex *)calloc(1, sizeof(Multiplex));
-    if (m != 0) {
-        if (pthread_mutex_init(&(m->mutex), 0) != 0) {
-            free(m);
-            return 0;
-        }
-        m->fd = fd;
+// -- ATOMICS
+#define _load(ptr)       __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define _store(ptr, v)   __atomic_store_n((ptr), (v), __ATOMIC_RELEASE)
+#define _add(ptr, v)     __atomic_add_fetch((ptr), (v), __ATOMIC_ACQ_REL)
+
+// -- BIT SETS
+#define _bit_test(set, id)  (((set)[(id) >> 6] >> ((id) & 63)) & 1)
+#define _bit_set(set, id)   ((set)[(id) >> 6] |= (uint64_t)1 << ((id) & 63))
+#define _bit_clear(set, id) ((set)[(id) >> 6] &= ~((uint64_t)1 << ((id) & 63)))
+#define _bit_empty(set)     (((set)[0] | (set)[1] | (set)[2] | (set)[3]) == 0)
+
+static int _bit_first(uint64_t const * set, int from) {
+    // lowest index >= 'from' in a 256-bit set, or -1
+    int word = from >> 6;
+    uint64_t bits = 0;
+    if (from > 255) return -1;
+    bits = set[word] & (~(uint64_t)0 << (from & 63));
+    while (bits == 0) {
+        if (++word == 4) return -1;
+        bits = set[word];
     }
-    return m;
+    return (word << 6) + __builtin_ctzll(bits);
 }
 
-// -- ACTIVATE CHANNEL
-static void _enable_channel(Multiplex * c, unsigned char channelId, int initialBufferSize) {
-    if (c != 0 && channelId >= 0 && channelId <= 255 && c->channels[channelId] == 0) {
-        ChannelBuffer * buf = (ChannelBuffer *)calloc(1, sizeof(ChannelBuffer));
-        if (buf != 0) {
-            int size = initialBufferSize > 0 ? initialBufferSize : CHANNEL_INITIAL_BUFFER_SIZE;
-            char * stream = (char *)calloc(size, sizeof(char));
-            if (stream != 0) {
-                buf->data = stream;
-                buf->offset = 0;
-                buf->length = 0;
-                buf->initial = size;
-                buf->capacity = size;
-                c->channels[channelId] = buf;
-            }
-        }
+// -- TIME
+static void _deadline_us(struct timespec * ts, long timeoutUs) {
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += timeoutUs / 1000000L;
+    ts->tv_nsec += (timeoutUs % 1000000L) * 1000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec += 1;
+        ts->tv_nsec -= 1000000000L;
     }
 }
 
-void multiplex_enable(Multiplex * c, unsigned char channelId, int initialBufferSize) {
-    if (multiplex_lock(c) == 0) {
-        _enable_channel(c, channelId, initialBufferSize);
-        multiplex_unlock(c);
-    }
+static void _deadline(struct timespec * ts, int timeoutMs) {
+    _deadline_us(ts, (long)timeoutMs * 1000L);
 }
 
-void multiplex_enable_range(Multiplex * c, unsigned char minChannel, unsigned char maxChannel, int initialBufferSize) {
-    if (multiplex_lock(c) == 0) {
-        int i;
-        for (i = minChannel; i <= maxChannel; ++i) 
-            _enable_channel(c, i, initialBufferSize);
-        multiplex_unlock(c);
-    }
+static int _remaining_ms(struct timespec const * deadline) {
+    struct timespec now;
+    long ms;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (deadline->tv_sec - now.tv_sec) * 1000L + (deadline->tv_nsec - now.tv_nsec) / 1000000L;
+    return ms > 0 ? (int)ms : 0;
 }
 
-void multiplex_disable(Multiplex * c, unsigned char channelId) {
-    if (multiplex_lock_channel(c, channelId) == 0) {
-        ChannelBuffer * buf = c->channels[channelId];
-        if (buf->data != 0) free(buf->data);
-        free(buf);
-        c->channels[channelId] = 0;
-        multiplex_unlock(c);
-    }
+// -- WAKEUP
+// 'multiplex_wakeup' counts the call and writes to a pipe that the fd
+// owner polls along with the fd. Only the fd owner empties the pipe; it
+// returns CHANNEL_WAKEUP if it waits for a channel set ('wakeWatch') and
+// there was a call since it started ('wakeSeen'), and waits on otherwise.
+static int _wakeup_pending(Multiplex * c) {
+    return c->wakeWatch && _load(&(c->wakeups)) != c->wakeSeen;
+}
+
+static int _wakeup_drain(Multiplex * c) {
+    char bytes[64];
+    while (read(c->wakePipe[0], bytes, sizeof(bytes)) > 0) {}
+    return _wakeup_pending(c);
 }
 
 // ----------------------------------------------------------------------
 //
-//   REALLOCATION
+//   MEMORY POOL
 //
 // ----------------------------------------------------------------------
-// We double the buffer size if necessary, and we reduce it by at least
-// half if less than 25% is filled.
-static int _reallocate_channel(Multiplex * c, unsigned char channelId, int additionalDataSize) {
-    if (c == 0 || c->channels[channelId] == 0) return 0;
-    else {
-        ChannelBuffer * buf = c->channels[channelId];
-        char * tmpBuf = buf->data;
-        int newLen = buf->offset + buf->length + additionalDataSize;
-        int allocateLen = buf->capacity;
-
-        // Case 1: buffer is too empty (less than 25%)
-        if (allocateLen > newLen * 4) {
-            allocateLen = buf->initial;
-        } else {
-            // Case 2: buffer is big enough
-            if (allocateLen >= newLen) return 1;
-
-            // Case 3: move data within buffer (set offset to 0)
-            if (buf->capacity >= buf->length + additionalDataSize) {
-                if (buf->offset > 0) {
-                    int i = 0; 
-                    while (i < buf->length) {
-                        buf->data[i] = buf->data[buf->offset + i];
-                    }
-                    buf->offset = 0;
-                }
-                return 1;
-            }
-        }
+// Chunks are rounded up to a power of two (at least 64 bytes); sizes up
+// to 1 MiB are cached in one free list per size, larger ones go straight
+// to malloc. Callers pass the size of a chunk when releasing it, so no
+// header is needed. If a chunk would exceed the limit, cached chunks are
+// freed first; if that does not help, the allocation fails with errno
+// set to EAGAIN (might fit later) or ENOMEM (will never fit).
+static void _pool_lock(MultiplexPool * pool) {
+#ifndef NO_MUTEX
+    pthread_mutex_lock(&(pool->mutex));
+#endif
+}
 
-        // Case 4: extend buffer
-        while (allocateLen < newLen) allocateLen *= 2;
-        buf->data = (char *)calloc(allocateLen, sizeof(char));
-        if (buf->data == 0) { buf->data = tmpBuf; return 0; }
-        buf->capacity = allocateLen;
-        memcpy(buf->data, tmpBuf + buf->offset, buf->length);
-        free(tmpBuf);
-        return 1;
+static void _pool_unlock(MultiplexPool * pool) {
+#ifndef NO_MUTEX
+    pthread_mutex_unlock(&(pool->mutex));
+#endif
+}
+
+static int _pool_class(size_t * size) {
+    // size class of a chunk (rounding up 'size'), or -1 if it is not cached
+    size_t chunk = 64;
+    int k = 0;
+    while (chunk < *size && k < MULTIPLEX_POOL_CLASSES) {
+        chunk <<= 1;
+        ++k;
     }
+    if (k == MULTIPLEX_POOL_CLASSES) return -1;
+    *size = chunk;
+    return k;
 }
 
-// ----------------------------------------------------------------------
-//
-//   MODIFY BUFFER
-//
-// ----------------------------------------------------------------------
-static void _write_channel(Multiplex * c, unsigned char channelId, char * data, int offset, int length) {
-    if (_reallocate_channel(c, channelId, length)) {
-        ChannelBuffer * buf = c->channels[channelId];
-        if (buf != 0) {
-            memcpy(buf->data + buf->offset + buf->length, data + offset, length);
-            buf->length += length;
-            buf->newData = length;
+static void _pool_trim(MultiplexPool * pool, size_t needed) {
+    // free cached chunks until 'needed' more bytes fit into the limit
+    int k = MULTIPLEX_POOL_CLASSES - 1;
+    for (; k >= 0 && pool->used + pool->cachedBytes + needed > pool->limit; --k) {
+        while (pool->free[k] != 0 && pool->used + pool->cachedBytes + needed > pool->limit) {
+            void * chunk = pool->free[k];
+            pool->free[k] = *(void **)chunk;
+            --pool->cached[k];
+            pool->cachedBytes -= (size_t)64 << k;
+            free(chunk);
         }
     }
 }
 
-void multiplex_write(Multiplex * c, unsigned char channelId, char * data, int offset, int length) {
-    if (multiplex_lock_channel(c, channelId) == 0) {
-        _write_channel(c, channelId, data, offset, length);
-        multiplex_unlock(c);
+static void * _pool_acquire(MultiplexPool * pool, size_t size) {
+    void * chunk = 0;
+    int k = _pool_class(&size);
+    _pool_lock(pool);
+    if (k >= 0 && pool->free[k] != 0) {
+        chunk = pool->free[k];
+        pool->free[k] = *(void **)chunk;
+        --pool->cached[k];
+        pool->cachedBytes -= size;
+        pool->used += size;
+        _pool_unlock(pool);
+        return chunk;
     }
+    if (pool->limit > 0) {
+        if (size > pool->limit) {
+            _pool_unlock(pool);
+            errno = ENOMEM;
+            return 0;
+        }
+        _pool_trim(pool, size);
+        if (pool->used + pool->cachedBytes + size > pool->limit) {
+            _pool_unlock(pool);
+            errno = EAGAIN;
+            return 0;
+        }
+    }
+    chunk = malloc(size);
+    if (chunk != 0) {
+        pool->used += size;
+        if (pool->used + pool->cachedBytes > pool->highWater)
+            pool->highWater = pool->used + pool->cachedBytes;
+    }
+    _pool_unlock(pool);
+    if (chunk == 0) errno = ENOMEM;
+    return chunk;
 }
 
-static int _copy_channel(Multiplex * c, unsigned char channelId, char * dst, int offset, int length) {
-    ChannelBuffer * buf = c->channels[channelId];
-    int copyLen = length;
-    if (buf == 0) return CHANNEL_IGNORED;
-
-    //
-    if (buf->length < length) copyLen = buf->length;
-    memcpy(dst + offset, buf->data + buf->offset, copyLen);
-    return copyLen;
+static void _pool_release(MultiplexPool * pool, void * chunk, size_t size) {
+    int k = _pool_class(&size);
+    _pool_lock(pool);
+    pool->used -= size;
+    if (k >= 0 && (size_t)(pool->cached[k] + 1) * size <= MULTIPLEX_POOL_CACHE) {
+        *(void **)chunk = pool->free[k];
+        pool->free[k] = chunk;
+        ++pool->cached[k];
+        pool->cachedBytes += size;
+    }
+    else free(chunk);
+    ++pool->released;
+#ifndef NO_MUTEX
+    if (pool->waiters > 0) pthread_cond_broadcast(&(pool->available));
+#endif
+    _pool_unlock(pool);
 }
 
-int multiplex_copy(Multiplex * c, unsigned char channelId, char * dst, int offset, int length) {
-    if (multiplex_lock_channel(c, channelId) != 0) return -1;
-    else {
-        int r = _copy_channel(c, channelId, dst, offset, length);
-        multiplex_unlock(c);
-        return r;
+static int _pool_wait(MultiplexPool * pool, unsigned int released, struct timespec const * deadline) {
+    // wait until a chunk has been released since 'released' was read
+    int r = 0;
+#ifndef NO_MUTEX
+    _pool_lock(pool);
+    while (r == 0 && pool->released == released) {
+        ++pool->waiters;
+        r = pthread_cond_timedwait(&(pool->available), &(pool->mutex), deadline);
+        --pool->waiters;
     }
+    _pool_unlock(pool);
+#else
+    r = pool->released == released ? ETIMEDOUT : 0;
+#endif
+    return r == ETIMEDOUT ? CHANNEL_TIMEOUT : 0;
 }
 
-static int _read_channel(Multiplex * c, unsigned char channelId, char * dst, int offset, int length) {
-    ChannelBuffer * buf = c->channels[channelId];
-    int copyLen = length;
-    if (buf == 0) return CHANNEL_IGNORED;
-
-    //
-    if (buf->length < length) copyLen = buf->length;
-    memcpy(dst + offset, buf->data + buf->offset, copyLen);
-    buf->offset += copyLen;
-    buf->length -= copyLen;
-    buf->newData -= copyLen;
-    if (buf->newData < 0) buf->newData = 0;
-    return copyLen;
+static unsigned int _pool_released(MultiplexPool * pool) {
+    unsigned int released = 0;
+    _pool_lock(pool);
+    released = pool->released;
+    _pool_unlock(pool);
+    return released;
 }
 
-int multiplex_read(Multiplex * c, unsigned char channelId, char * dst, int offset, int length) {
-    if (multiplex_lock_channel(c, channelId) != 0) return CHANNEL_CLOSED;
-    else {
-        int r = _read_channel(c, channelId, dst, offset, length);
-        multiplex_unlock(c);
-        return r;
+MultiplexPool * multiplex_pool_new(size_t limit, int policy) {
+    MultiplexPool * pool = (MultiplexPool *)calloc(1, sizeof(MultiplexPool));
+    if (pool != 0) {
+#ifndef NO_MUTEX
+        if (pthread_mutex_init(&(pool->mutex), 0) != 0) {
+            free(pool);
+            return 0;
+        }
+        if (multiplex_cond_init(&(pool->available)) != 0) {
+            pthread_mutex_destroy(&(pool->mutex));
+            free(pool);
+            return 0;
+        }
+#endif
+        pool->limit = limit;
+        pool->policy = policy;
     }
+    return pool;
 }
 
-static void _clear_channel(Multiplex * c, unsigned char channelId) {
-    ChannelBuffer * buf = c->channels[channelId];
-    buf->offset = 0;
-    buf->length = 0;
-    buf->newData = 0;
+void multiplex_pool_free(MultiplexPool * pool) {
+    int k = 0;
+    if (pool == 0) return;
+    for (; k < MULTIPLEX_POOL_CLASSES; ++k) {
+        while (pool->free[k] != 0) {
+            void * chunk = pool->free[k];
+            pool->free[k] = *(void **)chunk;
+            free(chunk);
+        }
+    }
+#ifndef NO_MUTEX
+    pthread_cond_destroy(&(pool->available));
+    pthread_mutex_destroy(&(pool->mutex));
+#endif
+    free(pool);
 }
 
-void multiplex_clear(Multiplex * c, unsigned char channelId) {
-    if (multiplex_lock_channel(c, channelId) == 0) {
-        _clear_channel(c, channelId);
-        multiplex_unlock(c);
-    }
+size_t multiplex_pool_used(MultiplexPool * pool) {
+    size_t used = 0;
+    if (pool == 0) return 0;
+    _pool_lock(pool);
+    used = pool->used;
+    _pool_unlock(pool);
+    return used;
 }
 
 // ----------------------------------------------------------------------
-// 
-//   RECEIVE LOGIC
+//
+//   CHANNEL TABLE
 //
 // ----------------------------------------------------------------------
-static int _fd_read(int fd, int timeoutMs, char * buffer, int length) {
-    int position = 0, bytesRead = 0, selectResult = -1;
-    struct timeval timeout;
-    fd_set fds;
+// Nodes and leaves are only freed by 'multiplex_free', so looking up a
+// channel needs no lock. They are created by the receiving side (holding
+// the mutex) as well as by senders (for flow control), so new ones are
+// linked in using compare-and-swap. The bit sets are only modified while
+// holding the mutex; a node's bit is set iff the set is not empty below.
+#define _SET_ENABLED 0  // channels with a receive buffer
+#define _SET_READY   1  // channels with data not reported by 'select'
+#define _SET_QUEUED  2  // channels in 'readyQueue'
+#define _SET_WAITING 3  // channels with threads waiting on 'cond'
 
-    while (position < length) {
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-        timeout.tv_sec = timeoutMs / 1000;
-        timeout.tv_usec = (timeoutMs % 1000) * 1000;
+#define _top(id) (((id) >> 16) & 255)
+#define _mid(id) (((id) >> 8) & 255)
+#define _low(id) ((id) & 255)
 
-        selectResult = select(fd + 1, &fds, (fd_set *)0, (fd_set *)0, &timeout);
-        if (selectResult == 0) return CHANNEL_TIMEOUT;
+static ChannelLeaf * _leaf(Multiplex * c, unsigned int channelId) {
+    ChannelNode * node = _load(&(c->nodes[_top(channelId)]));
+    return node != 0 ? _load(&(node->leaves[_mid(channelId)])) : 0;
+}
 
-        if (FD_ISSET(fd,&fds)) {
-            bytesRead = read(fd, buffer + position, length - position);
-            if (bytesRead <= 0) return CHANNEL_CLOSED;
-            else position += bytesRead;
+static ChannelLeaf * _leaf_create(Multiplex * c, unsigned int channelId) {
+    ChannelNode * node = _load(&(c->nodes[_top(channelId)])), * otherNode = 0;
+    ChannelLeaf * leaf = 0, * otherLeaf = 0;
+    if (node == 0) {
+        node = (ChannelNode *)calloc(1, sizeof(ChannelNode));
+        if (node == 0) return 0;
+        if (!__atomic_compare_exchange_n(&(c->nodes[_top(channelId)]), &otherNode, node, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free(node);
+            node = otherNode;
+        }
+    }
+    leaf = _load(&(node->leaves[_mid(channelId)]));
+    if (leaf == 0) {
+        leaf = (ChannelLeaf *)calloc(1, sizeof(ChannelLeaf));
+        if (leaf == 0) return 0;
+        if (!__atomic_compare_exchange_n(&(node->leaves[_mid(channelId)]), &otherLeaf, leaf, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free(leaf);
+            leaf = otherLeaf;
         }
     }
-    return length;
+    return leaf;
 }
 
-static int _select_channel(Multiplex * c, int timeoutMs) {
-    char prefixBuffer[5];
-    int bytesRead = 0, dataLength = 0;
-    unsigned char channelId = 0;
+static ChannelBuffer * _channel(Multiplex * c, unsigned int channelId) {
+    ChannelLeaf * leaf = 0;
+    if (channelId >= MULTIPLEX_MAX_CHANNELS) return 0;
+    leaf = _leaf(c, channelId);
+    return leaf != 0 ? leaf->channels[_low(channelId)] : 0;
+}
 
-    //
-    if (c == 0) return CHANNEL_CLOSED;
+static Multiplex * _table(Multiplex * c) {
+    // the links of a bonded multiplexer dispatch into its channels
+    return c->bond != 0 ? c->bond : c;
+}
 
-    // Check if data is available somewhere
-    {
-        int i = 0;
-        ChannelBuffer * buf = 0;
-        for (; i < 256; ++i) {
-            buf = c->channels[i];
-            if (buf != 0 && buf->length > 0 && buf->newData != 0) {
-                buf->newData = 0;
-                return i;
-            }
-        }
+static void _table_free(Multiplex * c) {
+    int i = 0, j = 0;
+    for (; i < 256; ++i) {
+        if (c->nodes[i] == 0) continue;
+        for (j = 0; j < 256; ++j)
+            if (c->nodes[i]->leaves[j] != 0) free(c->nodes[i]->leaves[j]);
+        free(c->nodes[i]);
+        c->nodes[i] = 0;
     }
+}
 
-    //
-    bytesRead = _fd_read(c->fd, timeoutMs, prefixBuffer, 5); 
-    if (bytesRead != 5) return bytesRead;
+// -- SETS
+static int _set_test(Multiplex * c, int set, unsigned int channelId) {
+    ChannelLeaf * leaf = _leaf(c, channelId);
+    return leaf != 0 && _bit_test(leaf->sets[set], _low(channelId));
+}
 
-    //
-    dataLength = (prefixBuffer[0] << 24) | (prefixBuffer[1] << 16) | (prefixBuffer[2] << 8) | prefixBuffer[3];
-    channelId = (unsigned char)prefixBuffer[4];
-    {
-        char buffer[dataLength - 1];
-        bytesRead = _fd_read(c->fd, timeoutMs, buffer, dataLength - 1);
-        if (bytesRead != dataLength - 1) return bytesRead;
-        if (c->channels[channelId] == 0) return CHANNEL_IGNORED;
-        _write_channel(c, channelId, buffer, 0, dataLength - 1);
-    }
-    return channelId;
+static void _set_add(Multiplex * c, int set, unsigned int channelId) {
+    // the leaf of the channel has to exist
+    ChannelNode * node = c->nodes[_top(channelId)];
+    _bit_set(node->leaves[_mid(channelId)]->sets[set], _low(channelId));
+    _bit_set(node->sets[set], _mid(channelId));
+    _bit_set(c->sets[set], _top(channelId));
 }
 
-int multiplex_select(Multiplex * c, int timeoutMs) {
-    if (multiplex_lock(c) == 0) {
-        int r = _select_channel(c, timeoutMs);
-        multiplex_unlock(c);
-        return r;
+static void _set_remove(Multiplex * c, int set, unsigned int channelId) {
+    ChannelLeaf * leaf = _leaf(c, channelId);
+    ChannelNode * node = 0;
+    if (leaf == 0) return;
+    _bit_clear(leaf->sets[set], _low(channelId));
+    if (!_bit_empty(leaf->sets[set])) return;
+    node = c->nodes[_top(channelId)];
+    _bit_clear(node->sets[set], _mid(channelId));
+    if (_bit_empty(node->sets[set])) _bit_clear(c->sets[set], _top(channelId));
+}
+
+static int _set_first(Multiplex * c, int set, unsigned int from) {
+    // lowest channel ID >= 'from' in the set, or -1
+    int top = 0, mid = 0, low = 0;
+    if (from >= MULTIPLEX_MAX_CHANNELS) return -1;
+    for (top = _bit_first(c->sets[set], _top(from)); top >= 0; top = _bit_first(c->sets[set], top + 1)) {
+        ChannelNode * node = c->nodes[top];
+        int first = top == (int)_top(from);
+        for (mid = _bit_first(node->sets[set], first ? (int)_mid(from) : 0); mid >= 0;
+             mid = _bit_first(node->sets[set], mid + 1)) {
+            low = _bit_first(node->leaves[mid]->sets[set], first && mid == (int)_mid(from) ? (int)_low(from) : 0);
+            if (low >= 0) return (top << 16) | (mid << 8) | low;
+        }
     }
-    return CHANNEL_CLOSED;
+    return -1;
 }
 
-void multiplex_ignore(Multiplex * c, unsigned char channelId) {
-    if (multiplex_lock_channel(c, channelId) == 0) {
-        c->channels[channelId]->newData = 0;
-        multiplex_unlock(c);
+// -- STATISTICS
+// Send counters live in the leaf (a channel does not have to be enabled
+// to send on it), receive counters in the channel buffer.
+#ifndef NO_STATS
+static void _count_sent(Multiplex * c, unsigned int channelId, size_t length, int frames) {
+    // the send mutex has to be held
+    ChannelLeaf * leaf = _leaf_create(c, channelId);
+    if (leaf != 0) {
+        _count(&(leaf->framesOut[_low(channelId)]), frames);
+        _count(&(leaf->bytesOut[_low(channelId)]), length);
     }
+    _count(&(c->stats.framesOut), frames);
+    _count(&(c->stats.bytesOut), length);
 }
 
-static int _receive_channel(Multiplex * c,
-                            int timeoutMs,
-                            unsigned char channelId,
-                            char * dst,
-                            int offset,
-                            int length) {
-    int receiveId = CHANNEL_IGNORED;
-    ChannelBuffer * buf = 0;
-    if (c == 0) return CHANNEL_CLOSED;
-    buf = c->channels[channelId];
-    if (buf == 0) return CHANNEL_IGNORED;
+static void _count_received(Multiplex * c, unsigned int channelId, int length, int frames) {
+    // fragments only count as a frame once the last one arrived
+    ChannelBuffer * buf = _channel(c, channelId);
+    _count(&(buf->stats.frames), frames);
+    _count(&(buf->stats.bytes), length);
+    _count(&(c->stats.framesIn), frames);
+    _count(&(c->stats.bytesIn), length);
+}
 
-    // Check if data is already buffered.
-    if (buf->length > 0) {
-        if (length <= buf->length) {
-            memcpy(dst + offset, buf->data + buf->offset, length);
-            buf->offset += length;
-            buf->length -= length;
-            return length;
-        } else {
-            int tmpLen = buf->length;
-            memcpy(dst + offset, buf->data + buf->offset, tmpLen);
-            buf->offset = 0;
-            buf->length = 0;
-            return tmpLen;
-        }
-    }
-
-    // Receive on the given Channel
-    receiveId = _select_channel(c, timeoutMs);
-    if (receiveId < 0) return receiveId;
-    if (receiveId != channelId) return CHANNEL_IGNORED;
+static void _count_dropped(Multiplex * c, unsigned int channelId) {
+    ChannelBuffer * buf = _channel(c, channelId);
+    if (buf != 0) {
+        _count(&(buf->stats.dropped), 1);
+        _count(&(c->stats.dropped), 1);
+    }
+    else _count(&(c->stats.ignored), 1);
+}
 
-    // Copy from ChannelBuffer
-    return _read_channel(c, channelId, dst, offset, length);
+static void _count_timeout(Multiplex * c, unsigned int channelId) {
+    ChannelBuffer * buf = _channel(c, channelId);
+    if (buf != 0) _count(&(buf->stats.timeouts), 1);
+    _count(&(c->stats.timeouts), 1);
 }
 
-int multiplex_receive(Multiplex * c,
-                      int timeoutMs,
-                      unsigned char channelId,
-                      char * dst,
-                      int offset,
-                      int length) {
-    if (multiplex_lock(c) == 0) {
-        int r = _receive_channel(c, timeoutMs, channelId, dst, offset, length);
-        multiplex_unlock(c);
-        return r;
-    }
-    return CHANNEL_CLOSED;
+static void _count_capacity(ChannelBuffer * buf, long delta) {
+    // capacity only grows on the producer side (holding the mutex)
+    uint64_t capacity = _count_shared(&(buf->stats.capacity), (uint64_t)delta);
+    uint64_t total = _count_shared(&(buf->total->capacity), (uint64_t)delta);
+    if (delta <= 0) return;
+    if (capacity > buf->stats.highWater) __atomic_store_n(&(buf->stats.highWater), capacity, __ATOMIC_RELAXED);
+    if (total > buf->total->highWater) __atomic_store_n(&(buf->total->highWater), total, __ATOMIC_RELAXED);
 }
+#else
+#define _count_sent(c, channelId, length, frames)     ((void)0)
+#define _count_received(c, channelId, length, frames) ((void)0)
+#define _count_dropped(c, channelId)                  ((void)0)
+#define _count_timeout(c, channelId)                  ((void)0)
+#define _count_capacity(buf, delta)                   ((void)0)
+#endif
+#define _count_realloc(buf) (_count(&((buf)->stats.reallocs), 1), _count(&((buf)->total->reallocs), 1))
 
 // ----------------------------------------------------------------------
 //
-//   SEND LOGIC
+//   TRAFFIC CAPTURE
 //
 // ----------------------------------------------------------------------
-int multiplex_send(Multiplex * c, unsigned char channelId, char const * src, int length) {
-    if (src == 0 || multiplex_lock(c) != 0) return -1;
-    else {
-        int len = length + 1;
-        char buffer[5 + length];
-        buffer[0] = (char)((len >> 24) & 0xFF);
-        buffer[1] = (char)((len >> 16) & 0xFF);
-        buffer[2] = (char)((len >> 8) & 0xFF);
-        buffer[3] = (char)(len & 0xFF);
-        buffer[4] = (char)(channelId & 0xFF);
-        memcpy(buffer + 5, src, length);
-        len = write(c->fd, buffer, 5 + length);
-        multiplex_unlock(c);
-        return len;
-    }
-} 
+// Records are appended to the active buffer under the recorder's mutex
+// (senders and the receiving thread record concurrently). The writer
+// thread swaps in the spare buffer once the active one is half full, or
+// every 100 ms, and writes the full one while records go to the other.
+// If the active buffer is full while the spare one is being written, the
+// record is dropped. With NO_MUTEX, a full buffer is written right away.
+typedef struct MultiplexRecorder {
+    int fd;              // trace file
+    char * buffer;       // records not written yet
+    int length;          // bytes in 'buffer'
+    char * spare;        // empty buffer (0 while the writer uses it)
+    uint64_t last;       // time of the previous record (ns)
+    int dropped;         // records that did not fit
+#ifndef NO_MUTEX
+    pthread_mutex_t mutex;  // protects everything above but 'fd'
+    pthread_cond_t wake;    // wakes the writer thread
+    pthread_t thread;       // writes full buffers
+    int running;            // 1 = 'thread' has to go on
+#endif
+} MultiplexRecorder;
 
-int multiplex_send_string(Multiplex * c, unsigned char channelId, char const * str) {
-    if (str == 0) return -1;
-    return multiplex_send(c, channelId, str, strlen(str));
+static int _trace_varint(unsigned char * p, uint64_t value) {
+    int n = 0;
+    for (; value >= 0x80; value >>= 7) p[n++] = (unsigned char)(value | 0x80);
+    p[n++] = (unsigned char)value;
+    return n;
 }
 
-// ----------------------------------------------------------------------
-//
-//   BUFFER INSPECTION
-//
-// ----------------------------------------------------------------------
-int multiplex_length(Multiplex * c, unsigned char channelId) {
-    if (multiplex_lock_channel(c, channelId)) return -1;
-    else {
-        int r = c->channels[channelId]->length;
-        multiplex_unlock(c);
-        return r;
+static void _trace_write(int fd, char const * data, int length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return;
+        data += written;
+        length -= (int)written;
     }
 }
 
-int multiplex_last_received(Multiplex * c, unsigned char channelId) {
-    if (multiplex_lock_channel(c, channelId)) return 0;
+static void _trace(Multiplex * c, int kind, unsigned int channelId, unsigned long length) {
+    MultiplexRecorder * r = c->recorder;
+    unsigned char record[32];
+    int n = 1;
+    uint64_t now = 0;
+    if (r == 0) return;
+    record[0] = (unsigned char)kind;
+#ifndef NO_MUTEX
+    pthread_mutex_lock(&(r->mutex));
+#endif
+    now = _now_ns();
+    n += _trace_varint(record + n, now - r->last);
+    n += _trace_varint(record + n, channelId);
+    n += _trace_varint(record + n, length);
+#ifdef NO_MUTEX
+    if (r->length + n > MULTIPLEX_TRACE_BUFFER) {
+        _trace_write(r->fd, r->buffer, r->length);
+        r->length = 0;
+    }
+#endif
+    if (r->length + n > MULTIPLEX_TRACE_BUFFER) ++r->dropped;
     else {
-        int r = c->channels[channelId]->newData;
-        multiplex_unlock(c);
-        return r;
+        memcpy(r->buffer + r->length, record, n);
+        r->length += n;
+        r->last = now;
     }
+#ifndef NO_MUTEX
+    if (r->length >= MULTIPLEX_TRACE_BUFFER / 2 && r->spare != 0) pthread_cond_signal(&(r->wake));
+    pthread_mutex_unlock(&(r->mutex));
+#endif
 }
 
-char const * multiplex_get(Multiplex * c, unsigned char channelId) {
-    if (multiplex_lock_channel(c, channelId) != 0) return 0;
-    else {
-        ChannelBuffer * buf = c->channels[channelId];
-        char const * ptr = buf->data + buf->offset;
-        multiplex_unlock(c);
-        return ptr;
+#ifndef NO_MUTEX
+static void * _recorder_thread(void * ptr) {
+    MultiplexRecorder * r = (MultiplexRecorder *)ptr;
+    struct timespec deadline;
+    pthread_mutex_lock(&(r->mutex));
+    while (r->running || r->length > 0) {
+        if (r->running && r->length < MULTIPLEX_TRACE_BUFFER / 2) {
+            _deadline(&deadline, 100);
+            pthread_cond_timedwait(&(r->wake), &(r->mutex), &deadline);
+        }
+        if (r->length > 0) {
+            char * full = r->buffer;
+            int length = r->length;
+            r->buffer = r->spare;
+            r->spare = 0;
+            r->length = 0;
+            pthread_mutex_unlock(&(r->mutex));
+            _trace_write(r->fd, full, length);
+            pthread_mutex_lock(&(r->mutex));
+            r->spare = full;
+        }
     }
+    pthread_mutex_unlock(&(r->mutex));
+    return 0;
 }
+#endif
 
-char * multiplex_strdup(Multiplex * c, unsigned char channelId) {
-    if (multiplex_lock_channel(c, channelId) != 0) return 0;
-    else {
-        ChannelBuffer * buf = c->channels[channelId];
-        char * tmp = (char *)calloc(buf->length + 1, sizeof(char));
-        if (tmp != 0) memcpy(tmp, buf->data + buf->offset, buf->length);
-        multiplex_unlock(c);
-        return tmp;
-    }
+static int _recorder_stop(MultiplexRecorder * r) {
+    // writes what is left; returns the number of dropped records
+    int dropped = 0;
+    if (r == 0) return 0;
+#ifndef NO_MUTEX
+    pthread_mutex_lock(&(r->mutex));
+    r->running = 0;
+    pthread_cond_signal(&(r->wake));
+    pthread_mutex_unlock(&(r->mutex));
+    pthread_join(r->thread, 0);
+    pthread_cond_destroy(&(r->wake));
+    pthread_mutex_destroy(&(r->mutex));
+#else
+    _trace_write(r->fd, r->buffer, r->length);
+#endif
+    dropped = r->dropped;
+    close(r->fd);
+    free(r->buffer);
+    free(r->spare);
+    free(r);
+    return dropped;
+}
+
+static MultiplexRecorder * _recorder_new(char const * path) {
+    MultiplexRecorder * r = (MultiplexRecorder *)calloc(1, sizeof(MultiplexRecorder));
+    char header[5] = { 'M', 'X', 'T', 'R', MULTIPLEX_TRACE_VERSION };
+    if (r == 0) return 0;
+    r->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    r->buffer = (char *)malloc(MULTIPLEX_TRACE_BUFFER);
+    r->spare = (char *)malloc(MULTIPLEX_TRACE_BUFFER);
+    if (r->fd < 0 || r->buffer == 0 || r->spare == 0) {
+        if (r->fd >= 0) close(r->fd);
+        free(r->buffer);
+        free(r->spare);
+        free(r);
+        return 0;
+    }
+    memcpy(r->buffer, header, sizeof(header));
+    r->length = sizeof(header);
+    r->last = _now_ns();
+#ifndef NO_MUTEX
+    if (pthread_mutex_init(&(r->mutex), 0) != 0) r->running = -1;
+    else if (multiplex_cond_init(&(r->wake)) != 0) {
+        pthread_mutex_destroy(&(r->mutex));
+        r->running = -1;
+    }
+    else {
+        r->running = 1;
+        if (pthread_create(&(r->thread), 0, &_recorder_thread, r) != 0) {
+            pthread_cond_destroy(&(r->wake));
+            pthread_mutex_destroy(&(r->mutex));
+            r->running = -1;
+        }
+    }
+    if (r->running < 0) {
+        close(r->fd);
+        free(r->buffer);
+        free(r->spare);
+        free(r);
+        return 0;
+    }
+#endif
+    return r;
+}
+
+int multiplex_record(Multiplex * c, char const * path) {
+    // a running recorder is replaced (its dropped records are not reported)
+    MultiplexRecorder * r = 0, * previous = 0;
+    int dropped = 0;
+    if (c == 0) return -1;
+    if (path != 0 && (r = _recorder_new(path)) == 0) return -1;
+    multiplex_lock(c);
+    multiplex_lock_send(c);
+    previous = c->recorder;
+    c->recorder = r;
+    multiplex_unlock_send(c);
+    multiplex_unlock(c);
+    dropped = _recorder_stop(previous);
+    return path != 0 ? 0 : dropped;
+}
+
+// ----------------------------------------------------------------------
+//
+//   BASICS
+//
+// ----------------------------------------------------------------------
+// -- CREATE
+Multiplex * multiplex_new(int fd) {
+    Multiplex * m = (Multiplex *)calloc(1, sizeof(Multiplex));
+    if (m != 0) {
+#ifndef NO_MUTEX
+        if (pthread_mutex_init(&(m->mutex), 0) != 0) {
+            free(m);
+            return 0;
+        }
+        if (pthread_mutex_init(&(m->sendMutex), 0) != 0) {
+            pthread_mutex_destroy(&(m->mutex));
+            free(m);
+            return 0;
+        }
+        if (multiplex_cond_init(&(m->readable)) != 0) {
+            pthread_mutex_destroy(&(m->sendMutex));
+            pthread_mutex_destroy(&(m->mutex));
+            free(m);
+            return 0;
+        }
+        if (pthread_mutex_init(&(m->writeMutex), 0) != 0) {
+            pthread_cond_destroy(&(m->readable));
+            pthread_mutex_destroy(&(m->sendMutex));
+            pthread_mutex_destroy(&(m->mutex));
+            free(m);
+            return 0;
+        }
+        if (multiplex_cond_init(&(m->txCond)) != 0) {
+            pthread_mutex_destroy(&(m->writeMutex));
+            pthread_cond_destroy(&(m->readable));
+            pthread_mutex_destroy(&(m->sendMutex));
+            pthread_mutex_destroy(&(m->mutex));
+            free(m);
+            return 0;
+        }
+        if (multiplex_cond_init(&(m->controlCond)) != 0) {
+            pthread_cond_destroy(&(m->txCond));
+            pthread_mutex_destroy(&(m->writeMutex));
+            pthread_cond_destroy(&(m->readable));
+            pthread_mutex_destroy(&(m->sendMutex));
+            pthread_mutex_destroy(&(m->mutex));
+            free(m);
+            return 0;
+        }
+        if (pthread_mutex_init(&(m->schedMutex), 0) != 0) {
+            pthread_cond_destroy(&(m->controlCond));
+            pthread_cond_destroy(&(m->txCond));
+            pthread_mutex_destroy(&(m->writeMutex));
+            pthread_cond_destroy(&(m->readable));
+            pthread_mutex_destroy(&(m->sendMutex));
+            pthread_mutex_destroy(&(m->mutex));
+            free(m);
+            return 0;
+        }
+        if (pthread_mutex_init(&(m->pinMutex), 0) != 0) {
+            pthread_mutex_destroy(&(m->schedMutex));
+            pthread_cond_destroy(&(m->controlCond));
+            pthread_cond_destroy(&(m->txCond));
+            pthread_mutex_destroy(&(m->writeMutex));
+            pthread_cond_destroy(&(m->readable));
+            pthread_mutex_destroy(&(m->sendMutex));
+            pthread_mutex_destroy(&(m->mutex));
+            free(m);
+            return 0;
+        }
+#endif
+        m->pool = multiplex_pool_new(0, MULTIPLEX_POOL_REJECT);
+        if (m->pool == 0) {
+#ifndef NO_MUTEX
+            pthread_mutex_destroy(&(m->pinMutex));
+            pthread_mutex_destroy(&(m->schedMutex));
+            pthread_cond_destroy(&(m->controlCond));
+            pthread_cond_destroy(&(m->txCond));
+            pthread_mutex_destroy(&(m->writeMutex));
+            pthread_cond_destroy(&(m->readable));
+            pthread_mutex_destroy(&(m->sendMutex));
+            pthread_mutex_destroy(&(m->mutex));
+#endif
+            free(m);
+            return 0;
+        }
+        m->ownPool = 1;
+        m->fd = fd;
+        m->readyLast = MULTIPLEX_MAX_CHANNELS - 1;
+        m->rxVersion = 1;
+        m->txVersion = 1;
+        m->maxVersion = 1;
+        m->peerVersion = 1;
+        m->forwardFd = -1;
+        m->forwardPipe[0] = m->forwardPipe[1] = -1;
+        m->wakePipe[0] = m->wakePipe[1] = -1;
+    }
+    return m;
+}
+
+static void _disable_channel(Multiplex * c, unsigned int channelId);
+#ifndef NO_MUTEX
+static void _stop_flusher(Multiplex * c);
+#endif
+static void _queued_free(Multiplex * c);
+#ifdef MULTIPLEX_URING
+static void _uring_free(struct MultiplexUring * u);
+#endif
+#ifdef MULTIPLEX_SHM
+static void _shm_free(struct MultiplexShm * s);
+#endif
+
+void multiplex_free(Multiplex * c) {
+    int i = 0;
+    if (c == 0) return;
+    multiplex_stop_workers(c);
+    while ((i = _set_first(c, _SET_ENABLED, 0)) >= 0) _disable_channel(c, i);
+    _table_free(c);
+    if (c->links != 0) {
+        for (i = 0; i < c->linkCount; ++i) multiplex_free(c->links[i]);
+        free(c->links);
+        if (c->fd >= 0) close(c->fd);
+    }
+    if (c->readyQueue != 0) free(c->readyQueue);
+    if (c->rx != 0) free(c->rx);
+    if (c->forwardPipe[0] >= 0) close(c->forwardPipe[0]);
+    if (c->forwardPipe[1] >= 0) close(c->forwardPipe[1]);
+    if (c->wakePipe[0] >= 0) close(c->wakePipe[0]);
+    if (c->wakePipe[1] >= 0) close(c->wakePipe[1]);
+    multiplex_lock_send(c);
+    _queued_free(c);
+    _recorder_stop(c->recorder);
+    c->recorder = 0;
+#ifndef NO_MUTEX
+    _stop_flusher(c);
+#endif
+    multiplex_unlock_send(c);
+#ifdef MULTIPLEX_URING
+    _uring_free(c->uring);
+#endif
+#ifdef MULTIPLEX_SHM
+    _shm_free(c->shm);
+#endif
+#ifndef NO_MUTEX
+    pthread_mutex_destroy(&(c->pinMutex));
+    pthread_mutex_destroy(&(c->schedMutex));
+    pthread_cond_destroy(&(c->controlCond));
+    pthread_cond_destroy(&(c->txCond));
+    pthread_mutex_destroy(&(c->writeMutex));
+    pthread_cond_destroy(&(c->readable));
+    pthread_mutex_destroy(&(c->sendMutex));
+    pthread_mutex_destroy(&(c->mutex));
+#endif
+    if (c->ownPool) multiplex_pool_free(c->pool);
+    free(c);
+}
+
+int multiplex_set_pool(Multiplex * c, MultiplexPool * pool) {
+    if (pool == 0 || multiplex_lock(c) != 0) return -1;
+    if (_set_first(c, _SET_ENABLED, 0) >= 0) {
+        multiplex_unlock(c);
+        return -1;
+    }
+    if (c->ownPool) multiplex_pool_free(c->pool);
+    c->pool = pool;
+    c->ownPool = 0;
+    multiplex_unlock(c);
+    return 0;
+}
+
+void multiplex_set_concurrent(Multiplex * c, int enabled) {
+#ifndef NO_MUTEX
+    if (multiplex_lock(c) == 0) {
+        c->concurrent = enabled ? 1 : 0;
+        multiplex_unlock(c);
+    }
+#endif
+}
+
+int multiplex_set_flow_control(Multiplex * c, int windowBytes) {
+    int i = -1, j = 0;
+    if (windowBytes < 0 || multiplex_lock(c) != 0) return -1;
+    if (windowBytes > 0 && _channel(c, MULTIPLEX_CONTROL_CHANNEL) != 0) {
+        multiplex_unlock(c);
+        return -1;
+    }
+    if (windowBytes > 0) c->control = 1;
+    c->window = windowBytes;
+    for (i = 0; i < 256; ++i) {
+        if (c->nodes[i] == 0) continue;
+        for (j = 0; j < 256; ++j)
+            if (c->nodes[i]->leaves[j] != 0) memset(c->nodes[i]->leaves[j]->used, 0, sizeof(c->nodes[i]->leaves[j]->used));
+    }
+    i = -1;
+    while ((i = _set_first(c, _SET_ENABLED, i + 1)) >= 0) _channel(c, i)->consumed = 0;
+    multiplex_unlock(c);
+    return 0;
+}
+
+// -- ACTIVATE CHANNEL
+static void _channel_init(ChannelBuffer * buf);
+static void _channel_destroy(ChannelBuffer * buf);
+static int _frames_init(ChannelBuffer * buf);
+static void _frames_destroy(ChannelBuffer * buf);
+
+static void _enable_channel(Multiplex * c, unsigned int channelId, int initialBufferSize) {
+    ChannelLeaf * leaf = 0;
+    if (c == 0 || channelId >= MULTIPLEX_MAX_CHANNELS) return;
+    if (c->control && channelId == MULTIPLEX_CONTROL_CHANNEL) return;
+    leaf = _leaf_create(c, channelId);
+    if (leaf != 0 && leaf->channels[_low(channelId)] == 0) {
+        ChannelBuffer * buf = (ChannelBuffer *)calloc(1, sizeof(ChannelBuffer));
+        if (buf != 0) {
+            int size = initialBufferSize > 0 ? initialBufferSize : CHANNEL_INITIAL_BUFFER_SIZE;
+            int ok = 1;
+            buf->pool = c->pool;
+#ifndef NO_STATS
+            buf->total = &(c->stats);
+#endif
+            _channel_init(buf);
+#ifndef NO_MUTEX
+            if (ok && multiplex_cond_init(&(buf->cond)) != 0) {
+                _channel_destroy(buf);
+                ok = 0;
+            }
+#ifndef CHANNEL_MUTEX
+            if (ok && pthread_mutex_init(&(buf->lock), 0) != 0) {
+                pthread_cond_destroy(&(buf->cond));
+                _channel_destroy(buf);
+                ok = 0;
+            }
+#endif
+#endif
+            if (!ok) free(buf);
+            else {
+                buf->length = 0;
+                buf->id = channelId;
+                buf->initial = size;
+                buf->forward = -1;
+#if !defined(NO_MUTEX) && !defined(CHANNEL_MUTEX)
+                pthread_mutex_lock(&(c->pinMutex));
+                leaf->channels[_low(channelId)] = buf;
+                pthread_mutex_unlock(&(c->pinMutex));
+#else
+                leaf->channels[_low(channelId)] = buf;
+#endif
+                _set_add(c, _SET_ENABLED, channelId);
+            }
+        }
+    }
+}
+
+void multiplex_enable(Multiplex * c, unsigned int channelId, int initialBufferSize) {
+    if (multiplex_lock(c) == 0) {
+        _enable_channel(c, channelId, initialBufferSize);
+        multiplex_unlock(c);
+    }
+}
+
+void multiplex_enable_range(Multiplex * c, unsigned int minChannel, unsigned int maxChannel, int initialBufferSize) {
+    if (multiplex_lock(c) == 0) {
+        unsigned int i;
+        if (maxChannel >= MULTIPLEX_MAX_CHANNELS) maxChannel = MULTIPLEX_MAX_CHANNELS - 1;
+        for (i = minChannel; i <= maxChannel; ++i) 
+            _enable_channel(c, i, initialBufferSize);
+        multiplex_unlock(c);
+    }
+}
+
+static void _free_channel(ChannelBuffer * buf) {
+    _channel_destroy(buf);
+    _frames_destroy(buf);
+#ifndef NO_MUTEX
+#ifndef CHANNEL_MUTEX
+    pthread_mutex_destroy(&(buf->lock));
+#endif
+    pthread_cond_destroy(&(buf->cond));
+#endif
+    free(buf);
+}
+
+static void _disable_channel(Multiplex * c, unsigned int channelId) {
+    // consumers may still use the buffer (see 'multiplex_lock_consumer')
+    ChannelBuffer * buf = _channel(c, channelId);
+    int users = 0;
+#if !defined(NO_MUTEX) && !defined(CHANNEL_MUTEX)
+    pthread_mutex_lock(&(c->pinMutex));
+    _leaf(c, channelId)->channels[_low(channelId)] = 0;
+    users = buf->users;
+    _store(&(buf->disabled), 1);
+    pthread_mutex_unlock(&(c->pinMutex));
+#else
+    _leaf(c, channelId)->channels[_low(channelId)] = 0;
+#endif
+    if (users == 0) _free_channel(buf);
+    _set_remove(c, _SET_ENABLED, channelId);
+    _set_remove(c, _SET_READY, channelId);
+    _set_remove(c, _SET_WAITING, channelId);
+}
+
+void multiplex_disable(Multiplex * c, unsigned int channelId) {
+    if (multiplex_lock_channel(c, channelId) == 0) {
+        _disable_channel(c, channelId);
+        multiplex_unlock(c);
+    }
+}
+
+// ----------------------------------------------------------------------
+//
+//   CHANNEL BUFFERS
+//
+// ----------------------------------------------------------------------
+// Every implementation provides the same operations: 'put' is only
+// called by the producer (holding the Multiplex mutex), 'take' and
+// 'linear' only by consumers (holding the channel's consumer lock).
+#define _channel_length(buf) _load(&((buf)->length))
+
+#ifdef CHANNEL_MUTEX
+// We double the buffer size if necessary, and we halve it (down to the
+// initial size) once less than 25% has been used for a while.
+static int _reallocate_channel(ChannelBuffer * buf, int additionalDataSize) {
+    char * tmpBuf = buf->data;
+    int newLen = buf->offset + buf->length + additionalDataSize;
+    int allocateLen = buf->capacity;
+
+    // Case 1: buffer has been too empty (less than 25%) for some time
+    if (allocateLen > newLen * 4 && allocateLen > buf->initial) {
+        if (++buf->idle >= MULTIPLEX_SHRINK_DELAY) {
+            allocateLen /= 2;
+            if (allocateLen < buf->initial) allocateLen = buf->initial;
+        }
+    } else buf->idle = 0;
+
+    if (allocateLen == buf->capacity && tmpBuf != 0) {
+        // Case 2: buffer is big enough
+        if (allocateLen >= newLen) return 1;
+
+        // Case 3: move data within buffer (set offset to 0)
+        if (buf->capacity >= buf->length + additionalDataSize) {
+            if (buf->offset > 0) {
+                memmove(buf->data, buf->data + buf->offset, buf->length);
+                buf->offset = 0;
+            }
+            return 1;
+        }
+    }
+
+    // Case 4: (re)allocate buffer
+    if (allocateLen < buf->initial) allocateLen = buf->initial;
+    while (allocateLen < buf->length + additionalDataSize) allocateLen *= 2;
+    buf->data = (char *)_pool_acquire(buf->pool, allocateLen);
+    if (buf->data == 0) { buf->data = tmpBuf; return 0; }
+    if (tmpBuf != 0) {
+        memcpy(buf->data, tmpBuf + buf->offset, buf->length);
+        _pool_release(buf->pool, tmpBuf, buf->capacity);
+    }
+    _count_capacity(buf, (long)allocateLen - buf->capacity);
+    _count_realloc(buf);
+    buf->capacity = allocateLen;
+    buf->offset = 0;
+    buf->idle = 0;
+    return 1;
+}
+
+static void _channel_init(ChannelBuffer * buf) {
+    buf->data = 0;
+    buf->offset = 0;
+    buf->capacity = 0;
+}
+
+static void _channel_destroy(ChannelBuffer * buf) {
+    if (buf->data != 0) _pool_release(buf->pool, buf->data, buf->capacity);
+    _count_capacity(buf, -(long)buf->capacity);
+    buf->data = 0;
+    buf->capacity = 0;
+}
+
+static int _stream_put(ChannelBuffer * buf, char const * data, int length) {
+    if (!_reallocate_channel(buf, length)) return 0;
+    memcpy(buf->data + buf->offset + buf->length, data, length);
+    buf->length += length;
+    return 1;
+}
+
+static int _stream_take(ChannelBuffer * buf, char * dst, int length, int consume) {
+    int copyLen = length;
+    if (buf->length < length) copyLen = buf->length;
+    if (dst != 0) memcpy(dst, buf->data + buf->offset, copyLen);
+    if (consume) {
+        buf->offset += copyLen;
+        buf->length -= copyLen;
+        if (buf->length == 0) buf->offset = 0;
+    }
+    return copyLen;
+}
+
+static char const * _stream_linear(ChannelBuffer * buf) {
+    return buf->data != 0 ? buf->data + buf->offset : "";
+}
+#else
+// Data is appended to the newest ring. If it does not fit, a ring of at
+// least twice the size is linked in and the producer continues there;
+// the consumer frees the old ring once it has drained it. An empty ring
+// that has been less than 25% full for a while is replaced by one of
+// half the size in the same way. Positions are free-running and only
+// masked when accessing 'data'. The first ring is allocated lazily.
+static ChannelRing * _ring_new(MultiplexPool * pool, unsigned int size) {
+    unsigned int capacity = 1;
+    ChannelRing * r = (ChannelRing *)_pool_acquire(pool, sizeof(ChannelRing));
+    while (capacity < size) capacity <<= 1;
+    if (r != 0) {
+        r->data = (char *)_pool_acquire(pool, capacity);
+        if (r->data == 0) {
+            _pool_release(pool, r, sizeof(ChannelRing));
+            return 0;
+        }
+        r->next = 0;
+        r->mask = capacity - 1;
+        r->head = 0;
+        r->tail = 0;
+    }
+    return r;
+}
+
+static void _ring_free(MultiplexPool * pool, ChannelRing * r) {
+    _pool_release(pool, r->data, r->mask + 1);
+    _pool_release(pool, r, sizeof(ChannelRing));
+}
+
+static void _ring_copy(ChannelRing * r, unsigned int position, char * dst, unsigned int length) {
+    unsigned int index = position & r->mask, first = r->mask + 1 - index;
+    if (first > length) first = length;
+    memcpy(dst, r->data + index, first);
+    memcpy(dst + first, r->data, length - first);
+}
+
+static void _channel_init(ChannelBuffer * buf) {
+    buf->read = buf->write = 0;
+    buf->linear = 0;
+    buf->linearCapacity = 0;
+}
+
+static void _channel_destroy(ChannelBuffer * buf) {
+    while (buf->read != 0) {
+        ChannelRing * next = buf->read->next;
+        _count_capacity(buf, -(long)(buf->read->mask + 1));
+        _ring_free(buf->pool, buf->read);
+        buf->read = next;
+    }
+    if (buf->linear != 0) free(buf->linear);
+    buf->write = 0;
+    buf->linear = 0;
+}
+
+static int _stream_put(ChannelBuffer * buf, char const * data, int length) {
+    ChannelRing * r = buf->write;
+    unsigned int tail = 0, capacity = 0, used = 0, size = 0, index = 0, first = 0;
+
+    // decide whether to continue in a new ring (and of what size)
+    if (r == 0) size = (unsigned int)(length > buf->initial ? length : buf->initial);
+    else {
+        tail = r->tail;
+        capacity = r->mask + 1;
+        used = tail - _load(&(r->head));
+        if (used * 4 < capacity && capacity > (unsigned int)buf->initial) ++buf->idle;
+        else buf->idle = 0;
+
+        if (capacity - used < (unsigned int)length)
+            size = capacity * 2 > (unsigned int)length ? capacity * 2 : (unsigned int)length;
+        else if (used == 0 && buf->idle >= MULTIPLEX_SHRINK_DELAY && (unsigned int)length <= capacity / 2)
+            size = capacity / 2;
+    }
+    if (size > 0) {
+        ChannelRing * next = _ring_new(buf->pool, size);
+        if (next == 0) return 0;
+        _count_capacity(buf, (long)next->mask + 1);
+        _count_realloc(buf);
+        if (r == 0) _store(&(buf->read), next);
+        else _store(&(r->next), next);
+        buf->write = r = next;
+        buf->idle = 0;
+        tail = 0;
+        capacity = r->mask + 1;
+    }
+
+    index = tail & r->mask;
+    first = capacity - index;
+    if (first > (unsigned int)length) first = length;
+    memcpy(r->data + index, data, first);
+    memcpy(r->data, data + first, length - first);
+
+    // 'length' may briefly overstate what is visible, but never understate it
+    _add(&(buf->length), length);
+    _store(&(r->tail), tail + length);
+    return 1;
+}
+
+static int _stream_take(ChannelBuffer * buf, char * dst, int length, int consume) {
+    ChannelRing * r = _load(&(buf->read));
+    unsigned int head = 0, tail = 0, n = 0;
+    int copied = 0;
+
+    if (r == 0) return 0;
+    head = r->head;
+    while (copied < length) {
+        tail = _load(&(r->tail));
+        if (tail == head) {
+            // drained; continue with the next ring once the producer has left this one
+            ChannelRing * next = _load(&(r->next));
+            if (next == 0) break;
+            if (_load(&(r->tail)) != head) continue;
+            if (consume) {
+                buf->read = next;
+                _count_capacity(buf, -(long)(r->mask + 1));
+                _ring_free(buf->pool, r);
+            }
+            r = next;
+            head = r->head;
+            continue;
+        }
+        n = tail - head;
+        if (n > (unsigned int)(length - copied)) n = length - copied;
+        if (dst != 0) _ring_copy(r, head, dst + copied, n);
+        copied += n;
+        head += n;
+        if (consume) _store(&(r->head), head);
+    }
+    if (consume && copied > 0) _add(&(buf->length), -copied);
+    return copied;
+}
+
+static char const * _stream_linear(ChannelBuffer * buf) {
+    ChannelRing * r = _load(&(buf->read));
+    unsigned int head = 0, tail = 0;
+    int length = 0;
+
+    // no copy needed if all data is in one piece
+    if (r == 0) return "";
+    head = r->head;
+    tail = _load(&(r->tail));
+    if (_load(&(r->next)) == 0 && (head & r->mask) + (tail - head) <= r->mask + 1)
+        return r->data + (head & r->mask);
+
+    length = _channel_length(buf);
+    if (buf->linearCapacity < length + 1) {
+        char * linear = (char *)realloc(buf->linear, length + 1);
+        if (linear == 0) return 0;
+        buf->linear = linear;
+        buf->linearCapacity = length + 1;
+    }
+    length = _stream_take(buf, buf->linear, length, 0);
+    buf->linear[length] = 0;
+    return buf->linear;
+}
+#endif
+
+// -- FRAMES
+// Channels in frame mode keep every frame in its own block, linked
+// from oldest to newest. 'frameHead' is an already consumed frame (or
+// the initial empty one) whose successor is the next frame to read, so
+// producer and consumer never touch the same pointer. The next frame
+// stays where it is until it is consumed, which makes it safe to hand
+// out pointers to it. A frame that arrives in fragments is collected in
+// 'partial' (growing by doubling) and only linked in once complete. A
+// read shorter than the next frame leaves the rest of it for the next
+// read ('frameOffset').
+#define _frame_size(capacity) (sizeof(ChannelFrame) + (size_t)(capacity) + 1)
+
+static ChannelFrame * _frame_new(MultiplexPool * pool, char const * data, int length, int capacity) {
+    ChannelFrame * f = (ChannelFrame *)_pool_acquire(pool, _frame_size(capacity));
+    if (f != 0) {
+        f->next = 0;
+        f->length = length;
+        f->capacity = capacity;
+        if (length > 0) memcpy(f->data, data, length);
+        f->data[length] = 0;
+    }
+    return f;
+}
+
+static void _frame_free(MultiplexPool * pool, ChannelFrame * f) {
+    _pool_release(pool, f, _frame_size(f->capacity));
+}
+
+static int _frames_init(ChannelBuffer * buf) {
+    buf->frameHead = buf->frameTail = _frame_new(buf->pool, 0, 0, 0);
+    buf->frameOffset = 0;
+    if (buf->frameHead != 0) _count_capacity(buf, (long)_frame_size(0));
+    return buf->frameHead != 0;
+}
+
+static void _frames_discard(ChannelBuffer * buf) {
+    // drop the frame being reassembled
+    if (buf->partial == 0) return;
+    _count_capacity(buf, -(long)_frame_size(buf->partial->capacity));
+    _frame_free(buf->pool, buf->partial);
+    buf->partial = 0;
+}
+
+static void _frames_destroy(ChannelBuffer * buf) {
+    while (buf->frameHead != 0) {
+        ChannelFrame * next = buf->frameHead->next;
+        _count_capacity(buf, -(long)_frame_size(buf->frameHead->capacity));
+        _frame_free(buf->pool, buf->frameHead);
+        buf->frameHead = next;
+    }
+    buf->frameTail = 0;
+    _frames_discard(buf);
+}
+
+static void _frames_link(ChannelBuffer * buf, ChannelFrame * f) {
+    _add(&(buf->length), f->length);
+    _store(&(buf->frameTail->next), f);
+    buf->frameTail = f;
+}
+
+static int _frames_reserve(ChannelBuffer * buf, int length) {
+    // make room for 'length' more bytes in the frame being reassembled
+    ChannelFrame * f = buf->partial, * next = 0;
+    int used = f != 0 ? f->length : 0, capacity = f != 0 ? f->capacity : 0;
+    if (f != 0 && capacity - used >= length) return 1;
+    if (length > INT_MAX - 64 - used) {
+        errno = ENOMEM;
+        return 0;
+    }
+    capacity = capacity < (INT_MAX - 64) / 2 ? capacity * 2 : INT_MAX - 64;
+    if (capacity < used + length) capacity = used + length;
+    next = _frame_new(buf->pool, f != 0 ? f->data : 0, used, capacity);
+    if (next == 0) return 0;
+    _count_capacity(buf, (long)_frame_size(capacity));
+    _count_realloc(buf);
+    _frames_discard(buf);
+    buf->partial = next;
+    return 1;
+}
+
+static int _frames_put(ChannelBuffer * buf, char const * data, int length, int more) {
+    ChannelFrame * f = buf->partial;
+    if (f == 0 && !more) {
+        f = _frame_new(buf->pool, data, length, length);
+        if (f == 0) return 0;
+        _count_capacity(buf, (long)_frame_size(length));
+        _frames_link(buf, f);
+        return 1;
+    }
+
+    // collect fragments (data may already be in place, see '_direct_target')
+    if (!_frames_reserve(buf, length)) return 0;
+    f = buf->partial;
+    if (data != f->data + f->length) memcpy(f->data + f->length, data, length);
+    f->length += length;
+    f->data[f->length] = 0;
+    if (!more) {
+        buf->partial = 0;
+        _frames_link(buf, f);
+    }
+    return 1;
+}
+
+static ChannelFrame * _frames_first(ChannelBuffer * buf) {
+    return _load(&(buf->frameHead->next));
+}
+
+static void _frames_pop(ChannelBuffer * buf) {
+    ChannelFrame * next = _frames_first(buf);
+    if (next != 0) {
+        _count_capacity(buf, -(long)_frame_size(buf->frameHead->capacity));
+        _frame_free(buf->pool, buf->frameHead);
+        buf->frameHead = next;
+        buf->leased = 0;
+        _add(&(buf->length), -(next->length - buf->frameOffset));
+        buf->frameOffset = 0;
+    }
+}
+
+// -- DISPATCH
+// Reading from a channel in frame mode returns (at most) one frame. In
+// stream mode, fragments ('more' set) are simply appended.
+static int _channel_put(ChannelBuffer * buf, char const * data, int length, int more) {
+    if (buf->framed) return _frames_put(buf, data, length, more);
+    return _stream_put(buf, data, length);
+}
+
+static int _channel_take(ChannelBuffer * buf, char * dst, int length, int consume, int * removed) {
+    // returns the number of bytes copied; 'removed' (optional) is set to the
+    // number of bytes removed from the buffer. A frame is only popped once
+    // all of it has been read, and a leased one only by
+    // 'multiplex_release_frame'.
+    int r = 0;
+    if (removed != 0) *removed = 0;
+    if (buf->framed) {
+        ChannelFrame * f = _frames_first(buf);
+        if (f == 0 || (consume && buf->leased)) return 0;
+        r = f->length - buf->frameOffset;
+        if (length > r) length = r;
+        if (dst != 0) memcpy(dst, f->data + buf->frameOffset, length);
+        if (consume && removed != 0) *removed = length;
+        if (consume && length == r) _frames_pop(buf);
+        else if (consume) {
+            buf->frameOffset += length;
+            _add(&(buf->length), -length);
+        }
+        return length;
+    }
+    r = _stream_take(buf, dst, length, consume);
+    if (consume && removed != 0) *removed = r;
+    return r;
+}
+
+static int _channel_drop(ChannelBuffer * buf) {
+    int dropped = 0;
+    if (buf->framed) {
+        ChannelFrame * f = 0;
+        while (!buf->leased && (f = _frames_first(buf)) != 0) {
+            dropped += f->length - buf->frameOffset;
+            _frames_pop(buf);
+        }
+        return dropped;
+    }
+    return _stream_take(buf, 0, INT_MAX, 1);
+}
+
+static char const * _channel_linear(ChannelBuffer * buf) {
+    if (buf->framed) {
+        ChannelFrame * f = _frames_first(buf);
+        return f != 0 ? f->data + buf->frameOffset : buf->frameHead->data;
+    }
+    return _stream_linear(buf);
+}
+
+// -- CONSUMER LOCK
+static void _lock_buffer(ChannelBuffer * buf) {
+#if !defined(NO_MUTEX) && !defined(CHANNEL_MUTEX)
+    pthread_mutex_lock(&(buf->lock));
+#endif
+}
+
+static void _unlock_buffer(ChannelBuffer * buf) {
+#if !defined(NO_MUTEX) && !defined(CHANNEL_MUTEX)
+    pthread_mutex_unlock(&(buf->lock));
+#endif
+}
+
+// Consumers do not take the Multiplex mutex, so the buffer is pinned
+// while they use it: 'multiplex_disable' removes it from the table right
+// away, but if consumers hold it, the last of them frees it.
+static void multiplex_unlock_consumer(Multiplex * c, ChannelBuffer * buf) {
+#ifdef CHANNEL_MUTEX
+    (void)buf;
+    multiplex_unlock(c);
+#elif !defined(NO_MUTEX)
+    int last = 0;
+    _unlock_buffer(buf);
+    pthread_mutex_lock(&(c->pinMutex));
+    last = --buf->users == 0 && buf->disabled;
+    pthread_mutex_unlock(&(c->pinMutex));
+    if (last) _free_channel(buf);
+#else
+    (void)c;
+    (void)buf;
+#endif
+}
+
+static ChannelBuffer * multiplex_lock_consumer(Multiplex * c, unsigned int channelId) {
+    // returns the locked buffer, or 0 if the channel is not enabled
+#ifdef CHANNEL_MUTEX
+    if (multiplex_lock_channel(c, channelId) != 0) return 0;
+    return _channel(c, channelId);
+#elif !defined(NO_MUTEX)
+    ChannelBuffer * buf = 0;
+    if (c == 0) return 0;
+    pthread_mutex_lock(&(c->pinMutex));
+    if ((buf = _channel(c, channelId)) != 0) ++buf->users;
+    pthread_mutex_unlock(&(c->pinMutex));
+    if (buf == 0) return 0;
+    _lock_buffer(buf);
+    if (!_load(&(buf->disabled))) return buf;
+    multiplex_unlock_consumer(c, buf);
+    return 0;
+#else
+    return c != 0 ? _channel(c, channelId) : 0;
+#endif
+}
+
+// ----------------------------------------------------------------------
+//
+//   READY CHANNELS
+//
+// ----------------------------------------------------------------------
+// Channels with data that 'select' has not reported yet are tracked in
+// a bit set of the channel table. Depending on the policy, 'select'
+// returns the channel that got data first (FIFO, using a queue that
+// contains every channel at most once), the next one after the
+// previously selected channel (round-robin), or the one with the lowest
+// ID (priority).
+static void _enqueue_ready(Multiplex * c, unsigned int channelId) {
+    if (_set_test(c, _SET_QUEUED, channelId)) return;
+    if (c->readyCount == c->readyCapacity) {
+        // grow the queue (if that fails, '_next_ready' finds the channel in the set)
+        int capacity = c->readyCapacity > 0 ? c->readyCapacity * 2 : 256, i = 0;
+        unsigned int * queue = (unsigned int *)malloc(capacity * sizeof(unsigned int));
+        if (queue == 0) return;
+        for (; i < c->readyCount; ++i)
+            queue[i] = c->readyQueue[(c->readyHead + i) & (c->readyCapacity - 1)];
+        if (c->readyQueue != 0) free(c->readyQueue);
+        c->readyQueue = queue;
+        c->readyHead = 0;
+        c->readyCapacity = capacity;
+    }
+    _set_add(c, _SET_QUEUED, channelId);
+    c->readyQueue[(c->readyHead + c->readyCount) & (c->readyCapacity - 1)] = channelId;
+    ++c->readyCount;
+}
+
+static void _mark_ready(Multiplex * c, unsigned int channelId) {
+    if (_set_test(c, _SET_READY, channelId)) return;
+    _set_add(c, _SET_READY, channelId);
+    if (c->policy == MULTIPLEX_POLICY_FIFO) _enqueue_ready(c, channelId);
+}
+
+static int _next_ready(Multiplex * c) {
+    int channelId = -1;
+    switch (c->policy) {
+        case MULTIPLEX_POLICY_FIFO:
+            while (c->readyCount > 0) {
+                channelId = c->readyQueue[c->readyHead];
+                c->readyHead = (c->readyHead + 1) & (c->readyCapacity - 1);
+                --c->readyCount;
+                _set_remove(c, _SET_QUEUED, channelId);
+                if (_set_test(c, _SET_READY, channelId)) return channelId;
+            }
+            return _set_first(c, _SET_READY, 0);
+        case MULTIPLEX_POLICY_ROUND_ROBIN:
+            channelId = _set_first(c, _SET_READY, c->readyLast + 1);
+            if (channelId < 0) channelId = _set_first(c, _SET_READY, 0);
+            if (channelId >= 0) c->readyLast = channelId;
+            return channelId;
+        default:
+            return _set_first(c, _SET_READY, 0);
+    }
+}
+
+static int _ready_channel(Multiplex * c) {
+    // skip channels whose data has been consumed in the meantime
+    int channelId = -1;
+    while ((channelId = _next_ready(c)) >= 0) {
+        ChannelBuffer * buf = _channel(c, channelId);
+        _set_remove(c, _SET_READY, channelId);
+        if (buf != 0 && _channel_length(buf) > 0) return channelId;
+    }
+    return -1;
+}
+
+void multiplex_set_policy(Multiplex * c, int policy) {
+    if (multiplex_lock(c) == 0) {
+        int i = -1;
+        c->policy = policy;
+        c->readyHead = 0;
+        c->readyCount = 0;
+        while ((i = _set_first(c, _SET_QUEUED, 0)) >= 0) _set_remove(c, _SET_QUEUED, i);
+        if (policy == MULTIPLEX_POLICY_FIFO) {
+            while ((i = _set_first(c, _SET_READY, i + 1)) >= 0)
+                _enqueue_ready(c, i);
+        }
+        multiplex_unlock(c);
+    }
+}
+
+// ----------------------------------------------------------------------
+//
+//   CONTROL CHANNEL
+//
+// ----------------------------------------------------------------------
+// Flow control and the protocol handshake use frames on channel
+// MULTIPLEX_CONTROL_CHANNEL. Such frames are handled internally unless
+// that channel is enabled for data (which is only possible as long as
+// neither flow control nor protocol v2 are requested). The first byte
+// of the payload is the type of the frame:
+//
+//     01 <4-byte channel ID> <4-byte credit increment>
+//     02 <highest supported version>
+//     03 [version]                     (following frames use it, 2 if absent)
+#define MULTIPLEX_CREDIT_UPDATE 1
+#define MULTIPLEX_HELLO         2
+#define MULTIPLEX_UPGRADE       3
+
+#define MULTIPLEX_VERSION 3  // highest protocol version supported
+
+// v3: a set high bit in the length prefix marks a fragment of a payload
+// that is continued by the next frame on the same channel
+#define _FRAGMENT 0x80000000UL
+
+// returned internally when only control frames arrived, which receivers
+// should not notice (as opposed to frames for disabled channels)
+#define _CONTROL_ONLY (CHANNEL_IGNORED - 1)
+
+static int _sendv(Multiplex * c, unsigned int channelId, struct iovec const * iov, int count, int flags);
+static int _write_locked(Multiplex * c, struct iovec * vec, int count, int frameLength, int flags);
+
+static void _put32(unsigned char * p, unsigned int value) {
+    p[0] = (unsigned char)((value >> 24) & 0xFF);
+    p[1] = (unsigned char)((value >> 16) & 0xFF);
+    p[2] = (unsigned char)((value >> 8) & 0xFF);
+    p[3] = (unsigned char)(value & 0xFF);
+}
+
+static unsigned int _get32(unsigned char const * p) {
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+static void _send_control(Multiplex * c, unsigned char const * payload, int length) {
+    struct iovec iov;
+    iov.iov_base = (void *)payload;
+    iov.iov_len = length;
+    _sendv(c, MULTIPLEX_CONTROL_CHANNEL, &iov, 1, MULTIPLEX_URGENT);
+}
+
+// -- FLOW CONTROL
+// The sender may have at most 'window' bytes per channel in flight (a
+// single larger frame is allowed once the full window is available).
+// Credit is returned once half the window has been consumed or the
+// channel buffer is empty; frames that are dropped (disabled channel,
+// full pool) are credited right away.
+static void _send_credit(Multiplex * c, unsigned int channelId, int increment) {
+    unsigned char payload[9];
+    payload[0] = MULTIPLEX_CREDIT_UPDATE;
+    _put32(payload + 1, channelId);
+    _put32(payload + 5, (unsigned int)increment);
+    _send_control(c, payload, 9);
+}
+
+static void _credit_consumed(Multiplex * c, ChannelBuffer * buf, int length) {
+    // called by the consumer of the channel
+    if (c->window == 0 || length <= 0) return;
+    buf->consumed += length;
+    if (buf->consumed >= c->window / 2 || _channel_length(buf) == 0) {
+        _send_credit(c, buf->id, buf->consumed);
+        buf->consumed = 0;
+    }
+}
+
+static void _credit_dropped(Multiplex * c, unsigned int channelId, int length) {
+    if (c->window > 0 && length > 0) _send_credit(c, channelId, length);
+}
+
+// -- HANDSHAKE
+// Both peers announce the highest version they support. Whoever learns
+// that both support v2 sends an upgrade frame (naming the highest common
+// version) and uses that version from then on, so each direction
+// switches at a well-defined point in the stream.
+static void _send_hello(Multiplex * c) {
+    unsigned char payload[2];
+    payload[0] = MULTIPLEX_HELLO;
+    payload[1] = (unsigned char)c->maxVersion;
+    _send_control(c, payload, 2);
+}
+
+static void _send_upgrade(Multiplex * c) {
+    unsigned char frame[7] = { 0, 0, 0, 3, MULTIPLEX_CONTROL_CHANNEL, MULTIPLEX_UPGRADE, 0 };
+    int version = c->peerVersion < c->maxVersion ? c->peerVersion : c->maxVersion;
+    struct iovec iov;
+    if (multiplex_lock_send(c) != 0) return;
+    if (c->txVersion < 2) {
+        frame[6] = (unsigned char)version;
+        iov.iov_base = frame;
+        iov.iov_len = 7;
+        if (_write_locked(c, &iov, 1, 7, MULTIPLEX_URGENT) >= 0) _store(&(c->txVersion), version);
+    }
+    multiplex_unlock_send(c);
+}
+
+static void _control_received(Multiplex * c, unsigned char const * payload, int length) {
+    // handle a control frame (holding the mutex); credit belongs to the
+    // bonded multiplexer, the protocol version to the link
+    Multiplex * table = _table(c);
+    ChannelLeaf * leaf = 0;
+    if (length < 1) return;
+    switch (payload[0]) {
+        case MULTIPLEX_CREDIT_UPDATE:
+            if (length != 9 || table->window == 0) return;
+            leaf = _leaf(table, _get32(payload + 1));
+            if (leaf != 0) _add(&(leaf->used[_low(_get32(payload + 1))]), -(int)_get32(payload + 5));
+            break;
+        case MULTIPLEX_HELLO:
+            if (length != 2) return;
+            c->peerVersion = payload[1];
+            if (c->maxVersion >= 2 && c->peerVersion >= 2) _send_upgrade(c);
+            break;
+        case MULTIPLEX_UPGRADE:
+            if (length >= 2 && (payload[1] < 2 || payload[1] > MULTIPLEX_VERSION)) return;
+            c->rxVersion = length >= 2 ? payload[1] : 2;
+            break;
+        default:
+            return;
+    }
+#ifndef NO_MUTEX
+    if (table->controlWaiters > 0) pthread_cond_broadcast(&(table->controlCond));
+#endif
+}
+
+// ----------------------------------------------------------------------
+//
+//   MODIFY BUFFER
+//
+// ----------------------------------------------------------------------
+#ifndef NO_MUTEX
+static void _schedule_channel(Multiplex * c, ChannelBuffer * buf);
+#endif
+
+static int _write_channel(Multiplex * c, unsigned int channelId, char const * data, int offset, int length, int more) {
+    // returns 0 if the data was dropped, or if the pool could not provide the
+    // memory yet (errno = EAGAIN); once a fragment has been dropped, the rest
+    // of its payload is dropped, too
+    ChannelBuffer * buf = _channel(c, channelId);
+    if (buf == 0) return 1;
+    if (buf->discarding) {
+        buf->discarding = more;
+        errno = ENOMEM;
+        return 0;
+    }
+    if (!_channel_put(buf, data + offset, length, more)) {
+        if (errno != EAGAIN || c->pool->policy != MULTIPLEX_POOL_BLOCK) {
+            _frames_discard(buf);
+            buf->discarding = more;
+        }
+        return 0;
+    }
+    if (more && buf->framed) return 1;
+    buf->newData = buf->framed ? buf->frameTail->length : length;
+#ifndef NO_MUTEX
+    if (buf->handler != 0 && c->workers != 0) {
+        _schedule_channel(c, buf);
+        return 1;
+    }
+#endif
+    _mark_ready(c, channelId);
+    return 1;
+}
+
+void multiplex_write(Multiplex * c, unsigned int channelId, char * data, int offset, int length) {
+    if (multiplex_lock_channel(c, channelId) == 0) {
+        _write_channel(c, channelId, data, offset, length, 0);
+        multiplex_unlock(c);
+    }
+}
+
+int multiplex_copy(Multiplex * c, unsigned int channelId, char * dst, int offset, int length) {
+    ChannelBuffer * buf = multiplex_lock_consumer(c, channelId);
+    if (buf == 0) return -1;
+    else {
+        int r = _channel_take(buf, dst + offset, length, 0, 0);
+        multiplex_unlock_consumer(c, buf);
+        return r;
+    }
+}
+
+static int _read_channel(Multiplex * c, ChannelBuffer * buf, char * dst, int offset, int length) {
+    int copyLen = 0, removed = 0;
+    if (buf == 0) return CHANNEL_IGNORED;
+
+    //
+    copyLen = _channel_take(buf, dst + offset, length, 1, &removed);
+#ifdef CHANNEL_MUTEX
+    buf->newData -= removed;
+    if (buf->newData < 0) buf->newData = 0;
+#endif
+    _credit_consumed(c, buf, removed);
+    return copyLen;
+}
+
+int multiplex_read(Multiplex * c, unsigned int channelId, char * dst, int offset, int length) {
+    ChannelBuffer * buf = multiplex_lock_consumer(c, channelId);
+    if (buf == 0) return CHANNEL_CLOSED;
+    else {
+        int r = _read_channel(c, buf, dst, offset, length);
+        multiplex_unlock_consumer(c, buf);
+        return r;
+    }
+}
+
+void multiplex_clear(Multiplex * c, unsigned int channelId) {
+    ChannelBuffer * buf = multiplex_lock_consumer(c, channelId);
+    if (buf != 0) {
+        int dropped = _channel_drop(buf);
+#ifdef CHANNEL_MUTEX
+        buf->newData = 0;
+#endif
+        _credit_consumed(c, buf, dropped);
+        multiplex_unlock_consumer(c, buf);
+    }
+}
+
+// ----------------------------------------------------------------------
+//
+//   FRAME LEASES
+//
+// ----------------------------------------------------------------------
+void multiplex_enable_frames(Multiplex * c, unsigned int channelId) {
+    if (multiplex_lock(c) == 0) {
+        ChannelBuffer * buf = 0;
+        _enable_channel(c, channelId, 1);
+        buf = _channel(c, channelId);
+        if (buf != 0 && !buf->framed && _channel_length(buf) == 0 && _frames_init(buf))
+            buf->framed = 1;
+        multiplex_unlock(c);
+    }
+}
+
+int multiplex_acquire_frame(Multiplex * c, unsigned int channelId, char const ** ptr, int * length) {
+    ChannelBuffer * buf = multiplex_lock_consumer(c, channelId);
+    ChannelFrame * f = 0;
+    if (buf == 0) return CHANNEL_IGNORED;
+    if (!buf->framed) {
+        multiplex_unlock_consumer(c, buf);
+        return CHANNEL_IGNORED;
+    }
+    f = _frames_first(buf);
+    if (f != 0) {
+        buf->leased = 1;
+        if (ptr != 0) *ptr = f->data + buf->frameOffset;
+        if (length != 0) *length = f->length - buf->frameOffset;
+    }
+    multiplex_unlock_consumer(c, buf);
+    return f != 0;
+}
+
+void multiplex_release_frame(Multiplex * c, unsigned int channelId) {
+    ChannelBuffer * buf = multiplex_lock_consumer(c, channelId);
+    if (buf != 0) {
+        if (buf->framed && buf->leased) {
+            int length = _frames_first(buf)->length - buf->frameOffset;
+            _frames_pop(buf);
+            _credit_consumed(c, buf, length);
+        }
+        multiplex_unlock_consumer(c, buf);
+    }
+}
+
+// ----------------------------------------------------------------------
+//
+//   IO_URING ENGINE
+//
+// ----------------------------------------------------------------------
+// With MULTIPLEX_ENGINE_URING, the fd is read and written through two
+// io_uring instances instead of poll/read/writev: one is only used by
+// the thread owning the fd for reading, the other one by the thread
+// holding the send (or write) mutex, so neither needs a lock.
+//
+// Sockets are read by a single multishot receive request, which keeps
+// filling buffers provided by us until it runs out of them. Every
+// completion is appended to the staging buffer and its buffer handed
+// back right away. Other fds (e.g. pipes) use one read request at a time,
+// targeting a buffer of the engine (never the staging buffer, which might
+// be reallocated while the request is pending). Requests stay in flight
+// across timeouts. For the reactor, an eventfd registered with the ring
+// becomes readable whenever a request completes.
+//
+// Frames are sent as linked 'writev' requests that are submitted and
+// waited for using a single system call; a short write is completed by
+// '_fd_writev'.
+#ifdef MULTIPLEX_URING
+#ifndef MULTIPLEX_URING_BUFFERS
+#define MULTIPLEX_URING_BUFFERS 8          // provided receive buffers (a power of two)
+#endif
+#ifndef MULTIPLEX_URING_BUFFER_SIZE
+#define MULTIPLEX_URING_BUFFER_SIZE 16384  // size of each receive buffer
+#endif
+#define _URING_RECEIVE 1                   // user data of the receive request
+#define _URING_CANCEL  2                   // user data of its cancellation
+#define _URING_WAKE    3                   // user data of the poll on the wakeup pipe
+
+typedef struct UringQueue {
+    int fd;                        // io_uring instance
+    unsigned int * sqHead;         // submission queue (shared with the kernel)
+    unsigned int * sqTail;
+    unsigned int * sqMask;
+    unsigned int * sqArray;
+    unsigned int * cqHead;         // completion queue (shared with the kernel)
+    unsigned int * cqTail;
+    unsigned int * cqMask;
+    struct io_uring_sqe * sqes;    // submission entries
+    struct io_uring_cqe * cqes;    // completion entries
+    unsigned int entries;          // size of the submission queue
+    unsigned int sqLocal;          // tail including entries not yet submitted
+    void * ring;                   // mapping of both queues
+    size_t ringSize;               // size of 'ring'
+    size_t sqesSize;               // size of 'sqes'
+} UringQueue;
+
+struct MultiplexUring {
+    UringQueue rx;                        // receive requests (fd owner)
+    UringQueue tx;                        // send requests (send/write mutex)
+    struct io_uring_buf_ring * buffers;   // buffers provided for multishot receive
+    char * data;                          // receive buffer memory
+    int event;                            // eventfd signalled on completion (reactor), or -1
+    int multishot;                        // 1 = multishot receive (0 = single reads)
+    int armed;                            // 1 = a receive request is in flight
+    int wakeArmed;                        // 1 = a poll on the wakeup pipe is in flight
+    int closed;                           // 1 = end of file or error seen
+};
+
+static int _fd_writev(int fd, struct iovec * iov, int count);
+static void _iov_advance(struct iovec ** iov, int * count, size_t bytes);
+
+// -- QUEUES
+static void _uring_close(UringQueue * q) {
+    if (q->sqes != 0) munmap(q->sqes, q->sqesSize);
+    if (q->ring != 0) munmap(q->ring, q->ringSize);
+    if (q->fd >= 0) close(q->fd);
+    q->sqes = 0;
+    q->ring = 0;
+    q->fd = -1;
+}
+
+static int _uring_setup(UringQueue * q, unsigned int entries, unsigned int completions) {
+    struct io_uring_params p;
+    char * ring = 0;
+    void * sqes = 0;
+
+    //
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = completions;
+    q->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (q->fd < 0) return 0;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        _uring_close(q);
+        return 0;
+    }
+    q->ringSize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > q->ringSize)
+        q->ringSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    q->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    q->ring = mmap(0, q->ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQ_RING);
+    if (q->ring == MAP_FAILED) q->ring = 0;
+    sqes = mmap(0, q->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQES);
+    if (sqes != MAP_FAILED) q->sqes = (struct io_uring_sqe *)sqes;
+    if (q->ring == 0 || q->sqes == 0) {
+        _uring_close(q);
+        return 0;
+    }
+
+    //
+    ring = (char *)q->ring;
+    q->sqHead = (unsigned int *)(ring + p.sq_off.head);
+    q->sqTail = (unsigned int *)(ring + p.sq_off.tail);
+    q->sqMask = (unsigned int *)(ring + p.sq_off.ring_mask);
+    q->sqArray = (unsigned int *)(ring + p.sq_off.array);
+    q->cqHead = (unsigned int *)(ring + p.cq_off.head);
+    q->cqTail = (unsigned int *)(ring + p.cq_off.tail);
+    q->cqMask = (unsigned int *)(ring + p.cq_off.ring_mask);
+    q->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    q->entries = p.sq_entries;
+    q->sqLocal = *q->sqTail;
+    return 1;
+}
+
+static struct io_uring_sqe * _uring_sqe(UringQueue * q) {
+    // next (cleared) submission entry, submitted by '_uring_enter'; 0 if full
+    unsigned int index = q->sqLocal & *q->sqMask;
+    if (q->sqLocal - _load(q->sqHead) >= q->entries) return 0;
+    memset(&(q->sqes[index]), 0, sizeof(struct io_uring_sqe));
+    q->sqArray[index] = index;
+    ++q->sqLocal;
+    return &(q->sqes[index]);
+}
+
+static int _uring_enter(UringQueue * q, unsigned int wait, int timeoutMs) {
+    // submit new entries, then wait for 'wait' completions (negative timeout = forever)
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned int submit = q->sqLocal - *q->sqTail;
+    if (submit == 0 && wait == 0) return 0;
+    _store(q->sqTail, q->sqLocal);
+    memset(&arg, 0, sizeof(arg));
+    if (wait > 0 && timeoutMs >= 0) {
+        ts.tv_sec = timeoutMs / 1000;
+        ts.tv_nsec = (timeoutMs % 1000) * 1000000L;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    return (int)syscall(__NR_io_uring_enter, q->fd, submit, wait,
+                        IORING_ENTER_EXT_ARG | (wait > 0 ? IORING_ENTER_GETEVENTS : 0), &arg, sizeof(arg));
+}
+
+static struct io_uring_cqe * _uring_cqe(UringQueue * q) {
+    // oldest unseen completion, or 0
+    unsigned int head = *q->cqHead;
+    if (head == _load(q->cqTail)) return 0;
+    return &(q->cqes[head & *q->cqMask]);
+}
+
+static void _uring_seen(UringQueue * q) {
+    _store(q->cqHead, *q->cqHead + 1);
+}
+
+// -- RECEIVE
+static void _uring_provide(struct MultiplexUring * u, unsigned int id) {
+    // hand receive buffer 'id' (back) to the kernel
+    unsigned short tail = u->buffers->tail;
+    struct io_uring_buf * b = &(u->buffers->bufs[tail & (MULTIPLEX_URING_BUFFERS - 1)]);
+    b->addr = (uint64_t)(uintptr_t)(u->data + (size_t)id * MULTIPLEX_URING_BUFFER_SIZE);
+    b->len = MULTIPLEX_URING_BUFFER_SIZE;
+    b->bid = (unsigned short)id;
+    _store(&(u->buffers->tail), (unsigned short)(tail + 1));
+}
+
+static int _uring_register_buffers(struct MultiplexUring * u) {
+    struct io_uring_buf_reg reg;
+    size_t size = MULTIPLEX_URING_BUFFERS * sizeof(struct io_uring_buf);
+    void * ring = 0;
+    unsigned int i = 0;
+
+    //
+    u->data = (char *)malloc((size_t)MULTIPLEX_URING_BUFFERS * MULTIPLEX_URING_BUFFER_SIZE);
+    if (u->data == 0) return 0;
+    ring = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) return 0;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring;
+    reg.ring_entries = MULTIPLEX_URING_BUFFERS;
+    if (syscall(__NR_io_uring_register, u->rx.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(ring, size);
+        return 0;
+    }
+    u->buffers = (struct io_uring_buf_ring *)ring;
+    for (; i < MULTIPLEX_URING_BUFFERS; ++i) _uring_provide(u, i);
+    return 1;
+}
+
+static int _uring_arm(Multiplex * c) {
+    // make sure a receive request is queued (submitted by the next '_uring_enter')
+    struct MultiplexUring * u = c->uring;
+    struct io_uring_sqe * sqe = 0;
+    if (u->armed || u->closed) return 1;
+    sqe = _uring_sqe(&(u->rx));
+    if (sqe == 0) return 0;
+    sqe->fd = c->fd;
+    sqe->user_data = _URING_RECEIVE;
+    if (u->multishot) {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+    }
+    else {
+        sqe->opcode = IORING_OP_READ;
+        sqe->addr = (uint64_t)(uintptr_t)u->data;
+        sqe->len = MULTIPLEX_URING_BUFFER_SIZE;
+        sqe->off = (uint64_t)-1;
+    }
+    u->armed = 1;
+    return 1;
+}
+
+static int _uring_retry(int res) {
+    // receive errors that only require a new request: out of buffers, or
+    // cancelled because the thread that submitted it has exited
+    return res == -ENOBUFS || res == -EAGAIN || res == -EINTR || res == -ECANCELED;
+}
+
+static int _stage(Multiplex * c, char const * data, int length) {
+    // append received bytes to the staging buffer
+    int end = c->rxOffset + c->rxLength;
+    if (end + length > c->rxCapacity && c->rxOffset > 0) {
+        memmove(c->rx, c->rx + c->rxOffset, c->rxLength);
+        c->rxOffset = 0;
+        end = c->rxLength;
+    }
+    if (end + length > c->rxCapacity) {
+        char * rx = (char *)realloc(c->rx, end + length);
+        if (rx == 0) return 0;
+        c->rx = rx;
+        c->rxCapacity = end + length;
+    }
+    memcpy(c->rx + end, data, length);
+    c->rxLength += length;
+    return 1;
+}
+
+static int _uring_fill(Multiplex * c, int timeoutMs) {
+    // same as '_fd_fill', waiting for completions instead of readability
+    struct MultiplexUring * u = c->uring;
+    struct io_uring_sqe * sqe = 0;
+    struct io_uring_cqe * cqe = 0;
+    int total = 0, expired = 0, woken = 0;
+
+    //
+    if (u->closed) return CHANNEL_CLOSED;
+    if (!_uring_arm(c)) return CHANNEL_CLOSED;
+    if (_wakeup_pending(c)) return CHANNEL_WAKEUP;
+    if (c->wakeWatch && c->wakePipe[0] >= 0 && !u->wakeArmed && (sqe = _uring_sqe(&(u->rx))) != 0) {
+        // 'multiplex_wakeup' completes this request, which ends the wait
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = c->wakePipe[0];
+        sqe->poll_events = POLLIN;
+        sqe->user_data = _URING_WAKE;
+        u->wakeArmed = 1;
+    }
+    if (u->event >= 0 && timeoutMs < 0) {
+        // reset the eventfd before looking for completions, so none is missed
+        uint64_t events = 0;
+        if (read(u->event, &events, sizeof(events)) < 0 && errno != EAGAIN) return CHANNEL_CLOSED;
+    }
+    if (_uring_cqe(&(u->rx)) == 0 && _uring_enter(&(u->rx), timeoutMs >= 0 ? 1 : 0, timeoutMs) < 0) {
+        if (errno == ETIME) expired = 1;
+        else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) return CHANNEL_CLOSED;
+    }
+    while ((cqe = _uring_cqe(&(u->rx))) != 0) {
+        int res = cqe->res;
+        unsigned int flags = cqe->flags;
+        char * data = u->data;
+        if (cqe->user_data != _URING_RECEIVE) {
+            if (cqe->user_data == _URING_WAKE) {
+                u->wakeArmed = 0;
+                woken = 1;
+            }
+            _uring_seen(&(u->rx));
+            continue;
+        }
+        _uring_seen(&(u->rx));
+        if (!(flags & IORING_CQE_F_MORE)) u->armed = 0;
+        if (res > 0) {
+            int staged = 1;
+            if (flags & IORING_CQE_F_BUFFER) data += (size_t)(flags >> IORING_CQE_BUFFER_SHIFT) * MULTIPLEX_URING_BUFFER_SIZE;
+            staged = _stage(c, data, res);
+            if (flags & IORING_CQE_F_BUFFER) _uring_provide(u, flags >> IORING_CQE_BUFFER_SHIFT);
+            if (staged) total += res;
+            else u->closed = 1;
+        }
+        else if (res == -EINVAL && u->multishot && total == 0) {
+            // kernel without multishot receive: fall back to single reads
+            u->multishot = 0;
+        }
+        else if (res == 0 || !_uring_retry(res)) u->closed = 1;
+    }
+
+    // keep a request in flight, so the eventfd signals the next data
+    if (!u->closed && _uring_arm(c)) _uring_enter(&(u->rx), 0, 0);
+    if (total > 0 && u->closed && u->event >= 0) {
+        // end of file is reported by the next call, make sure the reactor makes it
+        uint64_t one = 1;
+        ssize_t r = write(u->event, &one, sizeof(one));
+        (void)r;
+    }
+    if (woken && _wakeup_drain(c) && total == 0 && !u->closed) return CHANNEL_WAKEUP;
+    if (total > 0) return total;
+    if (u->closed) return CHANNEL_CLOSED;
+    return expired ? CHANNEL_TIMEOUT : 0;
+}
+
+// -- SEND
+static int _uring_writev(Multiplex * c, struct iovec * iov, int count) {
+    // same as '_fd_writev'; a chain of at most 'entries' requests per call
+    UringQueue * q = &(c->uring->tx);
+    struct io_uring_sqe * sqe = 0;
+    struct io_uring_cqe * cqe = 0;
+    size_t lengths[64];
+    int results[64];
+    int requests = 0, done = 0, i = 0, total = 0, r = 0;
+
+    //
+    if ((count + IOV_MAX - 1) / IOV_MAX > (int)q->entries || q->entries > 64) return _fd_writev(c->fd, iov, count);
+    for (i = 0; i < count; i += IOV_MAX) {
+        int n = count - i > IOV_MAX ? IOV_MAX : count - i, k = 0;
+        sqe = _uring_sqe(q);
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = c->fd;
+        sqe->addr = (uint64_t)(uintptr_t)(iov + i);
+        sqe->len = n;
+        sqe->off = (uint64_t)-1;
+        sqe->user_data = requests;
+        if (i + n < count) sqe->flags = IOSQE_IO_LINK;
+        for (lengths[requests] = 0; k < n; ++k) lengths[requests] += iov[i + k].iov_len;
+        ++requests;
+    }
+    while (done < requests) {
+        if (_uring_cqe(q) == 0 && _uring_enter(q, requests - done, -1) < 0 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY) return -1;
+        while ((cqe = _uring_cqe(q)) != 0) {
+            if (cqe->user_data < (uint64_t)requests) results[cqe->user_data] = cqe->res;
+            _uring_seen(q);
+            ++done;
+        }
+    }
+
+    // a short write cancels the rest of the chain, which is written directly
+    for (i = 0; i < requests && results[i] >= 0 && (size_t)results[i] == lengths[i]; ++i) total += results[i];
+    if (i == requests) return total;
+    if (results[i] < 0 && results[i] != -EAGAIN && results[i] != -EINTR) return -1;
+    if (results[i] > 0) total += results[i];
+    _iov_advance(&iov, &count, total);
+    r = _fd_writev(c->fd, iov, count);
+    return r < 0 ? -1 : total + r;
+}
+
+// -- CREATE
+static void _uring_free(struct MultiplexUring * u) {
+    struct io_uring_sqe * sqe = 0;
+    struct io_uring_cqe * cqe = 0;
+    if (u == 0) return;
+    if (u->armed && (sqe = _uring_sqe(&(u->rx))) != 0) {
+        // the kernel must not write to the buffers once they are freed
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = _URING_RECEIVE;
+        sqe->user_data = _URING_CANCEL;
+        while (u->armed) {
+            if (_uring_cqe(&(u->rx)) == 0 && _uring_enter(&(u->rx), 1, 1000) < 0 && errno != EINTR) break;
+            while ((cqe = _uring_cqe(&(u->rx))) != 0) {
+                if (cqe->user_data == _URING_RECEIVE && !(cqe->flags & IORING_CQE_F_MORE)) u->armed = 0;
+                _uring_seen(&(u->rx));
+            }
+        }
+    }
+    _uring_close(&(u->rx));
+    _uring_close(&(u->tx));
+    if (u->event >= 0) close(u->event);
+    if (u->buffers != 0) munmap(u->buffers, MULTIPLEX_URING_BUFFERS * sizeof(struct io_uring_buf));
+    if (!u->armed) free(u->data);
+    free(u);
+}
+
+static int _uring_watch(Multiplex * c) {
+    // register an eventfd for the reactor and queue a receive request
+    struct MultiplexUring * u = c->uring;
+    int r = 0;
+    if (u->event < 0) {
+        u->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (u->event < 0) return -1;
+        if (syscall(__NR_io_uring_register, u->rx.fd, IORING_REGISTER_EVENTFD, &(u->event), 1) < 0) {
+            close(u->event);
+            u->event = -1;
+            return -1;
+        }
+    }
+    if (multiplex_lock(c) != 0) return -1;
+#ifndef NO_MUTEX
+    if (c->reading) {
+        // the reading thread queues the request itself
+        multiplex_unlock(c);
+        return 0;
+    }
+#endif
+    if (!_uring_arm(c) || _uring_enter(&(u->rx), 0, 0) < 0) r = -1;
+    multiplex_unlock(c);
+    return r;
+}
+
+static struct MultiplexUring * _uring_new(int fd) {
+    struct MultiplexUring * u = (struct MultiplexUring *)calloc(1, sizeof(struct MultiplexUring));
+    struct stat st;
+    if (u == 0) return 0;
+    u->rx.fd = -1;
+    u->tx.fd = -1;
+    u->event = -1;
+    // completions that overflow the queue would only be seen by 'io_uring_enter',
+    // so it has room for one per receive buffer (plus failure, cancellation and wakeup)
+    if (!_uring_setup(&(u->rx), 4, 2 * MULTIPLEX_URING_BUFFERS) || !_uring_setup(&(u->tx), 64, 128)) {
+        _uring_free(u);
+        return 0;
+    }
+#ifdef IORING_RECV_MULTISHOT
+    if (fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode)) u->multishot = _uring_register_buffers(u);
+#endif
+    if (!u->multishot) {
+        free(u->data);
+        u->data = (char *)malloc(MULTIPLEX_URING_BUFFER_SIZE);
+        if (u->data == 0) {
+            _uring_free(u);
+            return 0;
+        }
+    }
+    return u;
+}
+#endif
+
+// ----------------------------------------------------------------------
+//
+//   SHARED MEMORY ENGINE
+//
+// ----------------------------------------------------------------------
+// With MULTIPLEX_ENGINE_SHM, frames are not written to the fd, but to a
+// ring buffer in shared memory (a memfd) read by the peer. Every peer
+// creates the ring it receives on, plus two eventfds (data available,
+// space available), and passes them to the other one over the Unix
+// socket (SCM_RIGHTS). Afterwards, the socket only tells that the peer
+// is gone.
+//
+// Each ring has a single producer (holding the send or write mutex)
+// and a single consumer (the thread owning the fd for reading). The
+// producer copies frames in and publishes them by advancing 'tail';
+// the consumer copies them to the staging buffer and advances 'head'.
+// A side that finds nothing to do spins for a while, then announces
+// that it is going to sleep ('readerWaiting'/'writerWaiting'), checks
+// again and waits for its eventfd. The other side only writes to that
+// eventfd if the flag is set, so a busy connection needs no system call
+// per frame.
+#ifdef MULTIPLEX_SHM
+#define _SHM_MAGIC 0x4d585348  // "MXSH", start of the handshake message
+#define _SHM_SPIN  256         // checks of the ring before going to sleep
+
+typedef struct ShmRing {
+    uint32_t tail;            // write position (producer)
+    uint32_t closed;          // 1 = the producer is gone
+    char pad0[56];
+    uint32_t head;            // read position (consumer)
+    char pad1[60];
+    uint32_t readerWaiting;   // 1 = the consumer waits for data
+    uint32_t writerWaiting;   // 1 = the producer waits for space
+    uint32_t size;            // capacity of 'data' (a power of two)
+    char pad2[52];
+    char data[];
+} ShmRing;
+
+struct MultiplexShm {
+    ShmRing * rx;             // ring written by the peer
+    ShmRing * tx;             // ring read by the peer
+    size_t rxSize;            // size of the mapping of 'rx'
+    size_t txSize;            // size of the mapping of 'tx'
+    int rxEvent;              // signalled when the peer wrote to 'rx'
+    int txEvent;              // signalled when the peer read from 'tx'
+    int peerRxEvent;          // signalled after writing to 'tx'
+    int peerTxEvent;          // signalled after reading from 'rx'
+    int closed;               // 1 = the socket was closed
+};
+
+static int _fd_wait(int fd, short events, int timeoutMs);
+
+// -- DOORBELLS
+static void _shm_ring(int event, uint32_t * waiting) {
+    // wake up the other side if it announced to sleep (the fence pairs
+    // with the one in '_shm_sleep')
+    uint64_t one = 1;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (_load(waiting) && __atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST)) {
+        ssize_t r = write(event, &one, sizeof(one));
+        (void)r;
+    }
+}
+
+static void _shm_reset(int event) {
+    uint64_t events = 0;
+    ssize_t r = read(event, &events, sizeof(events));
+    (void)r;
+}
+
+static int _shm_sleep(Multiplex * c, int event, uint32_t * waiting, uint32_t const * position, uint32_t seen, int timeoutMs) {
+    // wait until '*position' changes; returns 0 (check again), CHANNEL_TIMEOUT
+    // or CHANNEL_CLOSED
+    struct MultiplexShm * s = c->shm;
+    struct pollfd pfd[3];
+    int i = 0;
+    for (; i < _SHM_SPIN; ++i) if (_load(position) != seen) return 0;
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (_load(position) != seen) return 0;
+    pfd[0].fd = event;
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+    pfd[1].fd = c->fd;
+    pfd[1].events = POLLIN;
+    pfd[1].revents = 0;
+    pfd[2].fd = event == s->rxEvent && c->wakeWatch ? c->wakePipe[0] : -1;  // receiving only
+    pfd[2].events = POLLIN;
+    pfd[2].revents = 0;
+    if (poll(pfd, 3, timeoutMs) < 0) return errno == EINTR ? 0 : CHANNEL_CLOSED;
+    if (pfd[2].revents != 0 && _wakeup_drain(c)) return CHANNEL_WAKEUP;
+    if (pfd[0].revents & POLLIN) _shm_reset(event);
+    if (pfd[1].revents != 0) {
+        // the peer does not write to the socket, so this is end of file
+        _store(&(s->closed), 1);
+        return CHANNEL_CLOSED;
+    }
+    return pfd[0].revents != 0 || pfd[2].revents != 0 ? 0 : CHANNEL_TIMEOUT;
+}
+
+// -- RECEIVE
+static int _shm_fill(Multiplex * c, int timeoutMs) {
+    // same as '_fd_fill', copying from the receive ring
+    struct MultiplexShm * s = c->shm;
+    ShmRing * r = s->rx;
+    struct timespec deadline;
+    int end = c->rxOffset + c->rxLength, w = 0;
+    uint32_t head = r->head, available = 0, offset = 0, first = 0;
+    _deadline(&deadline, timeoutMs > 0 ? timeoutMs : 0);
+    while ((available = _load(&(r->tail)) - head) == 0) {
+        if (_load(&(r->closed))) return CHANNEL_CLOSED;
+        if (timeoutMs < 0) {
+            // reactor: make sure the peer signals the eventfd for the next data
+            _shm_reset(s->rxEvent);
+            __atomic_store_n(&(r->readerWaiting), 1, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (_load(&(r->tail)) != head) continue;
+            return 0;
+        }
+        if (_load(&(s->closed))) return CHANNEL_CLOSED;
+        if (_wakeup_pending(c)) return CHANNEL_WAKEUP;
+        w = _shm_sleep(c, s->rxEvent, &(r->readerWaiting), &(r->tail), head, _remaining_ms(&deadline));
+        if (w < 0) return w;
+    }
+    if (available > r->size) return CHANNEL_CLOSED;
+    if (available > (uint32_t)(c->rxCapacity - end)) available = (uint32_t)(c->rxCapacity - end);
+    offset = head & (r->size - 1);
+    first = r->size - offset < available ? r->size - offset : available;
+    memcpy(c->rx + end, r->data + offset, first);
+    memcpy(c->rx + end + first, r->data, available - first);
+    _store(&(r->head), head + available);
+    _shm_ring(s->peerTxEvent, &(r->writerWaiting));
+    c->rxLength += (int)available;
+    return (int)available;
+}
+
+// -- SEND
+static int _shm_writev(Multiplex * c, struct iovec * iov, int count) {
+    // same as '_fd_writev'; frames are published once all vectors are
+    // copied (or the ring is full, so a frame may be larger than the ring)
+    struct MultiplexShm * s = c->shm;
+    ShmRing * r = s->tx;
+    uint32_t tail = r->tail;
+    int total = 0, i = 0;
+    for (; i < count; ++i) {
+        char const * data = (char const *)iov[i].iov_base;
+        size_t length = iov[i].iov_len;
+        while (length > 0) {
+            uint32_t head = _load(&(r->head)), space = r->size - (tail - head);
+            uint32_t offset = tail & (r->size - 1), n = 0, first = 0;
+            if (_load(&(s->closed)) || _load(&(s->rx->closed))) {
+                errno = EPIPE;
+                return -1;
+            }
+            if (space == 0) {
+                _store(&(r->tail), tail);
+                _shm_ring(s->peerRxEvent, &(r->readerWaiting));
+                if (_shm_sleep(c, s->txEvent, &(r->writerWaiting), &(r->head), head, 1000) == CHANNEL_CLOSED) {
+                    errno = EPIPE;
+                    return -1;
+                }
+                continue;
+            }
+            n = length < space ? (uint32_t)length : space;
+            first = r->size - offset < n ? r->size - offset : n;
+            memcpy(r->data + offset, data, first);
+            memcpy(r->data, data + first, n - first);
+            tail += n;
+            data += n;
+            length -= n;
+            total += (int)n;
+        }
+    }
+    _store(&(r->tail), tail);
+    _shm_ring(s->peerRxEvent, &(r->readerWaiting));
+    return total;
+}
+
+// -- CREATE
+static void _shm_free(struct MultiplexShm * s) {
+    uint64_t one = 1;
+    if (s == 0) return;
+    if (s->tx != 0) {
+        // tell the peer (whether it sleeps or not)
+        ssize_t r = 0;
+        _store(&(s->tx->closed), 1);
+        r = write(s->peerRxEvent, &one, sizeof(one));
+        (void)r;
+        munmap(s->tx, s->txSize);
+    }
+    if (s->rx != 0) munmap(s->rx, s->rxSize);
+    if (s->rxEvent >= 0) close(s->rxEvent);
+    if (s->txEvent >= 0) close(s->txEvent);
+    if (s->peerRxEvent >= 0) close(s->peerRxEvent);
+    if (s->peerTxEvent >= 0) close(s->peerTxEvent);
+    free(s);
+}
+
+static int _shm_create(struct MultiplexShm * s) {
+    // creates the receive ring; returns its memfd, or -1
+    int memfd = (int)syscall(SYS_memfd_create, "multiplex", MFD_CLOEXEC);
+    s->rxSize = sizeof(ShmRing) + MULTIPLEX_SHM_RING_SIZE;
+    if (memfd < 0) return -1;
+    if (ftruncate(memfd, (off_t)s->rxSize) == 0) {
+        void * p = mmap(0, s->rxSize, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        if (p != MAP_FAILED) s->rx = (ShmRing *)p;
+    }
+    if (s->rx != 0) {
+        s->rx->size = MULTIPLEX_SHM_RING_SIZE;
+        s->rxEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        s->txEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    if (s->rx == 0 || s->rxEvent < 0 || s->txEvent < 0) {
+        close(memfd);
+        return -1;
+    }
+    return memfd;
+}
+
+static int _shm_send_handshake(int fd, int memfd, struct MultiplexShm * s) {
+    // the header tells whether the ring, the data and the space eventfd follow
+    uint32_t header[2];
+    int fds[3];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov;
+    struct msghdr msg;
+    ssize_t r = 0;
+    header[0] = _SHM_MAGIC;
+    header[1] = memfd >= 0;
+    iov.iov_base = header;
+    iov.iov_len = sizeof(header);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (memfd >= 0) {
+        struct cmsghdr * cmsg = 0;
+        fds[0] = memfd;
+        fds[1] = s->rxEvent;
+        fds[2] = s->txEvent;
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    }
+    while ((r = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+    return r == (ssize_t)sizeof(header) ? 0 : -1;
+}
+
+static int _shm_receive_handshake(int fd, int * fds) {
+    // returns 1 if the peer sent its ring (fds), 0 if it declined, or -1
+    uint32_t header[2];
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr * cmsg = 0;
+    size_t received = 0;
+    fds[0] = fds[1] = fds[2] = -1;
+    while (received < sizeof(header)) {
+        ssize_t r = 0;
+        if (!_fd_wait(fd, POLLIN, MULTIPLEX_SHM_TIMEOUT)) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        iov.iov_base = (char *)header + received;
+        iov.iov_len = sizeof(header) - received;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        r = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (r < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (r <= 0) return -1;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != 0; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(3 * sizeof(int)))
+                memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+        }
+        received += (size_t)r;
+    }
+    if (header[0] != _SHM_MAGIC) return -1;
+    return header[1] && fds[0] >= 0;
+}
+
+static int _shm_map(struct MultiplexShm * s, int memfd) {
+    // map the ring of the peer, making sure it fits into the file
+    struct stat st;
+    void * p = 0;
+    if (fstat(memfd, &st) != 0 || st.st_size <= (off_t)sizeof(ShmRing)) return 0;
+    p = mmap(0, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (p == MAP_FAILED) return 0;
+    s->tx = (ShmRing *)p;
+    s->txSize = (size_t)st.st_size;
+    return s->tx->size > 0 && (s->tx->size & (s->tx->size - 1)) == 0 &&
+           s->tx->size <= s->txSize - sizeof(ShmRing);
+}
+
+static int _shm_new(Multiplex * c) {
+    // exchange rings with the peer; returns 0 (c->shm is only set if both
+    // peers could create their ring) or -1 if the handshake failed
+    struct MultiplexShm * s = (struct MultiplexShm *)calloc(1, sizeof(struct MultiplexShm));
+    int memfd = -1, fds[3], r = 0, i = 0;
+    if (s != 0) {
+        s->rxEvent = s->txEvent = s->peerRxEvent = s->peerTxEvent = -1;
+        memfd = _shm_create(s);
+    }
+    if (_shm_send_handshake(c->fd, memfd, s) != 0) r = -1;
+    else r = _shm_receive_handshake(c->fd, fds);
+    if (memfd >= 0) close(memfd);
+    if (r > 0) {
+        if (memfd >= 0) {
+            s->peerRxEvent = fds[1];
+            s->peerTxEvent = fds[2];
+            fds[1] = fds[2] = -1;
+            // the peer is going to use its ring, there is no way back
+            if (_shm_map(s, fds[0])) c->shm = s;
+            else r = -1;
+        }
+        for (; i < 3; ++i) if (fds[i] >= 0) close(fds[i]);
+    }
+    if (c->shm == 0 && s != 0) {
+        if (s->tx != 0) munmap(s->tx, s->txSize);
+        s->tx = 0;
+        _shm_free(s);
+    }
+    return r < 0 ? -1 : 0;
+}
+
+static int _shm_watch(Multiplex * c) {
+    // the reactor reads once, announcing that the eventfd has to be signalled
+    uint64_t one = 1;
+    return write(c->shm->rxEvent, &one, sizeof(one)) == sizeof(one) ? 0 : -1;
+}
+#endif
+
+// -- ENGINE SELECTION
+Multiplex * multiplex_new_engine(int fd, int engine) {
+    Multiplex * m = multiplex_new(fd);
+#ifdef MULTIPLEX_URING
+    if (m != 0 && engine == MULTIPLEX_ENGINE_URING) m->uring = _uring_new(fd);
+#endif
+#ifdef MULTIPLEX_SHM
+    if (m != 0 && engine == MULTIPLEX_ENGINE_SHM && _shm_new(m) != 0) {
+        multiplex_free(m);
+        return 0;
+    }
+#endif
+    return m;
+}
+
+int multiplex_engine(Multiplex * c) {
+    if (c != 0 && c->shm != 0) return MULTIPLEX_ENGINE_SHM;
+    return c != 0 && c->uring != 0 ? MULTIPLEX_ENGINE_URING : MULTIPLEX_ENGINE_POLL;
+}
+
+static int _event_fd(Multiplex * c) {
+    // the fd that becomes readable when new data can be received
+#ifdef MULTIPLEX_URING
+    if (c->uring != 0) return c->uring->event;
+#endif
+#ifdef MULTIPLEX_SHM
+    if (c->shm != 0) return c->shm->rxEvent;
+#endif
+    return c->fd;
+}
+
+// ----------------------------------------------------------------------
+//
+//   LINK BONDING
+//
+// ----------------------------------------------------------------------
+// A bonded multiplexer has no fd of its own: it holds the channels, and
+// a link (a multiplexer pointing back to it through 'bond') per fd.
+// Sending picks the link the channel is pinned to and goes through that
+// link's send path (mutex, coalescing, scheduler). Pins never change, so
+// the frames of a channel arrive in the order they were sent. Credit is
+// kept by the bonded multiplexer, since the peer may return it on any
+// link; the protocol version is negotiated per link.
+Multiplex * multiplex_new_bonded(int const * fds, int count, int policy) {
+    Multiplex * m = 0;
+    int i = 0;
+    if (fds == 0 || count < 1 || count > MULTIPLEX_MAX_LINKS) return 0;
+    if ((m = multiplex_new(-1)) == 0) return 0;
+    m->links = (Multiplex **)calloc(count, sizeof(Multiplex *));
+    if (m->links == 0) {
+        multiplex_free(m);
+        return 0;
+    }
+    m->bondPolicy = policy;
+    for (; i < count; ++i) {
+        if ((m->links[i] = multiplex_new(fds[i])) == 0) {
+            multiplex_free(m);
+            return 0;
+        }
+        m->links[i]->bond = m;
+        ++m->linkCount;
+    }
+    return m;
+}
+
+static int _bond_pin(Multiplex * c, ChannelLeaf * leaf, unsigned int channelId, int link) {
+    // returns the link the channel is pinned to (the first pin wins); a
+    // new pin counts like a full staging buffer sent, so that channels
+    // starting at the same time are spread across the links
+    unsigned char pinned = 0;
+    if (!__atomic_compare_exchange_n(&(leaf->link[_low(channelId)]), &pinned, (unsigned char)(link + 1), 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return pinned - 1;
+    _add(&(c->links[link]->linkLoad), MULTIPLEX_RECEIVE_BUFFER_SIZE);
+    return link;
+}
+
+static Multiplex * _bond_link(Multiplex * c, unsigned int channelId) {
+    // the link carrying the channel, or 0 if out of memory
+    ChannelLeaf * leaf = _leaf_create(c, channelId);
+    int link = 0, i = 1;
+    if (leaf == 0) return 0;
+    if ((link = _load(&(leaf->link[_low(channelId)]))) != 0) return c->links[link - 1];
+    if (c->bondPolicy == MULTIPLEX_BOND_LEAST_LOADED) {
+        for (; i < c->linkCount; ++i)
+            if (_load(&(c->links[i]->linkLoad)) < _load(&(c->links[link]->linkLoad))) link = i;
+    }
+    else link = (int)(channelId % (unsigned int)c->linkCount);
+    return c->links[_bond_pin(c, leaf, channelId, link)];
+}
+
+int multiplex_pin(Multiplex * c, unsigned int channelId, int link) {
+    ChannelLeaf * leaf = 0;
+    if (c == 0 || c->links == 0 || link < 0 || link >= c->linkCount || channelId >= MULTIPLEX_MAX_CHANNELS) return -1;
+    if ((leaf = _leaf_create(c, channelId)) == 0) return -1;
+    return _bond_pin(c, leaf, channelId, link) == link ? 0 : -1;
+}
+
+// ----------------------------------------------------------------------
+// 
+//   RECEIVE LOGIC
+//
+// ----------------------------------------------------------------------
+// Incoming data is read into a staging buffer in as few 'read' calls
+// as possible. Every complete frame in it is dispatched to its channel
+// in one pass; a trailing partial frame is kept for the next read.
+// Frames that do not fit the staging buffer are streamed instead.
+static int _fd_wait(int fd, short events, int timeoutMs) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, timeoutMs) <= 0) return 0;
+    return pfd.revents != 0;
+}
+
+static int _wait_readable(Multiplex * c, int timeoutMs) {
+    // wait for the fd (and 'multiplex_wakeup'); returns 1 if it is
+    // readable, CHANNEL_TIMEOUT or CHANNEL_WAKEUP
+    struct pollfd pfd[2];
+    struct timespec deadline;
+    int r = 0;
+    if (!c->wakeWatch || c->wakePipe[0] < 0) return _fd_wait(c->fd, POLLIN, timeoutMs) ? 1 : CHANNEL_TIMEOUT;
+    _deadline(&deadline, timeoutMs);
+    while (!_wakeup_pending(c)) {
+        pfd[0].fd = c->fd;
+        pfd[1].fd = c->wakePipe[0];
+        pfd[0].events = pfd[1].events = POLLIN;
+        pfd[0].revents = pfd[1].revents = 0;
+        r = poll(pfd, 2, _remaining_ms(&deadline));
+        if (r == 0) return CHANNEL_TIMEOUT;
+        if (r < 0 && errno != EINTR) return 1;
+        if (pfd[0].revents != 0) return 1;
+        if (pfd[1].revents != 0) _wakeup_drain(c);
+    }
+    return CHANNEL_WAKEUP;
+}
+
+static int _reserve_staging(Multiplex * c) {
+    // make room behind the unparsed data (shrinking the buffer again once
+    // it is empty, the io_uring engine may have grown it)
+    int size = MULTIPLEX_RECEIVE_BUFFER_SIZE;
+    if (c->rxOffset > 0) {
+        memmove(c->rx, c->rx + c->rxOffset, c->rxLength);
+        c->rxOffset = 0;
+    }
+    if (c->rx == 0 || size > c->rxCapacity || (c->rxLength == 0 && c->rxCapacity > size)) {
+        char * rx = (char *)realloc(c->rx, size);
+        if (rx == 0) return 0;
+        c->rx = rx;
+        c->rxCapacity = size;
+    }
+    return 1;
+}
+
+// -- FORWARDING
+// The payload of a frame for a forwarded channel is written to the
+// target fd right from the staging buffer. If only part of it has been
+// read, the rest is moved from the fd to the target by the next calls
+// of '_fd_fill' (through a pipe using splice(), so it never enters user
+// space). Forwarded payloads are credited right away (flow control). A
+// target that takes nothing for MULTIPLEX_FORWARD_TIMEOUT ms has failed.
+static int _decode_id(unsigned char const * p, int length, unsigned int * id);
+static int _fd_try_writev(int fd, struct iovec * iov, int count);
+
+static int _write_all(int fd, char const * data, size_t length) {
+    struct iovec iov;
+    while (length > 0) {
+        int written = 0;
+        iov.iov_base = (void *)data;
+        iov.iov_len = length;
+        if ((written = _fd_try_writev(fd, &iov, 1)) < 0) return -1;
+        if (written == 0 && !_fd_wait(fd, POLLOUT, MULTIPLEX_FORWARD_TIMEOUT)) return -1;
+        data += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+#ifdef MULTIPLEX_SPLICE
+static int _fd_splice_target(int fd) {
+    // splice() into a socket blocks even with SPLICE_F_NONBLOCK, so sockets
+    // are written from the staging buffer instead
+    struct stat st;
+    return fstat(fd, &st) == 0 && !S_ISSOCK(st.st_mode);
+}
+#endif
+
+static void _forward_payload(Multiplex * c, ChannelBuffer * buf, char const * data, int length, unsigned long remaining) {
+    // write what has been received so far; the rest is forwarded by '_fd_fill'
+    c->forwardFd = buf->forward;
+    c->forwardChannel = buf->id;
+    c->forwardRemaining = remaining;
+    if (length > 0 && _write_all(buf->forward, data, (size_t)length) < 0) {
+        buf->forward = -1;
+        c->forwardFd = -1;
+    }
+    _credit_dropped(_table(c), buf->id, length + (int)remaining);
+}
+
+static void _forward_failed(Multiplex * c) {
+    // the target failed: drop the rest of the payload and stop forwarding
+    // the channel (unless it has been pointed at another fd meanwhile)
+    ChannelBuffer * buf = _channel(_table(c), c->forwardChannel);
+    if (buf != 0 && buf->forward == c->forwardFd) buf->forward = -1;
+    c->forwardFd = -1;
+}
+
+static int _forward_partial(Multiplex * c, unsigned char const * p, unsigned long dataLength, int more) {
+    // start forwarding an incomplete frame; returns 1 if it was consumed
+    Multiplex * table = _table(c);
+    unsigned int id = p[4];
+    int idLength = 1, staged = 0;
+    ChannelBuffer * buf = 0;
+#ifdef MULTIPLEX_URING
+    if (c->uring != 0) return 0;
+#endif
+#ifdef MULTIPLEX_SHM
+    if (c->shm != 0) return 0;
+#endif
+    if (c->rxVersion >= 2 && (idLength = _decode_id(p + 4, c->rxLength - 4, &id)) == 0) return 0;
+    if (id == MULTIPLEX_CONTROL_CHANNEL && table->control) return 0;
+    buf = _channel(table, id);
+    if (buf == 0 || buf->forward < 0) return 0;
+    staged = c->rxLength - 4 - idLength;
+    _trace(table, MULTIPLEX_TRACE_RECEIVED | (more ? MULTIPLEX_TRACE_MORE : 0), id, dataLength - idLength);
+    _count_received(table, id, (int)dataLength - idLength, !more);
+    _forward_payload(c, buf, (char const *)p + 4 + idLength, staged, dataLength - idLength - staged);
+    c->rxOffset = 0;
+    c->rxLength = 0;
+    return 1;
+}
+
+static int _fd_forward(Multiplex * c, int timeoutMs) {
+    // same as '_fd_fill', passing the bytes to the forwarding target
+    size_t length = c->forwardRemaining < (unsigned long)c->rxCapacity ? c->forwardRemaining : (size_t)c->rxCapacity;
+    ssize_t moved = -1;
+    int ready = 0;
+    if (timeoutMs >= 0 && (ready = _wait_readable(c, timeoutMs)) < 0) return ready;
+#ifdef MULTIPLEX_SPLICE
+    if (c->forwardFd >= 0 && c->forwardPipe[0] < 0 && pipe(c->forwardPipe) == 0) {
+        fcntl(c->forwardPipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(c->forwardPipe[1], F_SETFD, FD_CLOEXEC);
+    }
+    if (c->forwardFd >= 0 && c->forwardPipe[0] >= 0 && _fd_splice_target(c->forwardFd)) {
+        moved = syscall(SYS_splice, c->fd, 0, c->forwardPipe[1], 0, length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved > 0) {
+            // the pipe is emptied completely, so it never blocks the next splice
+            ssize_t left = moved;
+            while (left > 0) {
+                ssize_t r = syscall(SYS_splice, c->forwardPipe[0], 0, c->forwardFd, 0, (size_t)left, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (r > 0) left -= r;
+                else if (r < 0 && errno == EINTR) continue;
+                else if (r < 0 && errno == EAGAIN && _fd_wait(c->forwardFd, POLLOUT, MULTIPLEX_FORWARD_TIMEOUT)) continue;
+                else break;
+            }
+            if (left > 0) _forward_failed(c);
+            while (left > 0) {
+                // drop what is left in the pipe
+                ssize_t r = read(c->forwardPipe[0], c->rx, (size_t)left < (size_t)c->rxCapacity ? (size_t)left : (size_t)c->rxCapacity);
+                if (r <= 0) break;
+                left -= r;
+            }
+        }
+        else if (moved < 0 && errno == EINVAL) moved = -1;
+        else if (moved < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+        else if (moved == 0) return CHANNEL_CLOSED;
+    }
+#endif
+    if (moved < 0) {
+        // no splice() for these fds: copy through the (empty) staging buffer
+        moved = read(c->fd, c->rx, length);
+        if (moved < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+        if (moved <= 0) return CHANNEL_CLOSED;
+        if (c->forwardFd >= 0 && _write_all(c->forwardFd, c->rx, (size_t)moved) < 0) _forward_failed(c);
+    }
+    c->forwardRemaining -= (unsigned long)moved;
+    return (int)moved;
+}
+
+int multiplex_forward(Multiplex * c, unsigned int channelId, int fd) {
+    ChannelBuffer * buf = 0;
+    if (multiplex_lock(c) != 0) return -1;
+    if (fd >= 0) _enable_channel(c, channelId, 0);
+    buf = _channel(c, channelId);
+    if (buf != 0) buf->forward = fd;
+    multiplex_unlock(c);
+    return buf != 0 || fd < 0 ? 0 : -1;
+}
+
+// -- STREAMING
+// A frame that does not fit the staging buffer is passed on to its
+// channel piece by piece as it arrives, like a series of fragments, so
+// the staging buffer never grows beyond MULTIPLEX_RECEIVE_BUFFER_SIZE.
+// Payloads for channels in frame mode are read right into the frame
+// being reassembled, which is allocated for the whole payload up front.
+// Frames for disabled channels, or above a channel's 'maxFrame', are
+// drained without being buffered.
+#ifndef NO_MUTEX
+static void _notify(Multiplex * c, unsigned int channelId);
+#endif
+
+static int _accept_frame(ChannelBuffer * buf, unsigned long payloadLength, int more) {
+    // drops a payload above the channel's limit (and the rest of its fragments)
+    unsigned long length = payloadLength;
+    if (buf->maxFrame <= 0 || buf->discarding) return 1;
+    if (buf->framed && buf->partial != 0) length += (unsigned long)buf->partial->length;
+    if (length <= (unsigned long)buf->maxFrame) return 1;
+    _frames_discard(buf);
+    buf->discarding = more;
+    return 0;
+}
+
+static int _stream_start(Multiplex * c, unsigned char const * p, unsigned long dataLength, int more, int * channelId) {
+    // returns 1 if the frame is streamed, 0 if its channel ID is incomplete,
+    // or -1 if the ID is invalid
+    Multiplex * table = _table(c);
+    unsigned int id = p[4];
+    int idLength = 1;
+    ChannelBuffer * buf = 0;
+    if (c->rxVersion >= 2 && (idLength = _decode_id(p + 4, c->rxLength - 4, &id)) == 0)
+        return c->rxLength >= 8 ? -1 : 0;
+    buf = _channel(table, id);
+    c->rxStream = id;
+    c->rxRemaining = dataLength - idLength;
+    c->rxMore = more;
+    c->rxDrop = 0;
+    c->rxDirect = 0;
+    if (id == MULTIPLEX_CONTROL_CHANNEL && (table->control || buf == 0)) {
+        // no control message is that large
+        c->rxDrop = 1;
+    }
+    else if (buf == 0 || !_accept_frame(buf, c->rxRemaining, more)) {
+        c->rxDrop = 1;
+        _count_dropped(table, id);
+        if (*channelId < 0) *channelId = CHANNEL_IGNORED;
+    }
+    else if (buf->forward >= 0) _count_received(table, id, 0, !more);
+    else if (buf->framed && c->rxRemaining <= INT_MAX) _frames_reserve(buf, (int)c->rxRemaining);
+    if (id != MULTIPLEX_CONTROL_CHANNEL || (!table->control && buf != 0))
+        _trace(table, MULTIPLEX_TRACE_RECEIVED | (more ? MULTIPLEX_TRACE_MORE : 0), id, c->rxRemaining);
+    c->rxOffset += 4 + idLength;
+    c->rxLength -= 4 + idLength;
+    return 1;
+}
+
+static int _stream_payload(Multiplex * c, int * channelId) {
+    // pass what has been received of the streamed frame on; returns 1 if it
+    // is complete, or if its channel has new data to read
+    Multiplex * table = _table(c);
+    unsigned int id = c->rxStream;
+    ChannelBuffer * buf = _channel(table, id);
+    char const * data = c->rx + c->rxOffset;
+    int length = c->rxLength, readable = 0, more = 0;
+    if (c->rxDirect > 0) {
+        data = buf->partial->data + buf->partial->length;
+        length = c->rxDirect;
+    }
+    if ((unsigned long)length > c->rxRemaining) length = (int)c->rxRemaining;
+    more = c->rxMore || (unsigned long)length < c->rxRemaining;
+
+    if (c->rxDrop || buf == 0) {
+        if (id != MULTIPLEX_CONTROL_CHANNEL || !table->control) _credit_dropped(table, id, length);
+    }
+    else if (buf->forward >= 0) {
+        _count_received(table, id, length, 0);
+        _forward_payload(c, buf, data, length, 0);
+        if (buf->forward < 0) c->rxDrop = 1;
+    }
+    else if (_write_channel(table, id, data, 0, length, more)) {
+        _count_received(table, id, length, !more);
+        if (!more || !buf->framed) {
+#ifndef NO_MUTEX
+            _notify(table, id);
+#endif
+            if (*channelId < 0) *channelId = id;
+            readable = 1;
+        }
+    }
+    else if (errno == EAGAIN && table->pool->policy == MULTIPLEX_POOL_BLOCK) {
+        // keep the data in the staging buffer until memory is released
+        c->blocked = 1;
+        return 0;
+    }
+    else {
+        c->rxDrop = 1;
+        if (*channelId < 0) *channelId = CHANNEL_IGNORED;
+        _count_dropped(table, id);
+        _credit_dropped(table, id, length);
+    }
+
+    if (c->rxDirect > 0) c->rxDirect = 0;
+    else {
+        c->rxOffset += length;
+        c->rxLength -= length;
+    }
+    c->rxRemaining -= (unsigned long)length;
+    return readable || c->rxRemaining == 0;
+}
+
+static char * _direct_target(Multiplex * c, int * length) {
+    // where to read the streamed payload to, if not the staging buffer; never
+    // while other threads could disable the channel (concurrent mode)
+    ChannelBuffer * buf = 0;
+    ChannelFrame * f = 0;
+    if (c->rxRemaining == 0 || c->rxDrop || c->rxLength > 0 || c->rxRemaining > INT_MAX) return 0;
+#ifndef NO_MUTEX
+    if (_table(c)->reading) return 0;
+#endif
+    buf = _channel(_table(c), c->rxStream);
+    if (buf == 0 || !buf->framed || buf->forward >= 0 || buf->discarding) return 0;
+    if (!_frames_reserve(buf, (int)c->rxRemaining)) return 0;
+    f = buf->partial;
+    *length = (int)c->rxRemaining;
+    return f->data + f->length;
+}
+
+int multiplex_set_max_frame(Multiplex * c, unsigned int channelId, int maxBytes) {
+    ChannelBuffer * buf = 0;
+    if (multiplex_lock(c) != 0) return -1;
+    buf = _channel(c, channelId);
+    if (buf != 0) buf->maxFrame = maxBytes > 0 ? maxBytes : 0;
+    multiplex_unlock(c);
+    return buf != 0 ? 0 : -1;
+}
+
+static int _fd_fill(Multiplex * c, int timeoutMs) {
+    // a negative timeout reads without waiting (fd known to be readable)
+    int end = c->rxOffset + c->rxLength, bytesRead = 0, length = 0, r = 0;
+    char * target = 0;
+    if (c->forwardRemaining > 0) return _fd_forward(c, timeoutMs);
+#ifdef MULTIPLEX_URING
+    if (c->uring != 0) return _uring_fill(c, timeoutMs);
+#endif
+#ifdef MULTIPLEX_SHM
+    if (c->shm != 0) return _shm_fill(c, timeoutMs);
+#endif
+    if (timeoutMs >= 0 && (r = _wait_readable(c, timeoutMs)) < 0) return r;
+    if ((target = _direct_target(c, &length)) != 0) {
+        bytesRead = read(c->fd, target, length);
+        if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+        if (bytesRead <= 0) return CHANNEL_CLOSED;
+        c->rxDirect = bytesRead;
+        return bytesRead;
+    }
+    bytesRead = read(c->fd, c->rx + end, c->rxCapacity - end);
+    if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+    if (bytesRead <= 0) return CHANNEL_CLOSED;
+    c->rxLength += bytesRead;
+    return bytesRead;
+}
+
+// -- CONCURRENT MODE
+#ifndef NO_MUTEX
+static int _wait(Multiplex * c, pthread_cond_t * cond, int * waiters, struct timespec const * deadline) {
+    int r;
+    ++*waiters;
+    _hold_pause(c, lockedAt, lockHold);
+    r = pthread_cond_timedwait(cond, &(c->mutex), deadline);
+    _hold_resume(c, lockedAt);
+    --*waiters;
+    return r == ETIMEDOUT ? CHANNEL_TIMEOUT : 0;
+}
+
+static void _notify(Multiplex * c, unsigned int channelId) {
+    ChannelBuffer * buf = _channel(c, channelId);
+    if (buf != 0 && buf->waiters > 0) pthread_cond_broadcast(&(buf->cond));
+    if (c->setWaiting > 0) pthread_cond_broadcast(&(c->readable));
+    else if (c->selecting > 0) pthread_cond_signal(&(c->readable));
+}
+
+static void _handoff(Multiplex * c) {
+    // wake up a single waiting thread that can take over the fd
+    int channelId = 0;
+    if (c->reading) return;
+    if (c->selecting > 0 || c->setWaiting > 0) {
+        pthread_cond_signal(&(c->readable));
+        return;
+    }
+    channelId = _set_first(c, _SET_WAITING, 0);
+    if (channelId >= 0) pthread_cond_signal(&(_channel(c, channelId)->cond));
+}
+#endif
+
+static void _acquire_fd(Multiplex * c, int concurrent) {
+#ifndef NO_MUTEX
+    if (concurrent) {
+        c->reading = 1;
+        multiplex_unlock(c);
+    }
+#endif
+}
+
+static void _release_fd(Multiplex * c, int concurrent) {
+#ifndef NO_MUTEX
+    if (concurrent) {
+        multiplex_lock(c);
+        c->reading = 0;
+    }
+#endif
+}
+
+// -- FRAMES
+// v1 frames have a single byte channel ID, v2 frames a varint (7 bits
+// per byte, least significant first, high bit set if more follow).
+static int _decode_id(unsigned char const * p, int length, unsigned int * id) {
+    // returns the number of bytes used, or 0 if the ID is invalid
+    int i = 0;
+    *id = 0;
+    for (; i < 4 && i < length; ++i) {
+        *id |= (unsigned int)(p[i] & 0x7F) << (7 * i);
+        if ((p[i] & 0x80) == 0) return *id < MULTIPLEX_MAX_CHANNELS ? i + 1 : 0;
+    }
+    return 0;
+}
+
+static int _dispatch_frames(Multiplex * c, int * channelId) {
+    // returns the number of frames dispatched, or -1 if the stream is corrupt
+    Multiplex * table = _table(c);
+    int frames = 0;
+    c->blocked = 0;
+    while (c->rxLength > 0 || c->rxDirect > 0) {
+        unsigned char const * p = (unsigned char const *)c->rx + c->rxOffset;
+        unsigned long dataLength = 0;
+        unsigned int id = 0;
+        int idLength = 1, payloadLength = 0, more = 0, control = 0;
+        if (c->rxRemaining > 0) {
+            frames += _stream_payload(c, channelId);
+            if (c->blocked || c->rxRemaining > 0) break;
+            continue;
+        }
+        if (c->rxLength < 5) break;
+        dataLength = ((unsigned long)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        id = p[4];
+        if (c->rxVersion >= 3) {
+            more = (dataLength & _FRAGMENT) != 0;
+            dataLength &= ~_FRAGMENT;
+        }
+        if (dataLength == 0) return -1;
+        if ((unsigned long)(c->rxLength - 4) < dataLength) {
+            int r = 0;
+            if (_forward_partial(c, p, dataLength, more)) {
+                ++frames;
+                break;
+            }
+            if (4 + dataLength <= MULTIPLEX_RECEIVE_BUFFER_SIZE) break;
+            if ((r = _stream_start(c, p, dataLength, more, channelId)) < 0) return -1;
+            if (r == 0) break;
+            continue;
+        }
+        if (c->rxVersion >= 2 && (idLength = _decode_id(p + 4, (int)dataLength, &id)) == 0) return -1;
+        payloadLength = (int)dataLength - idLength;
+        control = id == MULTIPLEX_CONTROL_CHANNEL && (table->control || _channel(table, id) == 0);
+
+        if (control)
+            _control_received(c, p + 4 + idLength, payloadLength);
+        else if (_channel(table, id) != 0 && !_accept_frame(_channel(table, id), (unsigned long)payloadLength, more)) {
+            if (*channelId < 0) *channelId = CHANNEL_IGNORED;
+            _count_dropped(table, id);
+            _credit_dropped(table, id, payloadLength);
+        }
+        else if (_channel(table, id) != 0 && _channel(table, id)->forward >= 0) {
+            _count_received(table, id, payloadLength, !more);
+            _forward_payload(c, _channel(table, id), (char const *)p + 4 + idLength, payloadLength, 0);
+        }
+        else if (_channel(table, id) != 0) {
+            if (_write_channel(table, id, (char const *)p, 4 + idLength, payloadLength, more)) {
+                _count_received(table, id, payloadLength, !more);
+                if (!more || !_channel(table, id)->framed) {
+#ifndef NO_MUTEX
+                    _notify(table, id);
+#endif
+                    if (*channelId < 0) *channelId = id;
+                }
+            }
+            else if (errno == EAGAIN && table->pool->policy == MULTIPLEX_POOL_BLOCK) {
+                // keep the frame (and everything after it) in the staging buffer
+                c->blocked = 1;
+                break;
+            }
+            else {
+                if (*channelId < 0) *channelId = CHANNEL_IGNORED;
+                _count_dropped(table, id);
+                _credit_dropped(table, id, payloadLength);
+            }
+        }
+        else {
+            if (*channelId < 0) *channelId = CHANNEL_IGNORED;
+            _count_dropped(table, id);
+            _credit_dropped(table, id, payloadLength);
+        }
+        if (!control) _trace(table, MULTIPLEX_TRACE_RECEIVED | (more ? MULTIPLEX_TRACE_MORE : 0), id, (unsigned long)payloadLength);
+        c->rxOffset += 4 + (int)dataLength;
+        c->rxLength -= 4 + (int)dataLength;
+        ++frames;
+    }
+    if (c->rxLength == 0) c->rxOffset = 0;
+    return frames;
+}
+
+// -- BONDED LINKS
+// Every link of a bonded multiplexer has its own staging buffer (and
+// protocol version), but its frames are dispatched to the channels of
+// the bond. The fd owner polls all links at once and reads every
+// readable one; links are dispatched in turns, so that a busy link does
+// not always get to report its channels first.
+static int _bond_dispatch(Multiplex * c, int * channelId) {
+    // returns the number of frames dispatched, or -1 if a stream is corrupt
+    int i = 0, frames = 0, r = 0, first = c->linkNext;
+    c->blocked = 0;
+    c->linkNext = (first + 1) % c->linkCount;
+    for (; i < c->linkCount; ++i) {
+        Multiplex * link = c->links[(first + i) % c->linkCount];
+        if ((r = _dispatch_frames(link, channelId)) < 0) return -1;
+        frames += r;
+        if (link->blocked) c->blocked = 1;
+    }
+    return frames;
+}
+
+static int _bond_fill(Multiplex * c, int timeoutMs) {
+    // wait for any link (and 'multiplex_wakeup'); returns the number of
+    // bytes read, CHANNEL_TIMEOUT, CHANNEL_WAKEUP or CHANNEL_CLOSED
+    struct pollfd pfd[MULTIPLEX_MAX_LINKS + 1];
+    struct timespec deadline;
+    int i = 0, n = c->linkCount, count = n, total = 0, r = 0;
+    for (; i < n; ++i) {
+        pfd[i].fd = c->links[i]->fd;
+        pfd[i].events = POLLIN;
+    }
+    if (c->wakeWatch && c->wakePipe[0] >= 0) {
+        pfd[count].fd = c->wakePipe[0];
+        pfd[count++].events = POLLIN;
+    }
+    _deadline(&deadline, timeoutMs);
+    while (total == 0) {
+        if (_wakeup_pending(c)) return CHANNEL_WAKEUP;
+        for (i = 0; i < count; ++i) pfd[i].revents = 0;
+        r = poll(pfd, count, _remaining_ms(&deadline));
+        if (r == 0) return CHANNEL_TIMEOUT;
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return CHANNEL_CLOSED;
+        }
+        if (count > n && pfd[n].revents != 0) _wakeup_drain(c);
+        for (i = 0; i < n; ++i) {
+            if (pfd[i].revents == 0) continue;
+            if (!_reserve_staging(c->links[i])) return CHANNEL_CLOSED;
+            if ((r = _fd_fill(c->links[i], -1)) == CHANNEL_CLOSED) return r;
+            if (r > 0) total += r;
+        }
+    }
+    return total;
+}
+
+// -- receive at least one complete frame; returns the first channel that
+//    received data, CHANNEL_IGNORED if all frames were for disabled ones,
+//    or _CONTROL_ONLY if there were only control frames
+static int _receive_frames(Multiplex * c, int timeoutMs) {
+    struct timespec deadline;
+    int channelId = _CONTROL_ONLY, r = 0, concurrent = 0;
+
+    //
+#ifndef NO_MUTEX
+    concurrent = c->concurrent;
+#endif
+    _deadline(&deadline, timeoutMs);
+    while (1) {
+        unsigned int released = _pool_released(c->pool);
+        r = c->links != 0 ? _bond_dispatch(c, &channelId) : _dispatch_frames(c, &channelId);
+        if (r < 0) return CHANNEL_CLOSED;
+        if (r > 0) return channelId;
+        if (c->blocked) {
+            // out of memory: do not read any further until a chunk is released
+            _acquire_fd(c, concurrent);
+            r = _pool_wait(c->pool, released, &deadline);
+            _release_fd(c, concurrent);
+            if (r < 0) return r;
+            continue;
+        }
+        if (c->links == 0 && !_reserve_staging(c)) return CHANNEL_CLOSED;
+
+        _acquire_fd(c, concurrent);
+        r = c->links != 0 ? _bond_fill(c, _remaining_ms(&deadline)) : _fd_fill(c, _remaining_ms(&deadline));
+        _release_fd(c, concurrent);
+        if (r < 0) return r;
+    }
+}
+
+// -- SELECT
+#ifndef NO_MUTEX
+static int _select_concurrent(Multiplex * c, int timeoutMs) {
+    struct timespec deadline;
+    int r = 0;
+
+    _deadline(&deadline, timeoutMs);
+    while ((r = _ready_channel(c)) < 0) {
+        if (!c->reading) {
+            r = _receive_frames(c, _remaining_ms(&deadline));
+            if (r < 0 && r != CHANNEL_IGNORED && r != _CONTROL_ONLY) break;
+        }
+        else if (_wait(c, &(c->readable), &(c->selecting), &deadline) != 0) {
+            r = CHANNEL_TIMEOUT;
+            break;
+        }
+    }
+    _handoff(c);
+    return r;
+}
+#endif
+
+static int _select_channel(Multiplex * c, int timeoutMs) {
+    struct timespec deadline;
+    int r = 0;
+
+    //
+    if (c == 0) return CHANNEL_CLOSED;
+
+    // Check if data is available somewhere
+    r = _ready_channel(c);
+    if (r >= 0) return r;
+
+    //
+#ifndef NO_MUTEX
+    if (c->concurrent) return _select_concurrent(c, timeoutMs);
+#endif
+    _deadline(&deadline, timeoutMs);
+    do r = _receive_frames(c, _remaining_ms(&deadline));
+    while (r == _CONTROL_ONLY);
+    if (r < 0) return r;
+    r = _ready_channel(c);
+    return r >= 0 ? r : CHANNEL_IGNORED;
+}
+
+int multiplex_select(Multiplex * c, int timeoutMs) {
+    if (multiplex_lock(c) == 0) {
+        int r = _select_channel(c, timeoutMs);
+        if (r == CHANNEL_TIMEOUT) _count(&(c->stats.timeouts), 1);
+        multiplex_unlock(c);
+        return r;
+    }
+    return CHANNEL_CLOSED;
+}
+
+void multiplex_ignore(Multiplex * c, unsigned int channelId) {
+    if (multiplex_lock_channel(c, channelId) == 0) {
+        _channel(c, channelId)->newData = 0;
+        _set_remove(c, _SET_READY, channelId);
+        multiplex_unlock(c);
+    }
+}
+
+// -- RECEIVE
+#ifndef NO_MUTEX
+static int _receive_concurrent(Multiplex * c,
+                               int timeoutMs,
+                               unsigned int channelId,
+                               char * dst,
+                               int offset,
+                               int length) {
+    struct timespec deadline;
+    ChannelBuffer * buf = _channel(c, channelId);
+    int r = 0;
+
+    _deadline(&deadline, timeoutMs);
+    while (_channel_length(buf) == 0) {
+        if (!c->reading) {
+            r = _receive_frames(c, _remaining_ms(&deadline));
+            if (r < 0 && r != CHANNEL_IGNORED && r != _CONTROL_ONLY) break;
+        }
+        else {
+            _set_add(c, _SET_WAITING, channelId);
+            r = _wait(c, &(buf->cond), &(buf->waiters), &deadline);
+            if (buf->waiters == 0) _set_remove(c, _SET_WAITING, channelId);
+            if (r != 0) {
+                r = CHANNEL_TIMEOUT;
+                break;
+            }
+        }
+
+        // the channel might have been disabled in the meantime
+        buf = _channel(c, channelId);
+        if (buf == 0) {
+            r = CHANNEL_IGNORED;
+            break;
+        }
+    }
+    _handoff(c);
+    if (buf == 0 || _channel_length(buf) == 0) return r;
+    _lock_buffer(buf);
+    r = _read_channel(c, buf, dst, offset, length);
+    _unlock_buffer(buf);
+    return r;
+}
+#endif
+
+static int _receive_channel(Multiplex * c,
+                            int timeoutMs,
+                            unsigned int channelId,
+                            char * dst,
+                            int offset,
+                            int length) {
+    struct timespec deadline;
+    int receiveId = CHANNEL_IGNORED;
+    ChannelBuffer * buf = 0;
+    if (c == 0) return CHANNEL_CLOSED;
+    buf = _channel(c, channelId);
+    if (buf == 0) return CHANNEL_IGNORED;
+
+    // Check if data is already buffered.
+    if (_channel_length(buf) > 0) {
+        int r = 0;
+        _lock_buffer(buf);
+        r = _read_channel(c, buf, dst, offset, length);
+        _unlock_buffer(buf);
+        if (r > 0) return r;
+    }
+
+    // Wait for the thread currently reading from the fd
+#ifndef NO_MUTEX
+    if (c->concurrent) return _receive_concurrent(c, timeoutMs, channelId, dst, offset, length);
+#endif
+
+    // Receive on the given Channel (other channels may get data, too)
+    _deadline(&deadline, timeoutMs);
+    do receiveId = _receive_frames(c, _remaining_ms(&deadline));
+    while (receiveId == _CONTROL_ONLY);
+    if (receiveId < 0 && receiveId != CHANNEL_IGNORED) return receiveId;
+    if (_channel_length(buf) == 0) return CHANNEL_IGNORED;
+
+    // Copy from ChannelBuffer
+    _lock_buffer(buf);
+    receiveId = _read_channel(c, buf, dst, offset, length);
+    _unlock_buffer(buf);
+    return receiveId;
+}
+
+int multiplex_receive(Multiplex * c,
+                      int timeoutMs,
+                      unsigned int channelId,
+                      char * dst,
+                      int offset,
+                      int length) {
+    if (multiplex_lock(c) == 0) {
+        int r = _receive_channel(c, timeoutMs, channelId, dst, offset, length);
+        if (r == CHANNEL_TIMEOUT) _count_timeout(c, channelId);
+        multiplex_unlock(c);
+        return r;
+    }
+    return CHANNEL_CLOSED;
+}
+
+// -- WAIT SETS
+// The caller's set is matched against the bit sets of the channel table
+// 64 channel IDs at a time, starting after the channel found last, so
+// every channel of the set gets its turn.
+int multiplex_channel_set_add(MultiplexChannelSet * set, unsigned int channelId) {
+    unsigned int words = channelId / 64 + 1;
+    if (set == 0 || channelId >= MULTIPLEX_MAX_CHANNELS) return -1;
+    if (words > set->words) {
+        uint64_t * bits = (uint64_t *)realloc(set->bits, words * sizeof(uint64_t));
+        if (bits == 0) return -1;
+        memset(bits + set->words, 0, (words - set->words) * sizeof(uint64_t));
+        set->bits = bits;
+        set->words = words;
+    }
+    _bit_set(set->bits, channelId);
+    return 0;
+}
+
+void multiplex_channel_set_remove(MultiplexChannelSet * set, unsigned int channelId) {
+    if (set != 0 && channelId / 64 < set->words) _bit_clear(set->bits, channelId);
+}
+
+void multiplex_channel_set_clear(MultiplexChannelSet * set) {
+    if (set == 0) return;
+    if (set->bits != 0) free(set->bits);
+    set->bits = 0;
+    set->words = 0;
+    set->next = 0;
+}
+
+void multiplex_deadline(struct timespec * deadline, int timeoutMs) {
+    _deadline(deadline, timeoutMs);
+}
+
+static int _scan_set(Multiplex * c, MultiplexChannelSet * set, int fresh) {
+    // next channel of the set with new data ('fresh', like 'select') or with
+    // any buffered data, or -1
+    unsigned int start = 0, i = 0;
+    if (set->words == 0) return -1;
+    if (set->next >= set->words * 64) set->next = 0;
+    start = set->next / 64;
+    for (i = 0; i <= set->words; ++i) {
+        unsigned int word = (start + i) % set->words;
+        uint64_t bits = set->bits[word];
+        ChannelLeaf * leaf = 0;
+        if (i == 0) bits &= ~(uint64_t)0 << (set->next & 63);
+        else if (i == set->words) bits &= ~(~(uint64_t)0 << (set->next & 63));
+        if (bits == 0 || (leaf = _leaf(c, word * 64)) == 0) continue;
+        bits &= leaf->sets[fresh ? _SET_READY : _SET_ENABLED][word & 3];
+        for (; bits != 0; bits &= bits - 1) {
+            unsigned int channelId = word * 64 + (unsigned int)__builtin_ctzll(bits);
+            ChannelBuffer * buf = _channel(c, channelId);
+            if (fresh) _set_remove(c, _SET_READY, channelId);
+            if (buf != 0 && _channel_length(buf) > 0) {
+                set->next = channelId + 1;
+                return (int)channelId;
+            }
+        }
+    }
+    return -1;
+}
+
+static int _wait_set(Multiplex * c, MultiplexChannelSet * set, struct timespec const * deadline, int fresh) {
+    struct timespec until;
+    unsigned int seen = c->wakeupsSeen;
+    int r = 0, fds[2];
+
+    //
+    if (deadline != 0) until = *deadline;
+    else _deadline(&until, INT_MAX);
+    if (c->wakePipe[0] < 0 && pipe(fds) == 0) {
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, O_NONBLOCK);
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+        c->wakePipe[0] = fds[0];
+        _store(&(c->wakePipe[1]), fds[1]);
+    }
+
+    //
+    while ((r = _scan_set(c, set, fresh)) < 0) {
+        if (_load(&(c->wakeups)) != seen) {
+            r = CHANNEL_WAKEUP;
+            break;
+        }
+#ifndef NO_MUTEX
+        if (c->concurrent && c->reading) {
+            if (_wait(c, &(c->readable), &(c->setWaiting), &until) == 0) continue;
+            r = CHANNEL_TIMEOUT;
+        }
+        else
+#endif
+        {
+            c->wakeWatch = 1;
+            c->wakeSeen = seen;
+            r = _receive_frames(c, _remaining_ms(&until));
+            c->wakeWatch = 0;
+        }
+        if (r == CHANNEL_TIMEOUT && deadline == 0) _deadline(&until, INT_MAX);
+        else if (r < 0 && r != CHANNEL_IGNORED && r != _CONTROL_ONLY) break;
+    }
+    if (r == CHANNEL_WAKEUP) c->wakeupsSeen = _load(&(c->wakeups));
+#ifndef NO_MUTEX
+    if (c->concurrent) _handoff(c);
+#endif
+    return r;
+}
+
+int multiplex_select_set(Multiplex * c, MultiplexChannelSet * set, struct timespec const * deadline) {
+    if (set == 0) return CHANNEL_IGNORED;
+    if (multiplex_lock(c) == 0) {
+        int r = _wait_set(c, set, deadline, 1);
+        if (r == CHANNEL_TIMEOUT) _count(&(c->stats.timeouts), 1);
+        multiplex_unlock(c);
+        return r;
+    }
+    return CHANNEL_CLOSED;
+}
+
+int multiplex_receive_set(Multiplex * c, MultiplexChannelSet * set, struct timespec const * deadline,
+                          unsigned int * channelId, char * dst, int offset, int length) {
+    int r = 0;
+    if (set == 0) return CHANNEL_IGNORED;
+    if (multiplex_lock(c) != 0) return CHANNEL_CLOSED;
+    do {
+        // another consumer may have drained the channel in the meantime
+        ChannelBuffer * buf = 0;
+        if ((r = _wait_set(c, set, deadline, 0)) < 0) break;
+        if (channelId != 0) *channelId = (unsigned int)r;
+        buf = _channel(c, (unsigned int)r);
+        _lock_buffer(buf);
+        r = _read_channel(c, buf, dst, offset, length);
+        _unlock_buffer(buf);
+    } while (r == 0 && length > 0);
+    if (r == CHANNEL_TIMEOUT) _count(&(c->stats.timeouts), 1);
+    multiplex_unlock(c);
+    return r;
+}
+
+int multiplex_receive_batch(Multiplex * c, MultiplexChannelSet * set, MultiplexMessage * messages, int count,
+                            struct timespec const * deadline) {
+    int n = 0, r = 0, polled = 0;
+    if (set == 0 || messages == 0) return CHANNEL_IGNORED;
+    if (count <= 0) return 0;
+    if (multiplex_lock(c) != 0) return CHANNEL_CLOSED;
+    while (n < count) {
+        ChannelBuffer * buf = 0;
+        MultiplexMessage * m = messages + n;
+        if (n == 0) r = _wait_set(c, set, deadline, 0);
+        else if ((r = _scan_set(c, set, 0)) < 0) {
+            // read what else has arrived, without waiting (once)
+#ifndef NO_MUTEX
+            if (c->concurrent && c->reading) break;
+#endif
+            if (polled++ > 0 || _receive_frames(c, 0) == CHANNEL_CLOSED) break;
+#ifndef NO_MUTEX
+            if (c->concurrent) _handoff(c);
+#endif
+            continue;
+        }
+        if (r < 0) break;
+        buf = _channel(c, (unsigned int)r);
+        m->channelId = (unsigned int)r;
+        _lock_buffer(buf);
+        m->length = _read_channel(c, buf, m->data, 0, m->capacity);
+        _unlock_buffer(buf);
+        if (m->length > 0 || m->capacity <= 0) ++n;
+    }
+    if (n == 0 && r == CHANNEL_TIMEOUT) _count(&(c->stats.timeouts), 1);
+    multiplex_unlock(c);
+    return n > 0 ? n : r;
+}
+
+void multiplex_wakeup(Multiplex * c) {
+    // does not take the mutex, which a blocked receiver may hold
+    char byte = 1;
+    int fd = -1;
+    if (c == 0) return;
+    _add(&(c->wakeups), 1);
+    fd = _load(&(c->wakePipe[1]));
+    if (fd >= 0) {
+        ssize_t r = write(fd, &byte, 1);
+        (void)r;
+    }
+#ifndef NO_MUTEX
+    if (_load(&(c->concurrent)) && multiplex_lock(c) == 0) {
+        // threads waiting for the fd owner (no one holds the mutex for long)
+        pthread_cond_broadcast(&(c->readable));
+        multiplex_unlock(c);
+    }
+#endif
+}
+
+// -- EVENT LOOPS
+// For an external event loop, the fd is switched to non-blocking mode,
+// and every readiness event reads what is available. Incomplete frames
+// stay in the staging buffer until the rest arrives (also across
+// timeouts of 'select' and 'receive').
+static int _receive_available(Multiplex * c) {
+    // returns the number of frames dispatched, or CHANNEL_CLOSED; reading
+    // stops once a read does not fill the staging buffer, or when the
+    // pool is out of memory (MULTIPLEX_POOL_BLOCK)
+    int frames = 0, r = 1, n = 0, room = 0, closed = 0, channelId = CHANNEL_IGNORED;
+    if (c->links != 0) {
+        // every link reads what it has (the epoll instance does not tell which)
+        c->blocked = 0;
+        for (; n < c->linkCount; ++n) {
+            if ((r = _receive_available(c->links[n])) == CHANNEL_CLOSED) closed = 1;
+            else frames += r;
+            if (c->links[n]->blocked) c->blocked = 1;
+        }
+        return closed && frames == 0 ? CHANNEL_CLOSED : frames;
+    }
+    while (1) {
+        if ((n = _dispatch_frames(c, &channelId)) < 0) return CHANNEL_CLOSED;
+        frames += n;
+        if (r < room || c->blocked) return frames;
+        if (!_reserve_staging(c)) return CHANNEL_CLOSED;
+        room = c->rxCapacity - c->rxOffset - c->rxLength;
+        r = _fd_fill(c, -1);
+        if (r == CHANNEL_CLOSED) return frames > 0 ? frames : CHANNEL_CLOSED;
+        if (r < 0) return frames;
+    }
+}
+
+static int _bond_fileno(Multiplex * c) {
+    // an epoll instance watching all links (created by the first call)
+#ifdef __linux__
+    struct epoll_event event;
+    int i = 0, flags = 0;
+    for (; i < c->linkCount; ++i) {
+        flags = fcntl(c->links[i]->fd, F_GETFL);
+        if (flags < 0 || fcntl(c->links[i]->fd, F_SETFL, flags | O_NONBLOCK) < 0) return -1;
+    }
+    if (c->fd >= 0) return c->fd;
+    if ((c->fd = epoll_create1(EPOLL_CLOEXEC)) < 0) return -1;
+    for (i = 0; i < c->linkCount; ++i) {
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        if (epoll_ctl(c->fd, EPOLL_CTL_ADD, c->links[i]->fd, &event) < 0) {
+            close(c->fd);
+            c->fd = -1;
+            return -1;
+        }
+    }
+    return c->fd;
+#else
+    (void)c;
+    return -1;
+#endif
+}
+
+int multiplex_fileno(Multiplex * c) {
+    int flags = 0;
+    if (c == 0) return -1;
+    if (c->links != 0) return _bond_fileno(c);
+    flags = fcntl(c->fd, F_GETFL);
+    if (flags < 0 || fcntl(c->fd, F_SETFL, flags | O_NONBLOCK) < 0) return -1;
+#ifdef MULTIPLEX_URING
+    if (c->uring != 0 && _uring_watch(c) < 0) return -1;
+#endif
+#ifdef MULTIPLEX_SHM
+    if (c->shm != 0 && _shm_watch(c) < 0) return -1;
+#endif
+    return _event_fd(c);
+}
+
+int multiplex_on_readable(Multiplex * c) {
+    int r = 0;
+    if (multiplex_lock(c) != 0) return CHANNEL_CLOSED;
+#ifndef NO_MUTEX
+    if (c->reading) {
+        // the thread owning the fd reads it anyway
+        multiplex_unlock(c);
+        return 0;
+    }
+#endif
+    r = _receive_available(c);
+    multiplex_unlock(c);
+    return r;
+}
+
+// ----------------------------------------------------------------------
+//
+//   REACTOR
+//
+// ----------------------------------------------------------------------
+// A reactor watches the file descriptors of many multiplexers using a
+// single epoll set. Whenever one becomes readable, the reactor reads
+// what is available (without blocking), dispatches the frames, and
+// reports every channel with new data as a (multiplex, channel) event.
+// Multiplexers whose events did not fit into the caller's array are
+// remembered and reported first by the next call.
+#ifdef __linux__
+MultiplexReactor * multiplex_reactor_new(void) {
+    MultiplexReactor * r = (MultiplexReactor *)calloc(1, sizeof(MultiplexReactor));
+    if (r != 0) {
+        r->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (r->epfd < 0) {
+            free(r);
+            return 0;
+        }
+    }
+    return r;
+}
+
+void multiplex_reactor_free(MultiplexReactor * r) {
+    if (r == 0) return;
+    close(r->epfd);
+    if (r->pending != 0) free(r->pending);
+    if (r->blocked != 0) free(r->blocked);
+    free(r);
+}
+
+int multiplex_reactor_add(MultiplexReactor * r, Multiplex * c) {
+    struct epoll_event ev;
+    int fd = -1;
+    if (r == 0 || (fd = multiplex_fileno(c)) < 0) return -1;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    return epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int multiplex_reactor_remove(MultiplexReactor * r, Multiplex * c) {
+    int i = 0;
+    if (r == 0 || c == 0) return -1;
+    for (; i < r->pendingCount; ++i) {
+        if (r->pending[i] == c) {
+            r->pending[i--] = r->pending[--r->pendingCount];
+        }
+    }
+    for (i = 0; i < r->blockedCount; ++i) {
+        if (r->blocked[i] == c) {
+            r->blocked[i--] = r->blocked[--r->blockedCount];
+        }
+    }
+    return epoll_ctl(r->epfd, EPOLL_CTL_DEL, _event_fd(c), 0);
+}
+
+static int _reactor_push(Multiplex *** list, int * count, int * capacity, Multiplex * c) {
+    if (*count == *capacity) {
+        int newCapacity = *capacity > 0 ? *capacity * 2 : 16;
+        Multiplex ** entries = (Multiplex **)realloc(*list, newCapacity * sizeof(Multiplex *));
+        if (entries == 0) return 0;
+        *list = entries;
+        *capacity = newCapacity;
+    }
+    (*list)[(*count)++] = c;
+    return 1;
+}
+
+static int _reactor_defer(MultiplexReactor * r, Multiplex * c) {
+    return _reactor_push(&(r->pending), &(r->pendingCount), &(r->pendingCapacity), c);
+}
+
+static void _reactor_arm(MultiplexReactor * r, Multiplex * c, unsigned int events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(r->epfd, EPOLL_CTL_MOD, _event_fd(c), &ev);
+}
+
+static int _reactor_collect(MultiplexReactor * r, Multiplex * c, MultiplexEvent * events, int count, int maxEvents) {
+    // report all channels of 'c' with new data; the mutex has to be held
+    int channelId = 0;
+    while (count < maxEvents && (channelId = _ready_channel(c)) >= 0) {
+        events[count].multiplex = c;
+        events[count].channelId = channelId;
+        ++count;
+    }
+    if (count == maxEvents) _reactor_defer(r, c);
+    return count;
+}
+
+static int _reactor_read(MultiplexReactor * r, Multiplex * c, MultiplexEvent * events, int count, int maxEvents) {
+    int frames = 0, wasBlocked = 0;
+    if (multiplex_lock(c) != 0) return count;
+
+    // in concurrent mode, another thread might currently be reading
+#ifndef NO_MUTEX
+    if (c->reading) {
+        if (c->blocked) _reactor_push(&(r->blocked), &(r->blockedCount), &(r->blockedCapacity), c);
+        multiplex_unlock(c);
+        return count;
+    }
+#endif
+    wasBlocked = c->blocked;
+    frames = _receive_available(c);
+    if (frames >= 0 && c->blocked) {
+        // stop watching the fd until the pool has memory again
+        if (!wasBlocked) _reactor_arm(r, c, 0);
+        _reactor_push(&(r->blocked), &(r->blockedCount), &(r->blockedCapacity), c);
+    }
+    else if (frames >= 0 && wasBlocked) _reactor_arm(r, c, EPOLLIN);
+    if (frames == CHANNEL_CLOSED) {
+        epoll_ctl(r->epfd, EPOLL_CTL_DEL, _event_fd(c), 0);
+        events[count].multiplex = c;
+        events[count].channelId = CHANNEL_CLOSED;
+        ++count;
+    }
+    else count = _reactor_collect(r, c, events, count, maxEvents);
+    multiplex_unlock(c);
+    return count;
+}
+
+int multiplex_reactor_wait(MultiplexReactor * r, MultiplexEvent * events, int maxEvents, int timeoutMs) {
+    struct epoll_event ready[64];
+    struct timespec deadline;
+    int count = 0, n = 0, i = 0, deferred = 0, blocked = 0;
+    if (r == 0 || events == 0 || maxEvents <= 0) return -1;
+
+    // events left over from the last call
+    deferred = r->pendingCount;
+    r->pendingCount = 0;
+    for (i = 0; i < deferred; ++i) {
+        Multiplex * c = r->pending[i];
+        if (count == maxEvents) {
+            r->pending[r->pendingCount++] = c;
+            continue;
+        }
+        if (multiplex_lock(c) == 0) {
+            count = _reactor_collect(r, c, events, count, maxEvents);
+            multiplex_unlock(c);
+        }
+    }
+
+    // multiplexers waiting for memory: retry the frames in their staging buffer
+    blocked = r->blockedCount;
+    r->blockedCount = 0;
+    for (i = 0; i < blocked; ++i) {
+        Multiplex * c = r->blocked[i];
+        if (count == maxEvents) {
+            r->blocked[r->blockedCount++] = c;
+            continue;
+        }
+        count = _reactor_read(r, c, events, count, maxEvents);
+    }
+    if (count > 0) timeoutMs = 0;
+    else if (r->blockedCount > 0 && (timeoutMs < 0 || timeoutMs > 10)) timeoutMs = 10;
+
+    // keep waiting while readable fds only deliver partial frames
+    _deadline(&deadline, timeoutMs);
+    do {
+        while ((n = epoll_wait(r->epfd, ready, maxEvents - count < 64 ? maxEvents - count : 64, timeoutMs)) < 0) {
+            // io_uring completes receive requests in this thread, interrupting the wait
+            if (errno != EINTR) return -1;
+            if (timeoutMs > 0) timeoutMs = _remaining_ms(&deadline);
+        }
+        for (i = 0; i < n; ++i) {
+            Multiplex * c = (Multiplex *)ready[i].data.ptr;
+            if (count == maxEvents) {
+                // already readable, level-triggered epoll will report it again
+                break;
+            }
+            count = _reactor_read(r, c, events, count, maxEvents);
+        }
+        if (timeoutMs > 0) timeoutMs = _remaining_ms(&deadline);
+    } while (count == 0 && n > 0 && timeoutMs != 0);
+    return count;
+}
+#endif
+
+// ----------------------------------------------------------------------
+//
+//   WORKER POOL
+//
+// ----------------------------------------------------------------------
+// In dispatch mode, a reader thread demultiplexes the fd, and channels
+// with a handler are queued for a pool of workers when they receive
+// data (instead of being marked ready for 'select'). A channel is in at
+// most one queue at a time ('scheduled' stays set while a worker handles
+// it), so its frames are handled in order by one worker, while other
+// channels are handled in parallel. Every worker has its own queue
+// (channels are assigned by ID, so a busy channel tends to stay on one
+// core) and steals from the others once it runs out of work. A worker
+// handles at most MULTIPLEX_DISPATCH_BATCH frames of a channel before
+// putting it back at the end of the queue.
+#ifndef NO_MUTEX
+#ifndef MULTIPLEX_DISPATCH_BATCH
+#define MULTIPLEX_DISPATCH_BATCH 64     // frames (or chunks) handled per turn
+#endif
+#define MULTIPLEX_DISPATCH_CHUNK 65536  // data passed per call for stream channels
+#define MULTIPLEX_DISPATCH_POLL  50     // ms the reader waits before checking for 'stop'
+
+typedef struct WorkerQueue {
+    struct MultiplexWorkers * pool;  // pool of the worker owning this queue
+    pthread_mutex_t lock;            // protects the queue
+    unsigned int * ids;              // ring of channel IDs
+    int head;                        // oldest entry
+    int count;                       // number of entries
+    int capacity;                    // capacity of 'ids' (a power of two)
+} WorkerQueue;
+
+struct MultiplexWorkers {
+    Multiplex * c;            // multiplexer being served
+    pthread_t reader;         // reads from the fd
+    pthread_t * threads;      // workers
+    WorkerQueue * queues;     // one per worker
+    int count;                // number of workers
+    int running;              // 0 = stop
+    int closed;               // 1 = the fd was closed
+    pthread_mutex_t mutex;    // protects 'idle'
+    pthread_cond_t cond;      // wakes idle workers
+    int idle;                 // workers waiting on 'cond'
+};
+
+// -- QUEUES
+static int _queue_push(WorkerQueue * q, unsigned int channelId) {
+    pthread_mutex_lock(&(q->lock));
+    if (q->count == q->capacity) {
+        int capacity = q->capacity > 0 ? q->capacity * 2 : 64, i = 0;
+        unsigned int * ids = (unsigned int *)malloc(capacity * sizeof(unsigned int));
+        if (ids == 0) {
+            pthread_mutex_unlock(&(q->lock));
+            return -1;
+        }
+        for (; i < q->count; ++i) ids[i] = q->ids[(q->head + i) & (q->capacity - 1)];
+        if (q->ids != 0) free(q->ids);
+        q->ids = ids;
+        q->head = 0;
+        q->capacity = capacity;
+    }
+    q->ids[(q->head + q->count) & (q->capacity - 1)] = channelId;
+    ++q->count;
+    pthread_mutex_unlock(&(q->lock));
+    return 0;
+}
+
+static int _queue_pop(WorkerQueue * q, int steal, unsigned int * channelId) {
+    // the owner takes the oldest entry, thieves the newest
+    int found = 0;
+    pthread_mutex_lock(&(q->lock));
+    if (q->count > 0) {
+        --q->count;
+        if (steal) *channelId = q->ids[(q->head + q->count) & (q->capacity - 1)];
+        else {
+            *channelId = q->ids[q->head];
+            q->head = (q->head + 1) & (q->capacity - 1);
+        }
+        found = 1;
+    }
+    pthread_mutex_unlock(&(q->lock));
+    return found;
+}
+
+static int _queues_empty(struct MultiplexWorkers * w) {
+    int i = 0, empty = 1;
+    for (; i < w->count && empty; ++i) {
+        pthread_mutex_lock(&(w->queues[i].lock));
+        empty = w->queues[i].count == 0;
+        pthread_mutex_unlock(&(w->queues[i].lock));
+    }
+    return empty;
+}
+
+static void _wake_worker(struct MultiplexWorkers * w) {
+    pthread_mutex_lock(&(w->mutex));
+    if (w->idle > 0) pthread_cond_signal(&(w->cond));
+    pthread_mutex_unlock(&(w->mutex));
+}
+
+static int _next_channel(struct MultiplexWorkers * w, int self, unsigned int * channelId) {
+    // returns 0 once the pool is stopped
+    int i = 0;
+    while (1) {
+        if (_queue_pop(&(w->queues[self]), 0, channelId)) return 1;
+        for (i = 1; i < w->count; ++i)
+            if (_queue_pop(&(w->queues[(self + i) % w->count]), 1, channelId)) return 1;
+        pthread_mutex_lock(&(w->mutex));
+        if (!_load(&(w->running))) {
+            pthread_mutex_unlock(&(w->mutex));
+            return 0;
+        }
+        if (_queues_empty(w)) {
+            ++w->idle;
+            pthread_cond_wait(&(w->cond), &(w->mutex));
+            --w->idle;
+        }
+        pthread_mutex_unlock(&(w->mutex));
+    }
+}
+
+// -- SCHEDULE
+static int _channel_pending(struct MultiplexWorkers * w, ChannelBuffer * buf) {
+    // called holding the consumer lock
+    if (buf->handler == 0) return 0;
+    if (buf->framed ? _frames_first(buf) != 0 : _channel_length(buf) > 0) return 1;
+    return _load(&(w->closed)) && !buf->closeReported;
+}
+
+static void _schedule_channel(Multiplex * c, ChannelBuffer * buf) {
+    // called holding the mutex, after data arrived (or the fd was closed);
+    // the fence pairs with the one in '_finish_channel'
+    struct MultiplexWorkers * w = c->workers;
+    int expected = 0;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_compare_exchange_n(&(buf->scheduled), &expected, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        return;
+    if (_queue_push(&(w->queues[buf->id % w->count]), buf->id) != 0) {
+        // out of memory: leave the channel to 'select'
+        _store(&(buf->scheduled), 0);
+        _mark_ready(c, buf->id);
+        return;
+    }
+    _wake_worker(w);
+}
+
+static int _lock_worker_channel(Multiplex * c, ChannelBuffer * buf) {
+    // returns 0 if the channel was disabled since it was scheduled
+    ChannelBuffer * locked = multiplex_lock_consumer(c, buf->id);
+    if (locked == buf) return 1;
+    if (locked != 0) multiplex_unlock_consumer(c, locked);
+    return 0;
+}
+
+static int _finish_channel(struct MultiplexWorkers * w, ChannelBuffer * buf) {
+    // returns 1 if the worker has to go on, since data arrived after the
+    // channel was found empty and nobody else scheduled it (the consumer
+    // lock keeps a worker that takes over from popping in the meantime)
+    int expected = 0, pending = 0;
+    if (!_lock_worker_channel(w->c, buf)) return 0;
+    __atomic_store_n(&(buf->scheduled), 0, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    pending = _channel_pending(w, buf);
+    multiplex_unlock_consumer(w->c, buf);
+    return pending && __atomic_compare_exchange_n(&(buf->scheduled), &expected, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+// -- HANDLE
+static int _handle_data(struct MultiplexWorkers * w, ChannelBuffer * buf, char * chunk) {
+    // passes the next frame (or chunk of stream data) to the handler, or
+    // tells it that the fd was closed; returns 0 if there was nothing to do
+    Multiplex * c = w->c;
+    MultiplexHandler handler = 0;
+    void * context = 0;
+    ChannelFrame * f = 0;
+    char const * data = 0;
+    int length = 0;
+    if (!_lock_worker_channel(c, buf)) return 0;
+    handler = buf->handler;
+    context = buf->context;
+    if (handler != 0) {
+        if (!buf->framed) length = _read_channel(c, buf, chunk, 0, MULTIPLEX_DISPATCH_CHUNK);
+        else if ((f = _frames_first(buf)) != 0) {
+            buf->leased = 1;
+            data = f->data + buf->frameOffset;
+            length = f->length - buf->frameOffset;
+        }
+        if (f == 0 && length == 0 && _load(&(w->closed)) && !buf->closeReported) {
+            buf->closeReported = 1;
+            length = CHANNEL_CLOSED;
+        }
+    }
+    multiplex_unlock_consumer(c, buf);
+    if (f == 0 && length == 0) return 0;
+    if (f == 0) {
+        handler(c, buf->id, length > 0 ? chunk : 0, length, context);
+        return length > 0;
+    }
+
+    // frames are passed in place
+    handler(c, buf->id, data, length, context);
+    multiplex_release_frame(c, buf->id);
+    return 1;
+}
+
+static void _handle_channel(struct MultiplexWorkers * w, int self, unsigned int channelId, char * chunk) {
+    ChannelBuffer * buf = _channel(w->c, channelId);
+    int n = 0;
+    if (buf == 0) return;
+    do {
+        for (n = 0; n < MULTIPLEX_DISPATCH_BATCH; ++n)
+            if (!_handle_data(w, buf, chunk)) break;
+        // give other channels a turn (or go on if the queue cannot grow)
+        if (n == MULTIPLEX_DISPATCH_BATCH && _queue_push(&(w->queues[self]), channelId) == 0) return;
+    } while (n == MULTIPLEX_DISPATCH_BATCH || _finish_channel(w, buf));
+}
+
+// -- THREADS
+static void * _worker(void * ptr) {
+    WorkerQueue * q = (WorkerQueue *)ptr;
+    struct MultiplexWorkers * w = q->pool;
+    int self = (int)(q - w->queues);
+    unsigned int channelId = 0;
+    char * chunk = (char *)malloc(MULTIPLEX_DISPATCH_CHUNK);
+    if (chunk == 0) return 0;
+    while (_next_channel(w, self, &channelId)) _handle_channel(w, self, channelId, chunk);
+    free(chunk);
+    return 0;
+}
+
+static void * _reader(void * ptr) {
+    struct MultiplexWorkers * w = (struct MultiplexWorkers *)ptr;
+    Multiplex * c = w->c;
+    struct timespec deadline;
+    int r = 0, i = -1;
+    multiplex_lock(c);
+    while (_load(&(w->running))) {
+        if (!c->reading) r = _receive_frames(c, MULTIPLEX_DISPATCH_POLL);
+        else {
+            _deadline(&deadline, MULTIPLEX_DISPATCH_POLL);
+            r = _wait(c, &(c->readable), &(c->selecting), &deadline);
+        }
+        if (r == CHANNEL_CLOSED) {
+            // every handler is told once its data has been handled
+            _store(&(w->closed), 1);
+            while ((i = _set_first(c, _SET_ENABLED, i + 1)) >= 0)
+                if (_channel(c, i)->handler != 0) _schedule_channel(c, _channel(c, i));
+            break;
+        }
+    }
+    _handoff(c);
+    multiplex_unlock(c);
+    return 0;
+}
+
+static void _workers_free(struct MultiplexWorkers * w, int threads, int queues) {
+    int i = 0;
+    _store(&(w->running), 0);
+    pthread_mutex_lock(&(w->mutex));
+    pthread_cond_broadcast(&(w->cond));
+    pthread_mutex_unlock(&(w->mutex));
+    for (i = 0; i < threads; ++i) pthread_join(w->threads[i], 0);
+    for (i = 0; i < queues; ++i) {
+        if (w->queues[i].ids != 0) free(w->queues[i].ids);
+        pthread_mutex_destroy(&(w->queues[i].lock));
+    }
+    pthread_cond_destroy(&(w->cond));
+    pthread_mutex_destroy(&(w->mutex));
+    free(w->queues);
+    free(w->threads);
+    free(w);
+}
+
+static struct MultiplexWorkers * _workers_new(Multiplex * c, int count) {
+    struct MultiplexWorkers * w = (struct MultiplexWorkers *)calloc(1, sizeof(struct MultiplexWorkers));
+    int i = 0;
+    if (w == 0) return 0;
+    w->c = c;
+    w->count = count;
+    w->running = 1;
+    w->threads = (pthread_t *)calloc(count, sizeof(pthread_t));
+    w->queues = (WorkerQueue *)calloc(count, sizeof(WorkerQueue));
+    if (w->threads == 0 || w->queues == 0 || pthread_mutex_init(&(w->mutex), 0) != 0) {
+        if (w->threads != 0) free(w->threads);
+        if (w->queues != 0) free(w->queues);
+        free(w);
+        return 0;
+    }
+    if (pthread_cond_init(&(w->cond), 0) != 0) {
+        pthread_mutex_destroy(&(w->mutex));
+        free(w->threads);
+        free(w->queues);
+        free(w);
+        return 0;
+    }
+    for (; i < count; ++i) {
+        w->queues[i].pool = w;
+        if (pthread_mutex_init(&(w->queues[i].lock), 0) != 0) {
+            _workers_free(w, 0, i);
+            return 0;
+        }
+    }
+    for (i = 0; i < count; ++i) {
+        if (pthread_create(&(w->threads[i]), 0, _worker, &(w->queues[i])) != 0) {
+            _workers_free(w, i, count);
+            return 0;
+        }
+    }
+    return w;
+}
+#endif
+
+// -- API
+#ifndef NO_MUTEX
+static int _on_channel(Multiplex * c, unsigned int channelId, MultiplexHandler handler, void * context) {
+    ChannelBuffer * buf = _channel(c, channelId);
+    if (buf == 0 && handler != 0) {
+        _enable_channel(c, channelId, 1);
+        buf = _channel(c, channelId);
+        if (buf != 0 && !_frames_init(buf)) {
+            _disable_channel(c, channelId);
+            buf = 0;
+        }
+        if (buf != 0) buf->framed = 1;
+    }
+    if (buf == 0) return -1;
+    _lock_buffer(buf);
+    buf->handler = handler;
+    buf->context = context;
+    buf->closeReported = 0;
+    _unlock_buffer(buf);
+
+    // data that arrived before is handed to the workers (or back to 'select')
+    if (_channel_length(buf) > 0 || (buf->framed && _frames_first(buf) != 0)) {
+        if (handler != 0 && c->workers != 0) {
+            _set_remove(c, _SET_READY, channelId);
+            _schedule_channel(c, buf);
+        }
+        else if (handler == 0) _mark_ready(c, channelId);
+    }
+    return 0;
+}
+#endif
+
+int multiplex_on(Multiplex * c, unsigned int channelId, MultiplexHandler handler, void * context) {
+#ifndef NO_MUTEX
+    int r = -1;
+    if (multiplex_lock(c) != 0) return -1;
+    r = _on_channel(c, channelId, handler, context);
+    multiplex_unlock(c);
+    return r;
+#else
+    return -1;
+#endif
+}
+
+int multiplex_on_range(Multiplex * c, unsigned int minChannelId, unsigned int maxChannelId, MultiplexHandler handler, void * context) {
+#ifndef NO_MUTEX
+    unsigned int i = minChannelId;
+    int r = 0;
+    if (multiplex_lock(c) != 0) return -1;
+    if (maxChannelId >= MULTIPLEX_MAX_CHANNELS) maxChannelId = MULTIPLEX_MAX_CHANNELS - 1;
+    for (; i <= maxChannelId; ++i)
+        if (_on_channel(c, i, handler, context) != 0) r = -1;
+    multiplex_unlock(c);
+    return r;
+#else
+    return -1;
+#endif
+}
+
+int multiplex_start_workers(Multiplex * c, int workers) {
+#ifndef NO_MUTEX
+    struct MultiplexWorkers * w = 0;
+    int i = -1;
+    if (workers <= 0 || multiplex_lock(c) != 0) return -1;
+    if (c->workers != 0 || (w = _workers_new(c, workers)) == 0) {
+        multiplex_unlock(c);
+        return -1;
+    }
+    if (pthread_create(&(w->reader), 0, _reader, w) != 0) {
+        _workers_free(w, workers, workers);
+        multiplex_unlock(c);
+        return -1;
+    }
+    c->workers = w;
+    c->concurrent = 1;
+    while ((i = _set_first(c, _SET_ENABLED, i + 1)) >= 0) {
+        ChannelBuffer * buf = _channel(c, i);
+        if (buf->handler != 0 && (_channel_length(buf) > 0 || (buf->framed && _frames_first(buf) != 0))) {
+            _set_remove(c, _SET_READY, i);
+            _schedule_channel(c, buf);
+        }
+    }
+    multiplex_unlock(c);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+void multiplex_stop_workers(Multiplex * c) {
+#ifndef NO_MUTEX
+    struct MultiplexWorkers * w = 0;
+    int i = -1;
+    if (c == 0 || (w = c->workers) == 0) return;
+    _store(&(w->running), 0);
+    pthread_join(w->reader, 0);
+    multiplex_lock(c);
+    c->workers = 0;
+    multiplex_unlock(c);
+    _workers_free(w, w->count, w->count);
+
+    // unhandled data is left to 'select'
+    multiplex_lock(c);
+    while ((i = _set_first(c, _SET_ENABLED, i + 1)) >= 0) {
+        ChannelBuffer * buf = _channel(c, i);
+        _store(&(buf->scheduled), 0);
+        if (buf->handler != 0 && (_channel_length(buf) > 0 || (buf->framed && _frames_first(buf) != 0)))
+            _mark_ready(c, i);
+    }
+    multiplex_unlock(c);
+#endif
+}
+
+// ----------------------------------------------------------------------
+//
+//   SEND LOGIC
+//
+// ----------------------------------------------------------------------
+// The header is sent from a small stack buffer, followed by the caller's
+// payload vectors; 'writev' is repeated until everything is written.
+static void _iov_advance(struct iovec ** iov, int * count, size_t bytes) {
+    // skip 'bytes' already written
+    while (*count > 0 && bytes >= (*iov)->iov_len) {
+        bytes -= (*iov)->iov_len;
+        ++*iov;
+        --*count;
+    }
+    if (*count > 0) {
+        (*iov)->iov_base = (char *)(*iov)->iov_base + bytes;
+        (*iov)->iov_len -= bytes;
+    }
+}
+
+static int _fd_writev(int fd, struct iovec * iov, int count) {
+    int total = 0;
+    ssize_t bytesWritten = 0;
+
+    while (count > 0) {
+        bytesWritten = writev(fd, iov, count > IOV_MAX ? IOV_MAX : count);
+        if (bytesWritten < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            _fd_wait(fd, POLLOUT, -1);
+            continue;
+        }
+        total += (int)bytesWritten;
+        _iov_advance(&iov, &count, (size_t)bytesWritten);
+    }
+    return total;
+}
+
+static int _writev(Multiplex * c, struct iovec * iov, int count) {
+    // write using the engine of the multiplexer
+#ifdef MULTIPLEX_URING
+    if (c->uring != 0) return _uring_writev(c, iov, count);
+#endif
+#ifdef MULTIPLEX_SHM
+    if (c->shm != 0) return _shm_writev(c, iov, count);
+#endif
+    return _fd_writev(c->fd, iov, count);
+}
+
+// -- QUEUED FRAMES
+// What 'multiplex_broadcast' cannot write to a target without blocking is
+// queued on that target (in order, holding the send mutex). The payload
+// is copied once for all targets into a reference counted buffer; every
+// entry has its own copy of the (short) header.
+typedef struct SharedPayload {
+    int refs;          // queue entries using the payload (+ the broadcast)
+    int length;        // bytes in 'data'
+    char data[];
+} SharedPayload;
+
+typedef struct QueuedFrame {
+    struct QueuedFrame * next;    // next frame to be written
+    SharedPayload * payload;      // payload of the frame
+    unsigned char header[8];      // encoded header
+    int headerLength;             // bytes in 'header'
+    int offset;                   // bytes of header and payload written already
+} QueuedFrame;
+
+static SharedPayload * _payload_new(char const * data, int length) {
+    SharedPayload * p = (SharedPayload *)malloc(sizeof(SharedPayload) + length);
+    if (p == 0) return 0;
+    p->refs = 1;
+    p->length = length;
+    if (length > 0) memcpy(p->data, data, length);
+    return p;
+}
+
+static void _payload_release(SharedPayload * p) {
+    if (_add(&(p->refs), -1) == 0) free(p);
+}
+
+static int _fd_try_writev(int fd, struct iovec * iov, int count) {
+    // write what the fd takes without blocking; returns the number of bytes or -1.
+    // A blocking pipe only returns from a write once all of it is written, so
+    // fds other than sockets and regular files get PIPE_BUF bytes at most
+    // (which fit if they poll writable)
+    struct msghdr msg;
+    struct stat st;
+    ssize_t r = 0;
+    size_t left = PIPE_BUF, saved = 0;
+    int n = 0;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count > IOV_MAX ? IOV_MAX : count;
+    r = sendmsg(fd, &msg, MSG_DONTWAIT);
+    if (r < 0 && errno == ENOTSOCK) {
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) r = writev(fd, iov, msg.msg_iovlen);
+        else if (!_fd_wait(fd, POLLOUT, 0)) r = 0;
+        else {
+            while (n < (int)msg.msg_iovlen - 1 && iov[n].iov_len <= left) left -= iov[n++].iov_len;
+            saved = iov[n].iov_len;
+            if (saved > left) iov[n].iov_len = left;
+            r = writev(fd, iov, n + 1);
+            iov[n].iov_len = saved;
+        }
+    }
+    if (r < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    return (int)r;
+}
+
+static void _queued_pop(Multiplex * c) {
+    QueuedFrame * q = c->outHead;
+    c->outHead = q->next;
+    if (c->outHead == 0) c->outTail = 0;
+    _payload_release(q->payload);
+    free(q);
+}
+
+static void _queued_free(Multiplex * c) {
+    while (c->outHead != 0) _queued_pop(c);
+}
+
+static int _queued_write(Multiplex * c, int wait) {
+    // write queued frames (the send mutex has to be held); without 'wait', only
+    // as much as the fd takes right away. Returns the number of bytes written,
+    // or -1 (dropping the queue, since the stream is broken anyway)
+    int total = 0, r = 0;
+    while (c->outHead != 0) {
+        QueuedFrame * q = c->outHead;
+        struct iovec iov[2], * vec = iov;
+        int count = 2, length = q->headerLength + q->payload->length - q->offset;
+        iov[0].iov_base = q->header;
+        iov[0].iov_len = q->headerLength;
+        iov[1].iov_base = q->payload->data;
+        iov[1].iov_len = q->payload->length;
+        _iov_advance(&vec, &count, (size_t)q->offset);
+        r = wait ? _fd_writev(c->fd, vec, count) : _fd_try_writev(c->fd, vec, count);
+        if (r < 0) {
+            _queued_free(c);
+            return -1;
+        }
+        total += r;
+        if (r < length) {
+            q->offset += r;
+            break;
+        }
+        _queued_pop(c);
+    }
+    return total;
+}
+
+// -- COALESCING
+// Small frames are appended to 'tx' and the sender returns right away.
+// A flusher thread writes the batch once the oldest frame in it has
+// waited 'txDelayUs'; a sender that pushes the batch beyond 'txThreshold'
+// writes it itself. Flushing swaps in the spare buffer and passes from
+// the send mutex to the write mutex, so batches are written in order
+// while other threads already fill the next one.
+#ifndef NO_MUTEX
+static int _flush_locked(Multiplex * c, struct iovec const * iov, int count) {
+    struct iovec stackVec[17], * vec = stackVec;
+    char * batch = c->tx;
+    int n = 0, r = 0;
+
+    //
+    if (count + 1 > 17) {
+        vec = (struct iovec *)malloc((count + 1) * sizeof(struct iovec));
+        if (vec == 0) return -1;
+    }
+    if (c->txLength > 0) {
+        vec[n].iov_base = batch;
+        vec[n].iov_len = c->txLength;
+        ++n;
+    }
+    if (count > 0) memcpy(vec + n, iov, count * sizeof(struct iovec));
+    n += count;
+    c->tx = c->txSpare;
+    c->txSpare = 0;
+    c->txLength = 0;
+
+    //
+    pthread_mutex_lock(&(c->writeMutex));
+    multiplex_unlock_send(c);
+    if (n > 0) r = _writev(c, vec, n);
+    pthread_mutex_unlock(&(c->writeMutex));
+    multiplex_lock_send(c);
+
+    // recycle the batch buffer
+    if (c->tx == 0) c->tx = batch;
+    else if (c->txSpare == 0) c->txSpare = batch;
+    else free(batch);
+    if (vec != stackVec) free(vec);
+    return r;
+}
+
+static int _append_locked(Multiplex * c, struct iovec const * iov, int count) {
+    int i = 0;
+    if (c->tx == 0) {
+        c->tx = (char *)malloc(c->txCapacity);
+        if (c->tx == 0) return 0;
+    }
+    if (c->txLength == 0) {
+        _deadline_us(&(c->txDeadline), c->txDelayUs);
+        pthread_cond_signal(&(c->txCond));
+    }
+    for (; i < count; ++i) {
+        memcpy(c->tx + c->txLength, iov[i].iov_base, iov[i].iov_len);
+        c->txLength += (int)iov[i].iov_len;
+    }
+    return 1;
+}
+
+static void * _flusher(void * ptr) {
+    Multiplex * c = (Multiplex *)ptr;
+    multiplex_lock_send(c);
+    while (c->txRunning) {
+        int r = 0;
+        _hold_pause(c, sendLockedAt, sendHold);
+        if (c->txLength == 0) pthread_cond_wait(&(c->txCond), &(c->sendMutex));
+        else r = pthread_cond_timedwait(&(c->txCond), &(c->sendMutex), &(c->txDeadline));
+        _hold_resume(c, sendLockedAt);
+        if (r == ETIMEDOUT && c->txLength > 0) _flush_locked(c, 0, 0);
+    }
+    multiplex_unlock_send(c);
+    return 0;
+}
+
+static int _send_coalesced(Multiplex * c, struct iovec const * vec, int count, int frameLength, int flags) {
+    int r = 0;
+
+    // large or urgent frames go out immediately (together with the batch)
+    if ((flags & MULTIPLEX_URGENT) || frameLength >= c->txThreshold) {
+        r = _flush_locked(c, vec, count);
+        return r < 0 ? -1 : frameLength;
+    }
+
+    //
+    if (!_append_locked(c, vec, count)) return -1;
+    if (c->txLength >= c->txThreshold) r = _flush_locked(c, 0, 0);
+    return r < 0 ? -1 : frameLength;
+}
+
+static void _stop_flusher(Multiplex * c) {
+    // called with the send mutex held
+    if (c->txRunning) {
+        c->txRunning = 0;
+        pthread_cond_signal(&(c->txCond));
+        multiplex_unlock_send(c);
+        pthread_join(c->txThread, 0);
+        multiplex_lock_send(c);
+    }
+    if (c->txLength > 0) _flush_locked(c, 0, 0);
+    if (c->tx != 0) free(c->tx);
+    if (c->txSpare != 0) free(c->txSpare);
+    c->tx = 0;
+    c->txSpare = 0;
+    c->txThreshold = 0;
+}
+#endif
+
+void multiplex_set_coalescing(Multiplex * c, int thresholdBytes, int delayUs) {
+#ifndef NO_MUTEX
+    int i = 0;
+    if (c == 0) return;
+    for (; c->links != 0 && i < c->linkCount; ++i) multiplex_set_coalescing(c->links[i], thresholdBytes, delayUs);
+    if (c->links == 0 && multiplex_lock_send(c) == 0) {
+        _stop_flusher(c);
+        if (thresholdBytes > 0) {
+            c->txThreshold = thresholdBytes;
+            c->txCapacity = 2 * thresholdBytes;
+            c->txDelayUs = delayUs > 0 ? delayUs : 0;
+            c->txRunning = 1;
+            if (pthread_create(&(c->txThread), 0, &_flusher, c) != 0) {
+                c->txRunning = 0;
+                c->txThreshold = 0;
+            }
+        }
+        multiplex_unlock_send(c);
+    }
+#endif
+}
+
+int multiplex_flush(Multiplex * c) {
+    int r = 0, i = 0, n = 0;
+    if (c == 0) return -1;
+    if (c->links != 0) {
+        for (; i < c->linkCount && r >= 0; ++i)
+            if ((n = multiplex_flush(c->links[i])) < 0) r = -1;
+            else r += n;
+        return r;
+    }
+    if (multiplex_lock_send(c) != 0) return -1;
+    if (c->outHead != 0) r = _queued_write(c, 1);
+#ifndef NO_MUTEX
+    if (r >= 0 && c->txLength > 0) r = (n = _flush_locked(c, 0, 0)) < 0 ? -1 : r + n;
+#endif
+    multiplex_unlock_send(c);
+    return r;
+}
+
+// -- CREDIT
+// A sender without enough credit reads from the fd itself until the
+// peer's credit update arrives (frames for other channels are buffered
+// as usual), or waits for the thread that currently owns the fd.
+static int _await_control(Multiplex * c, struct timespec const * deadline) {
+    // process incoming frames until a control frame might have changed
+    // the state; the mutex has to be held
+    int r = 0;
+#ifndef NO_MUTEX
+    if (c->concurrent && c->reading) {
+        r = _wait(c, &(c->controlCond), &(c->controlWaiters), deadline);
+        return r == CHANNEL_TIMEOUT && _remaining_ms(deadline) > 0 ? 0 : r;
+    }
+#endif
+    r = _receive_frames(c, _remaining_ms(deadline));
+#ifndef NO_MUTEX
+    _handoff(c);
+#endif
+    return r == CHANNEL_IGNORED || r == _CONTROL_ONLY ? 0 : r;
+}
+
+static int _await_credit(Multiplex * c, int * used, int needed) {
+    struct timespec deadline;
+    int r = 0;
+    if (multiplex_lock(c) != 0) return -1;
+    while (c->window - _load(used) < needed) {
+        _deadline(&deadline, 100);
+        r = _await_control(c, &deadline);
+        if (r == CHANNEL_CLOSED) break;
+    }
+    multiplex_unlock(c);
+    return r == CHANNEL_CLOSED ? -1 : 0;
+}
+
+static int _take_credit(Multiplex * c, unsigned int channelId, int length, int flags) {
+    int needed = length < c->window ? length : c->window;
+    ChannelLeaf * leaf = _leaf_create(c, channelId);
+    int * used = 0;
+    if (leaf == 0) return -1;
+    used = &(leaf->used[_low(channelId)]);
+    while (1) {
+        int current = _load(used);
+        if (c->window - current >= needed) {
+            if (__atomic_compare_exchange_n(used, &current, current + length, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                return 0;
+            continue;
+        }
+        if (flags & MULTIPLEX_NONBLOCK) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (_await_credit(c, used, needed) != 0) return -1;
+    }
+}
+
+static void _return_credit(Multiplex * c, unsigned int channelId, int length) {
+    // give back what '_take_credit' took for a frame that was not sent
+    ChannelLeaf * leaf = c->window > 0 ? _leaf(c, channelId) : 0;
+    if (leaf != 0) _add(&(leaf->used[_low(channelId)]), -length);
+}
+
+// -- NEGOTIATE
+static int _tx_version(Multiplex * c) {
+    // a bonded multiplexer uses the lowest version of its links
+    int i = 0, version = 0;
+    if (c->links == 0) return _load(&(c->txVersion));
+    version = _load(&(c->links[0]->txVersion));
+    for (i = 1; i < c->linkCount; ++i)
+        if (_load(&(c->links[i]->txVersion)) < version) version = _load(&(c->links[i]->txVersion));
+    _store(&(c->txVersion), version);
+    return version;
+}
+
+int multiplex_negotiate(Multiplex * c, int timeoutMs) {
+    struct timespec deadline;
+    int r = 0, i = 0;
+    if (multiplex_lock(c) != 0) return CHANNEL_CLOSED;
+    if (!c->control && _channel(c, MULTIPLEX_CONTROL_CHANNEL) != 0) {
+        // the control channel is used for data
+        multiplex_unlock(c);
+        return 1;
+    }
+    c->control = 1;
+    c->maxVersion = MULTIPLEX_VERSION;
+    for (; i < (c->links != 0 ? c->linkCount : 1); ++i) {
+        Multiplex * link = c->links != 0 ? c->links[i] : c;
+        link->maxVersion = MULTIPLEX_VERSION;
+        _send_hello(link);
+        if (link->peerVersion >= 2) _send_upgrade(link);
+    }
+
+    //
+    _deadline(&deadline, timeoutMs);
+    while (_tx_version(c) < 2 && r != CHANNEL_CLOSED) {
+        r = _await_control(c, &deadline);
+        if (_remaining_ms(&deadline) == 0) break;
+    }
+    r = r == CHANNEL_CLOSED ? CHANNEL_CLOSED : _tx_version(c);
+    multiplex_unlock(c);
+    return r;
+}
+
+// -- SCHEDULER
+// With fragmentation, senders take turns for every fragment. A sender
+// queues a ticket and waits until it is granted; when a turn ends, the
+// next ticket is granted (possibly the next fragment of the same
+// sender, which is queued first): the highest priority first, then the
+// lowest virtual start time (start-time fair queuing: a channel's next
+// fragment starts where its last one finished, at the earliest at the
+// current virtual time, and finishes after 'bytes / weight'). Fragments
+// of one payload must not interleave with another payload for the same
+// channel, so such tickets wait until the payload is complete. The
+// queue has its own mutex, which is never held while writing.
+#ifndef NO_MUTEX
+typedef struct SendTicket {
+    struct SendTicket * next;  // next ticket in 'schedQueue'
+    pthread_cond_t cond;       // signalled when the ticket is granted
+    ChannelLeaf * leaf;        // leaf of the channel
+    unsigned int channelId;    // channel to send on
+    int priority;              // 0 .. MULTIPLEX_PRIORITIES (control frames)
+    int more;                  // 1 = the fragment is followed by another one
+    int continued;             // 1 = the payload has been started
+    int granted;               // 1 = it is this sender's turn
+    uint64_t start;            // virtual start time
+} SendTicket;
+
+static int _ticket_init(Multiplex * c, SendTicket * t, unsigned int channelId, int flags) {
+    t->leaf = _leaf_create(c, channelId);
+    if (t->leaf == 0 || pthread_cond_init(&(t->cond), 0) != 0) return -1;
+    t->channelId = channelId;
+    t->continued = 0;
+    t->granted = 0;
+    t->priority = _load(&(t->leaf->priority[_low(channelId)]));
+    if ((flags & MULTIPLEX_URGENT) || (_table(c)->control && channelId == MULTIPLEX_CONTROL_CHANNEL))
+        t->priority = MULTIPLEX_PRIORITIES;
+    return 0;
+}
+
+static void _turn_grant(Multiplex * c) {
+    // hand the turn to the best eligible ticket (holding 'schedMutex')
+    SendTicket ** p = &(c->schedQueue), ** best = 0;
+    for (; *p != 0; p = &((*p)->next)) {
+        SendTicket * t = *p;
+        if (t->leaf->fragmenting[_low(t->channelId)] && !t->continued) continue;
+        if (best == 0 || t->priority > (*best)->priority ||
+            (t->priority == (*best)->priority && t->start < (*best)->start))
+            best = p;
+    }
+    if (best == 0) {
+        c->schedBusy = 0;
+        return;
+    }
+    {
+        SendTicket * t = *best;
+        *best = t->next;
+        c->schedBusy = 1;
+        c->schedClock[t->priority] = t->start;
+        t->leaf->fragmenting[_low(t->channelId)] = (unsigned char)t->more;
+        t->continued = 1;
+        t->granted = 1;
+        pthread_cond_signal(&(t->cond));
+    }
+}
+
+static void _turn_take(Multiplex * c, SendTicket * t, size_t bytes, int more) {
+    // queue the next fragment; a sender still having its turn (after the
+    // previous fragment) only gives it up now, so that its next fragment
+    // competes with the waiting ones
+    unsigned int low = _low(t->channelId);
+    int weight = 0, holding = t->granted;
+    SendTicket ** p = &(c->schedQueue);
+
+    pthread_mutex_lock(&(c->schedMutex));
+    weight = t->leaf->weight[low] > 0 ? t->leaf->weight[low] : 1;
+    t->start = t->leaf->finish[low] > c->schedClock[t->priority] ? t->leaf->finish[low] : c->schedClock[t->priority];
+    t->leaf->finish[low] = t->start + (uint64_t)bytes * 256 / weight;
+    t->more = more;
+    t->granted = 0;
+    t->next = 0;
+    while (*p != 0) p = &((*p)->next);
+    *p = t;
+    if (!c->schedBusy || holding) _turn_grant(c);
+    while (!t->granted) pthread_cond_wait(&(t->cond), &(c->schedMutex));
+    pthread_mutex_unlock(&(c->schedMutex));
+}
+
+static void _turn_pass(Multiplex * c, SendTicket * t) {
+    // the payload is complete (or failed)
+    pthread_mutex_lock(&(c->schedMutex));
+    t->leaf->fragmenting[_low(t->channelId)] = 0;
+    t->granted = 0;
+    _turn_grant(c);
+    pthread_mutex_unlock(&(c->schedMutex));
+}
+#endif
+
+int multiplex_set_fragmentation(Multiplex * c, int fragmentBytes) {
+    int i = 0;
+    if (c == 0 || fragmentBytes < 0) return -1;
+    for (; c->links != 0 && i < c->linkCount; ++i) multiplex_set_fragmentation(c->links[i], fragmentBytes);
+    if (multiplex_lock_send(c) != 0) return -1;
+    c->fragmentSize = fragmentBytes;
+    multiplex_unlock_send(c);
+    return 0;
+}
+
+int multiplex_set_priority(Multiplex * c, unsigned int channelId, int priority, int weight) {
+#ifndef NO_MUTEX
+    ChannelLeaf * leaf = 0;
+    int i = 0;
+#endif
+    if (c == 0 || channelId >= MULTIPLEX_MAX_CHANNELS || priority < 0 || priority >= MULTIPLEX_PRIORITIES ||
+        weight < 1 || weight > 255) return -1;
+#ifndef NO_MUTEX
+    // the links schedule their own senders
+    for (; c->links != 0 && i < c->linkCount; ++i)
+        if (multiplex_set_priority(c->links[i], channelId, priority, weight) != 0) return -1;
+    leaf = _leaf_create(c, channelId);
+    if (leaf == 0) return -1;
+    pthread_mutex_lock(&(c->schedMutex));
+    _store(&(leaf->priority[_low(channelId)]), (unsigned char)priority);
+    leaf->weight[_low(channelId)] = (unsigned char)weight;
+    pthread_mutex_unlock(&(c->schedMutex));
+#endif
+    return 0;
+}
+
+// -- SEND
+static int _iov_slice(struct iovec * dst, struct iovec const * src, int count, size_t offset, size_t length) {
+    // the vectors covering 'length' bytes of 'src', starting at 'offset'; returns their number
+    int n = 0;
+    for (; count > 0 && offset >= src->iov_len; ++src, --count) offset -= src->iov_len;
+    for (; count > 0 && length > 0; ++src, --count) {
+        size_t available = src->iov_len - offset;
+        if (available == 0) continue;
+        dst[n].iov_base = (char *)src->iov_base + offset;
+        dst[n].iov_len = available < length ? available : length;
+        length -= dst[n].iov_len;
+        offset = 0;
+        ++n;
+    }
+    return n;
+}
+
+static int _encode_header(unsigned char * header, int version, unsigned int channelId, size_t length) {
+    // 4-byte length (of ID and payload), then the channel ID; returns the header length
+    int idLength = 1, i = 0;
+    if (version >= 2) {
+        while (idLength < 4 && (channelId >> (7 * idLength)) != 0) ++idLength;
+        for (; i < idLength; ++i)
+            header[4 + i] = (unsigned char)(((channelId >> (7 * i)) & 0x7F) | (i + 1 < idLength ? 0x80 : 0));
+    }
+    else header[4] = (unsigned char)channelId;
+    _put32(header, (unsigned int)(length + idLength));
+    return 4 + idLength;
+}
+
+static int _write_locked(Multiplex * c, struct iovec * vec, int count, int frameLength, int flags) {
+    // write (or batch) a complete frame, after any queued broadcast frames;
+    // the send mutex has to be held
+    if (c->outHead != 0 && _queued_write(c, 1) < 0) return -1;
+#ifndef NO_MUTEX
+    if (c->txThreshold > 0) return _send_coalesced(c, vec, count, frameLength, flags);
+#endif
+    return _writev(c, vec, count);
+}
+
+static int _send_fragment(Multiplex * c, unsigned int channelId, struct iovec * vec, int count, size_t length, int more, int flags) {
+    // vec[0] is the header
+    unsigned char * header = (unsigned char *)vec[0].iov_base;
+    int r = -1;
+
+    // the protocol version can only change while holding the send mutex
+    if (multiplex_lock_send(c) == 0) {
+        vec[0].iov_len = _encode_header(header, c->txVersion, channelId, length);
+        if (more) header[0] |= 0x80;
+        r = _write_locked(c, vec, count, (int)(length + vec[0].iov_len), flags);
+        if (r >= 0) _count_sent(c, channelId, length, !more);
+        multiplex_unlock_send(c);
+    }
+    return r;
+}
+
+static int _sendv(Multiplex * c, unsigned int channelId, struct iovec const * iov, int count, int flags) {
+    struct iovec stackVec[16], * vec = stackVec;
+    unsigned char header[8];
+    size_t length = 0, offset = 0, fragment = 0;
+    long total = 0;
+    int i = 0, r = -1, more = 0, fragmentSize = c->fragmentSize;
+#ifndef NO_MUTEX
+    SendTicket ticket;
+#endif
+
+    //
+    for (; i < count; ++i) length += iov[i].iov_len;
+    if (c->links != 0) {
+        // a bonded multiplexer sends over the link of the channel (whose
+        // load includes the frames still being written)
+        Multiplex * link = _bond_link(c, channelId);
+        if (link == 0) return -1;
+        _add(&(link->linkLoad), (uint64_t)length);
+        return _sendv(link, channelId, iov, count, flags);
+    }
+    if (count + 1 > 16) {
+        vec = (struct iovec *)malloc((count + 1) * sizeof(struct iovec));
+        if (vec == 0) return -1;
+    }
+    vec[0].iov_base = header;
+#ifndef NO_MUTEX
+    if (fragmentSize > 0 && _ticket_init(c, &ticket, channelId, flags) != 0) {
+        if (vec != stackVec) free(vec);
+        return -1;
+    }
+#endif
+
+    // fragments are only understood by v3 peers
+    fragment = fragmentSize > 0 && _load(&(c->txVersion)) >= 3 ? (size_t)fragmentSize : length;
+    do {
+        size_t n = length - offset < fragment ? length - offset : fragment;
+        int k = _iov_slice(vec + 1, iov, count, offset, n);
+        more = offset + n < length;
+#ifndef NO_MUTEX
+        if (fragmentSize > 0) _turn_take(c, &ticket, n, more);
+#endif
+        r = _send_fragment(c, channelId, vec, k + 1, n, more, flags);
+#ifndef NO_MUTEX
+        if (fragmentSize > 0 && (r < 0 || !more)) _turn_pass(c, &ticket);
+#endif
+        if (r < 0) break;
+        total += r;
+        offset += n;
+    } while (more);
+#ifndef NO_MUTEX
+    if (fragmentSize > 0) pthread_cond_destroy(&(ticket.cond));
+#endif
+    if (vec != stackVec) free(vec);
+    if (r < 0) return -1;
+    return total < INT_MAX ? (int)total : INT_MAX;
+}
+
+int multiplex_sendv_flags(Multiplex * c, unsigned int channelId, struct iovec const * iov, int count, int flags) {
+    size_t length = 0;
+    int i = 0;
+
+    //
+    if (c == 0 || count < 0 || (iov == 0 && count > 0)) return -1;
+    for (; i < count; ++i) length += iov[i].iov_len;
+    if (length >= INT_MAX - 8) return -1;
+    if (channelId >= MULTIPLEX_MAX_CHANNELS || (channelId > 255 && _load(&(c->txVersion)) < 2)) {
+        errno = ERANGE;
+        return -1;
+    }
+    if (c->control && channelId == MULTIPLEX_CONTROL_CHANNEL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (c->window > 0 && _take_credit(c, channelId, (int)length, flags) != 0) return -1;
+    _trace(c, MULTIPLEX_TRACE_SENT, channelId, length);
+    return _sendv(c, channelId, iov, count, flags);
+}
+
+int multiplex_sendv(Multiplex * c, unsigned int channelId, struct iovec const * iov, int count) {
+    return multiplex_sendv_flags(c, channelId, iov, count, 0);
+}
+
+int multiplex_send_flags(Multiplex * c, unsigned int channelId, char const * src, int length, int flags) {
+    struct iovec iov;
+    if (src == 0 || length < 0) return -1;
+    iov.iov_base = (void *)src;
+    iov.iov_len = length;
+    return multiplex_sendv_flags(c, channelId, &iov, 1, flags);
+}
+
+int multiplex_send(Multiplex * c, unsigned int channelId, char const * src, int length) {
+    return multiplex_send_flags(c, channelId, src, length, 0);
+}
+
+int multiplex_send_string(Multiplex * c, unsigned int channelId, char const * str) {
+    if (str == 0) return -1;
+    return multiplex_send(c, channelId, str, strlen(str));
+}
+
+// -- BROADCAST
+// v1 and v2 headers only differ for channel IDs 128 .. 255, so both are
+// encoded up front. The payload is only copied once a target cannot take
+// the whole frame right away.
+static int _broadcast_direct(Multiplex * c) {
+    // targets whose frames are written by 'multiplex_broadcast' itself
+    if (c->uring != 0 || c->shm != 0 || c->links != 0 || c->fragmentSize > 0) return 0;
+#ifndef NO_MUTEX
+    if (c->txThreshold > 0) return 0;
+#endif
+    return 1;
+}
+
+static int _broadcast_one(Multiplex * c, unsigned int channelId, char const * src, int length,
+                          unsigned char headers[2][8], int const * headerLengths, SharedPayload ** payload) {
+    struct iovec iov[2], * vec = iov;
+    QueuedFrame * q = 0;
+    int v2 = 0, written = 0, count = 2;
+    iov[1].iov_base = (void *)src;
+    iov[1].iov_len = length;
+    if (!_broadcast_direct(c)) return multiplex_sendv_flags(c, channelId, iov + 1, 1, MULTIPLEX_NONBLOCK) < 0 ? -1 : 0;
+    if ((channelId > 255 && _load(&(c->txVersion)) < 2) || (c->control && channelId == MULTIPLEX_CONTROL_CHANNEL)) return -1;
+    if (c->window > 0 && _take_credit(c, channelId, length, MULTIPLEX_NONBLOCK) != 0) return -1;
+    if (multiplex_lock_send(c) != 0) {
+        _return_credit(c, channelId, length);
+        return -1;
+    }
+    v2 = c->txVersion >= 2;
+    iov[0].iov_base = headers[v2];
+    iov[0].iov_len = headerLengths[v2];
+    if (c->outHead == 0 && (written = _fd_try_writev(c->fd, iov, 2)) < 0) {
+        multiplex_unlock_send(c);
+        _return_credit(c, channelId, length);
+        return -1;
+    }
+    if (written < headerLengths[v2] + length) {
+        if (*payload == 0) *payload = _payload_new(src, length);
+        if (*payload == 0 || (q = (QueuedFrame *)malloc(sizeof(QueuedFrame))) == 0) {
+            // out of memory: block instead
+            _iov_advance(&vec, &count, (size_t)written);
+            if (_queued_write(c, 1) < 0 || _fd_writev(c->fd, vec, count) < 0) {
+                multiplex_unlock_send(c);
+                _return_credit(c, channelId, length);
+                return -1;
+            }
+        }
+        else {
+            _add(&((*payload)->refs), 1);
+            q->next = 0;
+            q->payload = *payload;
+            memcpy(q->header, headers[v2], headerLengths[v2]);
+            q->headerLength = headerLengths[v2];
+            q->offset = written;
+            if (c->outTail != 0) c->outTail->next = q;
+            else c->outHead = q;
+            c->outTail = q;
+            if (q != c->outHead) _queued_write(c, 0);
+        }
+    }
+    _count_sent(c, channelId, length, 1);
+    multiplex_unlock_send(c);
+    _trace(c, MULTIPLEX_TRACE_SENT, channelId, (unsigned long)length);
+    return 0;
+}
+
+int multiplex_broadcast(Multiplex ** targets, int count, unsigned int channelId, char const * src, int length) {
+    unsigned char headers[2][8];
+    int headerLengths[2], i = 0, sent = 0;
+    SharedPayload * payload = 0;
+
+    //
+    if (targets == 0 || count < 0 || length < 0 || (src == 0 && length > 0) || length >= INT_MAX - 8) return -1;
+    if (channelId >= MULTIPLEX_MAX_CHANNELS) {
+        errno = ERANGE;
+        return -1;
+    }
+    headerLengths[0] = _encode_header(headers[0], 1, channelId & 255, length);
+    headerLengths[1] = _encode_header(headers[1], 2, channelId, length);
+    for (; i < count; ++i)
+        if (targets[i] != 0 && _broadcast_one(targets[i], channelId, src, length, headers, headerLengths, &payload) == 0)
+            ++sent;
+    if (payload != 0) _payload_release(payload);
+    return sent;
+}
+
+// ----------------------------------------------------------------------
+//
+//   BUFFER INSPECTION
+//
+// ----------------------------------------------------------------------
+int multiplex_length(Multiplex * c, unsigned int channelId) {
+    ChannelBuffer * buf = multiplex_lock_consumer(c, channelId);
+    if (buf == 0) return -1;
+    else {
+        int r = _channel_length(buf);
+        multiplex_unlock_consumer(c, buf);
+        return r;
+    }
+}
+
+int multiplex_last_received(Multiplex * c, unsigned int channelId) {
+    if (multiplex_lock_channel(c, channelId)) return 0;
+    else {
+        int r = _channel(c, channelId)->newData;
+        multiplex_unlock(c);
+        return r;
+    }
+}
+
+char const * multiplex_get(Multiplex * c, unsigned int channelId) {
+    ChannelBuffer * buf = multiplex_lock_consumer(c, channelId);
+    if (buf == 0) return 0;
+    else {
+        char const * ptr = _channel_linear(buf);
+        multiplex_unlock_consumer(c, buf);
+        return ptr;
+    }
+}
+
+char * multiplex_strdup(Multiplex * c, unsigned int channelId) {
+    ChannelBuffer * buf = multiplex_lock_consumer(c, channelId);
+    if (buf == 0) return 0;
+    else {
+        int length = _channel_length(buf);
+        char * tmp = (char *)calloc(length + 1, sizeof(char));
+        if (tmp != 0) _channel_take(buf, tmp, length, 0, 0);
+        multiplex_unlock_consumer(c, buf);
+        return tmp;
+    }
+}
+
+// -- STATISTICS
+#ifndef NO_STATS
+static void _stats_copy(MultiplexStats * out, MultiplexStats const * stats) {
+    // every field is a counter
+    uint64_t const * src = (uint64_t const *)stats;
+    uint64_t * dst = (uint64_t *)out;
+    size_t i = 0;
+    for (; i < sizeof(MultiplexStats) / sizeof(uint64_t); ++i) dst[i] = __atomic_load_n(src + i, __ATOMIC_RELAXED);
+}
+#endif
+
+int multiplex_stats(Multiplex * c, unsigned int channelId, MultiplexStats * out) {
+#ifndef NO_STATS
+    ChannelLeaf * leaf = 0;
+    ChannelBuffer * buf = 0;
+    int i = 0;
+#endif
+    if (out == 0) return -1;
+    memset(out, 0, sizeof(MultiplexStats));
+#ifndef NO_STATS
+    if (c == 0 || channelId >= MULTIPLEX_MAX_CHANNELS || (leaf = _leaf(c, channelId)) == 0) return -1;
+    out->framesOut = __atomic_load_n(&(leaf->framesOut[_low(channelId)]), __ATOMIC_RELAXED);
+    out->bytesOut = __atomic_load_n(&(leaf->bytesOut[_low(channelId)]), __ATOMIC_RELAXED);
+    for (; c->links != 0 && i < c->linkCount; ++i) {
+        // sends are counted by the links
+        ChannelLeaf * linkLeaf = _leaf(c->links[i], channelId);
+        if (linkLeaf == 0) continue;
+        out->framesOut += __atomic_load_n(&(linkLeaf->framesOut[_low(channelId)]), __ATOMIC_RELAXED);
+        out->bytesOut += __atomic_load_n(&(linkLeaf->bytesOut[_low(channelId)]), __ATOMIC_RELAXED);
+    }
+    if ((buf = multiplex_lock_consumer(c, channelId)) != 0) {
+        out->framesIn = __atomic_load_n(&(buf->stats.frames), __ATOMIC_RELAXED);
+        out->bytesIn = __atomic_load_n(&(buf->stats.bytes), __ATOMIC_RELAXED);
+        out->dropped = __atomic_load_n(&(buf->stats.dropped), __ATOMIC_RELAXED);
+        out->reallocs = __atomic_load_n(&(buf->stats.reallocs), __ATOMIC_RELAXED);
+        out->capacity = __atomic_load_n(&(buf->stats.capacity), __ATOMIC_RELAXED);
+        out->highWater = __atomic_load_n(&(buf->stats.highWater), __ATOMIC_RELAXED);
+        out->timeouts = __atomic_load_n(&(buf->stats.timeouts), __ATOMIC_RELAXED);
+        multiplex_unlock_consumer(c, buf);
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+int multiplex_stats_all(Multiplex * c, MultiplexStats * out) {
+#ifndef NO_STATS
+    MultiplexStats link;
+    int i = 0, j = 0;
+#endif
+    if (c == 0 || out == 0) return -1;
+    memset(out, 0, sizeof(MultiplexStats));
+#ifndef NO_STATS
+    _stats_copy(out, &(c->stats));
+    for (; c->links != 0 && i < c->linkCount; ++i) {
+        // sends are counted by the links
+        _stats_copy(&link, &(c->links[i]->stats));
+        out->framesOut += link.framesOut;
+        out->bytesOut += link.bytesOut;
+        for (j = 0; j < MULTIPLEX_LOCK_BUCKETS; ++j) {
+            out->sendWait[j] += link.sendWait[j];
+            out->sendHold[j] += link.sendHold[j];
+        }
+    }
+    return 0;
+#else
+    return -1;
+#endif
 }
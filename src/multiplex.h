@@ -24,68 +24,570 @@
 #define MULTIPLEX_H
 
 #define CHANNEL_INITIAL_BUFFER_SIZE 256
+#ifndef MULTIPLEX_RECEIVE_BUFFER_SIZE
+#define MULTIPLEX_RECEIVE_BUFFER_SIZE 65536
+#endif
 #define CHANNEL_IGNORED -255
 #define CHANNEL_TIMEOUT -77
+#define CHANNEL_WAKEUP  -78
 #define CHANNEL_CLOSED  -1
 
+#define MULTIPLEX_URGENT   1  // send flag: write immediately, even when coalescing
+#define MULTIPLEX_NONBLOCK 2  // send flag: fail with EAGAIN instead of waiting for credit
+
+#define MULTIPLEX_CONTROL_CHANNEL 255  // carries credit updates and the protocol handshake
+#define MULTIPLEX_MAX_CHANNELS 16777216  // channel IDs are below this (IDs above 255 need protocol v2)
+#define MULTIPLEX_CHANNEL_SETS 4         // bit sets kept in the channel table
+#define MULTIPLEX_PRIORITIES 8           // send priorities (0 = default .. 7 = most urgent)
+
+// order in which 'select' reports channels with new data
+#define MULTIPLEX_POLICY_FIFO        0  // in order of arrival (default)
+#define MULTIPLEX_POLICY_ROUND_ROBIN 1  // next channel ID after the last one selected
+#define MULTIPLEX_POLICY_PRIORITY    2  // lowest channel ID first
+
+// what happens to a frame that does not fit into the memory budget of a pool
+#define MULTIPLEX_POOL_REJECT 0  // drop the frame
+#define MULTIPLEX_POOL_BLOCK  1  // stop reading the fd until memory is released
+
+// I/O engine used for the fd (see 'multiplex_new_engine')
+#define MULTIPLEX_ENGINE_POLL  0  // poll/read/writev (default)
+#define MULTIPLEX_ENGINE_URING 1  // io_uring (Linux), falls back to MULTIPLEX_ENGINE_POLL
+#define MULTIPLEX_ENGINE_SHM   2  // shared memory rings (Linux, Unix socket to a local peer)
+
+// how a bonded multiplexer assigns channels to its links (see 'multiplex_new_bonded')
+#define MULTIPLEX_BOND_HASH         0  // channel ID modulo the number of links
+#define MULTIPLEX_BOND_LEAST_LOADED 1  // the link that has sent the fewest bytes so far
+#define MULTIPLEX_MAX_LINKS        64  // links per bonded multiplexer
+
+#define MULTIPLEX_POOL_CLASSES 15       // chunk sizes 64 bytes .. 1 MiB
+#ifndef MULTIPLEX_POOL_CACHE
+#define MULTIPLEX_POOL_CACHE   1048576  // bytes of free chunks kept per size
+#endif
+#ifndef MULTIPLEX_SHRINK_DELAY
+#define MULTIPLEX_SHRINK_DELAY 64       // writes below 25% usage before a buffer shrinks
+#endif
+#ifndef MULTIPLEX_SHM_RING_SIZE
+#define MULTIPLEX_SHM_RING_SIZE 1048576 // bytes per direction of the shared memory engine
+#endif
+#ifndef MULTIPLEX_SHM_TIMEOUT
+#define MULTIPLEX_SHM_TIMEOUT   5000    // ms to wait for the peer to set up the shared memory engine
+#endif
+#ifndef MULTIPLEX_FORWARD_TIMEOUT
+#define MULTIPLEX_FORWARD_TIMEOUT 5000  // ms a forwarding target may block before it counts as failed
+#endif
+#define MULTIPLEX_LOCK_BUCKETS 16       // lock histograms: bucket i counts times below 2^i us
+#ifndef MULTIPLEX_TRACE_BUFFER
+#define MULTIPLEX_TRACE_BUFFER 262144   // bytes per buffer of the traffic recorder (two are used)
+#endif
+
+// traffic traces (see 'multiplex_record')
+#define MULTIPLEX_TRACE_VERSION  1
+#define MULTIPLEX_TRACE_RECEIVED 0  // record kind: a frame arrived
+#define MULTIPLEX_TRACE_SENT     1  // record kind: a payload was sent
+#define MULTIPLEX_TRACE_MORE     2  // flag: the frame is a fragment, continued by the next one
+
+#include <time.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
 #ifndef NO_MUTEX
 #include <pthread.h>
 #endif
 
+// Channel buffers draw their memory from a pool of power-of-two sized
+// chunks. Free chunks are cached for reuse, and the pool can enforce a
+// limit on the memory held by all buffers (shared pools: all buffers of
+// all multiplexers using it).
+typedef struct MultiplexPool {
+    void * free[MULTIPLEX_POOL_CLASSES];  // cached chunks, linked through their first word
+    int cached[MULTIPLEX_POOL_CLASSES];   // number of chunks in 'free'
+    size_t used;                          // bytes handed out
+    size_t cachedBytes;                   // bytes in 'free'
+    size_t highWater;                     // maximum of 'used + cachedBytes'
+    size_t limit;                         // maximum of 'used + cachedBytes' (0 = none)
+    int policy;                           // MULTIPLEX_POOL_*
+    unsigned int released;                // incremented whenever a chunk is released
+#ifndef NO_MUTEX
+    pthread_mutex_t mutex;                // producers and consumers allocate concurrently
+    pthread_cond_t available;             // signalled when memory is released
+    int waiters;                          // threads waiting on 'available'
+#endif
+} MultiplexPool;
+
+// Statistics (counters are updated with relaxed atomics and can be read at
+// any time; build with NO_STATS to compile them out).
+typedef struct MultiplexStats {
+    uint64_t framesIn;        // frames received
+    uint64_t bytesIn;         // payload bytes received
+    uint64_t framesOut;       // frames sent
+    uint64_t bytesOut;        // payload bytes sent
+    uint64_t dropped;         // frames for enabled channels dropped (pool limit)
+    uint64_t ignored;         // frames for disabled channels (CHANNEL_IGNORED)
+    uint64_t reallocs;        // buffer (ring) allocations
+    uint64_t capacity;        // bytes held by channel buffers
+    uint64_t highWater;       // maximum of 'capacity'
+    uint64_t timeouts;        // select/receive calls that returned CHANNEL_TIMEOUT
+    uint64_t lockWait[MULTIPLEX_LOCK_BUCKETS];  // time spent waiting for the mutex
+    uint64_t lockHold[MULTIPLEX_LOCK_BUCKETS];  // time the mutex was held
+    uint64_t sendWait[MULTIPLEX_LOCK_BUCKETS];  // time spent waiting for the send mutex
+    uint64_t sendHold[MULTIPLEX_LOCK_BUCKETS];  // time the send mutex was held
+} MultiplexStats;
+
+#ifndef NO_STATS
+typedef struct ChannelStats {
+    uint64_t frames;     // frames received
+    uint64_t bytes;      // payload bytes received
+    uint64_t dropped;    // frames dropped (pool limit)
+    uint64_t reallocs;   // buffer (ring) allocations
+    uint64_t capacity;   // bytes held by the buffer
+    uint64_t highWater;  // maximum of 'capacity'
+    uint64_t timeouts;   // receive calls that returned CHANNEL_TIMEOUT
+} ChannelStats;
+#endif
+
+// Channel buffers are single-producer/single-consumer ring buffers: the
+// thread demultiplexing the fd appends (holding the Multiplex mutex),
+// consumers only lock the channel itself. Build with CHANNEL_MUTEX to
+// use a plain buffer guarded by the Multiplex mutex instead.
+#ifndef CHANNEL_MUTEX
+typedef struct ChannelRing {
+    struct ChannelRing * next;  // newer ring (set once this one is full)
+    unsigned int mask;          // capacity - 1 (capacity is a power of two)
+    unsigned int head;          // read position (written by consumer)
+    unsigned int tail;          // write position (written by producer)
+    char * data;                // pool chunk of 'mask + 1' bytes
+} ChannelRing;
+#endif
+
+typedef struct ChannelFrame {
+    struct ChannelFrame * next;  // newer frame (written by producer)
+    int length;                  // payload length
+    int capacity;                // room for 'data' (without the zero byte)
+    char data[];                 // payload (followed by a zero byte)
+} ChannelFrame;
+
+// Handler for received data in dispatch mode (see 'multiplex_on').
+struct Multiplex;
+typedef void (*MultiplexHandler)(struct Multiplex * c, unsigned int channelId, char const * data, int length, void * context);
+
 typedef struct ChannelBuffer {
+    struct MultiplexPool * pool;  // memory for data and frames
+#ifdef CHANNEL_MUTEX
     char * data;    // receive buffer
     int offset;     // current read offset
-    int length;     // current read length
     int capacity;   // capacity of receive buffer
+#else
+    struct ChannelRing * read;   // oldest ring (consumer side)
+    struct ChannelRing * write;  // newest ring (producer side)
+    char * linear;               // contiguous copy for 'multiplex_get'
+    int linearCapacity;          // capacity of 'linear'
+#endif
+    struct ChannelFrame * frameHead;  // consumed frame preceding the next one (frame mode)
+    struct ChannelFrame * frameTail;  // newest frame (frame mode)
+    struct ChannelFrame * partial;    // frame reassembled from fragments (frame mode)
+    int discarding;                   // 1 = drop fragments up to the last one of a payload
+    int framed;     // 1 = keep frame boundaries
+    int leased;     // 1 = first frame is held by 'multiplex_acquire_frame'
+    int frameOffset; // bytes of the first frame already read (frame mode)
+    int length;     // current read length
+    unsigned int id; // channel ID
     int initial;    // minimum capacity
+    int consumed;   // bytes read since the last credit update (flow control)
+    int idle;       // consecutive writes with less than 25% of the capacity used
     int newData;    // 0 = no new data since last 'select'
+    int forward;    // fd receiving the payload instead of the buffer (-1 = none)
+    int maxFrame;   // largest payload accepted (0 = no limit)
+#ifndef NO_MUTEX
+#ifndef CHANNEL_MUTEX
+    pthread_mutex_t lock; // serializes consumers of this channel
+    int users;            // consumers that looked the buffer up ('pinMutex')
+    int disabled;         // 1 = removed from the table, the last user frees it
+#endif
+    pthread_cond_t cond;  // signalled when data arrives (concurrent mode)
+    int waiters;          // threads waiting on 'cond'
+    MultiplexHandler handler;        // called by the workers in dispatch mode (0 = none)
+    void * context;                  // passed to 'handler'
+    int scheduled;                   // 1 = queued for (or handled by) a worker
+    int closeReported;               // 1 = 'handler' was told that the fd was closed
+#endif
+#ifndef NO_STATS
+    ChannelStats stats;            // counters of this channel
+    struct MultiplexStats * total; // counters of the multiplexer
+#endif
 } ChannelBuffer;
 
+// Channels are looked up in a three-level radix table (8 bits of the ID
+// per level) whose nodes are allocated when first used. Every level has
+// bit sets (enabled, ready, ...) marking the non-empty entries below it,
+// so the lowest ID in a set is found in a few steps.
+typedef struct ChannelLeaf {
+    struct ChannelBuffer * channels[256];         // receive buffers
+    int used[256];                                // bytes sent, not yet credited by the peer
+    unsigned char link[256];                      // bonded link carrying the channel + 1 (0 = not pinned yet)
+#ifndef NO_MUTEX
+    unsigned char priority[256];                  // send priority
+    unsigned char weight[256];                    // send weight within the priority (0 = 1)
+    unsigned char fragmenting[256];               // 1 = a fragmented payload is being sent
+    uint64_t finish[256];                         // virtual finish time of the last fragment
+#endif
+#ifndef NO_STATS
+    uint64_t framesOut[256];                      // frames sent per channel
+    uint64_t bytesOut[256];                       // payload bytes sent per channel
+#endif
+    uint64_t sets[MULTIPLEX_CHANNEL_SETS][4];     // channels in each set
+} ChannelLeaf;
+
+typedef struct ChannelNode {
+    struct ChannelLeaf * leaves[256];
+    uint64_t sets[MULTIPLEX_CHANNEL_SETS][4];     // leaves with channels in each set
+} ChannelNode;
+
+struct MultiplexUring;
+struct MultiplexShm;
+struct MultiplexWorkers;
+struct SendTicket;
+struct QueuedFrame;
+struct MultiplexRecorder;
+
 typedef struct Multiplex {
     int fd;                                // file descriptor
-    struct ChannelBuffer * channels[256];  // O(1) lookup for channels
+    struct MultiplexUring * uring;         // io_uring engine (0 = MULTIPLEX_ENGINE_POLL)
+    struct MultiplexShm * shm;             // shared memory engine (0 = MULTIPLEX_ENGINE_POLL)
+    struct ChannelNode * nodes[256];       // channel table (see above)
+    uint64_t sets[MULTIPLEX_CHANNEL_SETS][4]; // nodes with channels in each set
+    char * rx;                             // receive staging buffer
+    int rxOffset;                          // start of unparsed data in 'rx'
+    int rxLength;                          // number of unparsed bytes in 'rx'
+    int rxCapacity;                        // capacity of 'rx'
+    unsigned long rxRemaining;             // payload bytes of the streamed frame still to be received
+    unsigned int rxStream;                 // channel of the streamed frame
+    int rxMore;                            // 1 = the streamed frame is a fragment (protocol v3)
+    int rxDrop;                            // 1 = the streamed frame is dropped
+    int rxDirect;                          // bytes of it read right into the channel's partial frame
+    unsigned int * readyQueue;             // ready channels in order of arrival
+    int readyHead;                         // first entry in 'readyQueue'
+    int readyCount;                        // number of entries in 'readyQueue'
+    int readyCapacity;                     // capacity of 'readyQueue' (a power of two)
+    int readyLast;                         // channel selected last (round-robin)
+    int policy;                            // MULTIPLEX_POLICY_*
+    struct MultiplexPool * pool;           // memory for channel buffers
+    int ownPool;                           // 1 = 'pool' was created by 'multiplex_new'
+    int blocked;                           // 1 = a frame waits for memory (MULTIPLEX_POOL_BLOCK)
+    int control;                           // 1 = MULTIPLEX_CONTROL_CHANNEL is reserved
+    int window;                            // credit per channel (0 = no flow control)
+    int maxVersion;                        // highest protocol version offered
+    int peerVersion;                       // highest protocol version offered by the peer
+    int txVersion;                         // protocol version used for sending
+    int rxVersion;                         // protocol version of received frames
+    int fragmentSize;                      // payloads above this are fragmented (0 = off)
+    int forwardFd;                         // target of the payload being forwarded (-1 = drop it)
+    unsigned int forwardChannel;           // channel of the payload being forwarded
+    unsigned long forwardRemaining;        // payload bytes still to be forwarded from 'fd'
+    int forwardPipe[2];                    // pipe for splicing forwarded payloads (-1 = not yet)
+    int wakePipe[2];                       // written by 'multiplex_wakeup' (-1 = not yet)
+    unsigned int wakeups;                  // calls of 'multiplex_wakeup'
+    unsigned int wakeupsSeen;              // 'wakeups' reported by a blocking call
+    unsigned int wakeSeen;                 // 'wakeupsSeen' when the fd owner started waiting
+    int wakeWatch;                         // 1 = the fd owner returns CHANNEL_WAKEUP when woken
+    struct Multiplex ** links;             // links of a bonded multiplexer (0 = not bonded)
+    int linkCount;                         // number of 'links'
+    int linkNext;                          // link dispatched first by the next receive (round-robin)
+    int bondPolicy;                        // MULTIPLEX_BOND_*
+    struct Multiplex * bond;               // bonded multiplexer holding the channels of this link (0 = none)
+    uint64_t linkLoad;                     // bytes sent over this link
+    struct QueuedFrame * outHead;          // broadcast frames not written yet (oldest first)
+    struct QueuedFrame * outTail;          // newest entry in 'outHead'
+    struct MultiplexRecorder * recorder;   // traffic capture (0 = off)
 #ifndef NO_MUTEX
     pthread_mutex_t mutex;                 // for exclusive access
+    pthread_mutex_t sendMutex;             // serializes writes to 'fd'
+    pthread_cond_t readable;               // signalled when any channel receives data
+    int concurrent;                        // 1 = do not hold 'mutex' while reading from 'fd'
+    int reading;                           // 1 = a thread currently owns 'fd' for reading
+    int selecting;                         // threads waiting on 'readable'
+    int setWaiting;                        // threads waiting on 'readable' for a channel set
+    pthread_cond_t controlCond;            // signalled when a control frame arrives
+    int controlWaiters;                    // threads waiting on 'controlCond'
+    pthread_mutex_t writeMutex;            // held while writing a batch to 'fd'
+    pthread_cond_t txCond;                 // wakes the flusher thread
+    pthread_t txThread;                    // writes batches whose delay has expired
+    int txRunning;                         // 1 = 'txThread' is running
+    struct timespec txDeadline;            // when the current batch has to be written
+    char * tx;                             // batch of coalesced frames
+    char * txSpare;                        // buffer for the next batch
+    int txLength;                          // bytes in 'tx'
+    int txCapacity;                        // capacity of 'tx' and 'txSpare'
+    int txThreshold;                       // batch size that triggers a write (0 = off)
+    int txDelayUs;                         // maximum time a frame waits in the batch
+    pthread_mutex_t schedMutex;            // protects the send scheduler
+    pthread_mutex_t pinMutex;              // protects channel lookups by consumers
+    struct SendTicket * schedQueue;        // senders waiting for their turn
+    int schedBusy;                         // 1 = a sender has its turn
+    uint64_t schedClock[MULTIPLEX_PRIORITIES + 1]; // virtual time per priority (fair queuing)
+    struct MultiplexWorkers * workers;     // dispatch mode worker pool (0 = not running)
+#endif
+#ifndef NO_STATS
+    MultiplexStats stats;                  // counters of all channels (see 'multiplex_stats_all')
+#ifndef NO_MUTEX
+    uint64_t lockedAt;                     // when 'mutex' was acquired (ns)
+    uint64_t sendLockedAt;                 // when 'sendMutex' was acquired (ns)
+#endif
 #endif
 } Multiplex;
 
 // Multiplexing Operations (these are not thread-safe!)
 Multiplex * multiplex_new(int fd);
-void multiplex_enable(Multiplex * c, unsigned char channelId, int initialBufferSize);
-void multiplex_enable_range(Multiplex * c, unsigned char minChannelId, unsigned char maxChannelId, int initialBufferSize);
-void multiplex_disable(Multiplex * c, unsigned char channelId);
+void multiplex_enable(Multiplex * c, unsigned int channelId, int initialBufferSize);
+void multiplex_enable_range(Multiplex * c, unsigned int minChannelId, unsigned int maxChannelId, int initialBufferSize);
+void multiplex_disable(Multiplex * c, unsigned int channelId);
+void multiplex_free(Multiplex * c);
+
+// -- create a multiplexer using the given MULTIPLEX_ENGINE_*; if io_uring is
+//    not available, the poll engine is used ('multiplex_engine' tells which).
+//    MULTIPLEX_ENGINE_SHM needs a connected Unix domain socket, and the peer
+//    has to use it, too: both exchange shared memory rings over the socket
+//    (waiting up to MULTIPLEX_SHM_TIMEOUT ms), and use the poll engine if
+//    either of them fails to set them up (returns 0 if the peer does not answer)
+Multiplex * multiplex_new_engine(int fd, int engine);
+int multiplex_engine(Multiplex * c);
+
+// -- link bonding: one multiplexer striped across 'count' fds (up to
+//    MULTIPLEX_MAX_LINKS, e.g. parallel TCP connections to the same peer,
+//    which has to bond the other ends in the same order). Every channel is
+//    pinned to one link when it is first sent on (by MULTIPLEX_BOND_*
+//    'policy', or by 'multiplex_pin' beforehand), so its frames stay in
+//    order; receiving reads from all links. Links use the poll engine, and
+//    the whole multiplexer reports CHANNEL_CLOSED once any link is closed.
+//    'multiplex_pin' returns 0, or -1 if the link does not exist or the
+//    channel is pinned to another one already
+Multiplex * multiplex_new_bonded(int const * fds, int count, int policy);
+int multiplex_pin(Multiplex * c, unsigned int channelId, int link);
+
+// -- memory pools; 'limit' is in bytes (0 = unlimited). A pool can be
+//    shared by several multiplexers, it has to be set before channels
+//    are enabled (returns 0 on success) and must outlive them.
+MultiplexPool * multiplex_pool_new(size_t limit, int policy);
+void multiplex_pool_free(MultiplexPool * pool);
+size_t multiplex_pool_used(MultiplexPool * pool);
+int multiplex_set_pool(Multiplex * c, MultiplexPool * pool);
+
+// -- concurrent mode: the thread reading from the fd releases the mutex while
+//    blocked, other receivers wait for their channel (ignored with NO_MUTEX)
+void multiplex_set_concurrent(Multiplex * c, int enabled);
+
+// -- dispatch mode: 'handler' is called by a pool of worker threads for every
+//    frame received on the channel (which is enabled in frame mode if it is
+//    not enabled yet; stream channels pass the data in chunks), and once with
+//    data = 0 and length = CHANNEL_CLOSED when the fd is closed. A channel is
+//    handled by one worker at a time, in order of arrival; different channels
+//    are handled in parallel. Such channels are not reported by 'select'
+//    while the workers run, and must not be disabled meanwhile. Starting the
+//    workers also starts a thread reading from the fd and enables concurrent
+//    mode. Return 0 or -1 (always with NO_MUTEX); a 0 handler removes it.
+int multiplex_on(Multiplex * c, unsigned int channelId, MultiplexHandler handler, void * context);
+int multiplex_on_range(Multiplex * c, unsigned int minChannelId, unsigned int maxChannelId, MultiplexHandler handler, void * context);
+int multiplex_start_workers(Multiplex * c, int workers);
+void multiplex_stop_workers(Multiplex * c);
+
+// -- flow control: the peer may only send 'windowBytes' per channel before
+//    the data has been read here; credit is returned on the control channel.
+//    Both ends have to enable it with the same window before sending
+//    (0 = off; returns -1 if the control channel is enabled for data).
+int multiplex_set_flow_control(Multiplex * c, int windowBytes);
+
+// -- protocol v2 (channel IDs up to MULTIPLEX_MAX_CHANNELS - 1) and v3 (v2
+//    plus fragments) have to be negotiated with the peer, which has to call
+//    this, too; returns the protocol version in use (1 if the peer does not
+//    answer in time)
+int multiplex_negotiate(Multiplex * c, int timeoutMs);
+
+// -- send scheduling: payloads larger than 'fragmentBytes' are split into
+//    fragments (once protocol v3 is negotiated) and senders take turns per
+//    fragment: by priority first, then by weighted fair queuing among the
+//    channels of a priority (0 = off; priorities and weights are ignored with
+//    NO_MUTEX). Control frames and MULTIPLEX_URGENT frames go first.
+int multiplex_set_fragmentation(Multiplex * c, int fragmentBytes);
+int multiplex_set_priority(Multiplex * c, unsigned int channelId, int priority, int weight);
+
+// -- send data; returns the number of bytes written (including the header) or -1
+//    (a channel without credit blocks, or fails with errno = EAGAIN if MULTIPLEX_NONBLOCK)
+int multiplex_send(Multiplex * c, unsigned int channelId, char const * src, int length);
+int multiplex_sendv(Multiplex * c, unsigned int channelId, struct iovec const * iov, int count);
+int multiplex_send_flags(Multiplex * c, unsigned int channelId, char const * src, int length, int flags);
+int multiplex_sendv_flags(Multiplex * c, unsigned int channelId, struct iovec const * iov, int count, int flags);
+
+// -- send the same payload to many multiplexers: the header is encoded once
+//    per protocol version, and each target gets as much of the frame as its
+//    fd takes without blocking. The rest is queued, sharing a single copy of
+//    the payload among all queues; queued frames are written before anything
+//    else sent to that target, or by 'multiplex_flush' (frames still queued
+//    when a multiplexer is freed are dropped). Targets using another engine,
+//    bonding, coalescing or fragmentation get a regular send. Targets without
+//    credit are skipped. Returns the number of targets the frame was written
+//    or queued to, or -1
+int multiplex_broadcast(Multiplex ** targets, int count, unsigned int channelId, char const * src, int length);
 
-// -- send data; returns result of 'write'
-int multiplex_send(Multiplex * c, unsigned char channelId, char const * src, int length);
-int multiplex_send_string(Multiplex * c, unsigned char channelId, char const * str);
+// -- coalesce frames of concurrent senders; a batch is written once it holds
+//    'thresholdBytes' or after 'delayUs' (0 = disable, ignored with NO_MUTEX)
+void multiplex_set_coalescing(Multiplex * c, int thresholdBytes, int delayUs);
+
+// -- write all coalesced (and queued broadcast) frames now; returns bytes written or -1
+int multiplex_flush(Multiplex * c);
+int multiplex_send_string(Multiplex * c, unsigned int channelId, char const * str);
 
 // -- select channel; returns the channel ID (>= 0) or a status code (< 0)
+void multiplex_set_policy(Multiplex * c, int policy);
 int multiplex_select(Multiplex * c, int timeoutMs);
 
+// -- external event loops: 'multiplex_fileno' switches the fd to non-blocking
+//    mode and returns the fd to watch for readability (level-triggered; with
+//    io_uring or shared memory an eventfd), or -1. Whenever it is readable,
+//    'multiplex_on_readable' reads what is available without blocking and
+//    returns the number of frames received (partial frames are kept for the
+//    next call), or CHANNEL_CLOSED; 'multiplex_select' with timeout 0 then
+//    reports the channels with new data
+int multiplex_fileno(Multiplex * c);
+int multiplex_on_readable(Multiplex * c);
+
 // -- receive data with timeout
-int multiplex_receive(Multiplex * c, int timeoutMs, unsigned char channelId, char * dst, int offset, int length);
+int multiplex_receive(Multiplex * c, int timeoutMs, unsigned int channelId, char * dst, int offset, int length);
+
+// -- wait sets: 'multiplex_select_set' returns a channel of the set with new
+//    data, 'multiplex_receive_set' reads from a channel of the set that has
+//    data (stored in '*channelId'), taking turns among the channels of the
+//    set. Both block until then, but no longer than the absolute
+//    CLOCK_MONOTONIC 'deadline' (see 'multiplex_deadline'; 0 = no limit), and
+//    return CHANNEL_TIMEOUT, CHANNEL_CLOSED, or CHANNEL_WAKEUP once
+//    'multiplex_wakeup' has been called (if no such call is blocked, the
+//    next one returns it right away). A zero-initialized set is empty;
+//    'multiplex_channel_set_add' returns 0, or -1 if out of memory
+typedef struct MultiplexChannelSet {
+    uint64_t * bits;      // bit i is set if channel i is in the set
+    unsigned int words;   // number of words in 'bits'
+    unsigned int next;    // channel ID to continue the search at
+} MultiplexChannelSet;
+
+int multiplex_channel_set_add(MultiplexChannelSet * set, unsigned int channelId);
+void multiplex_channel_set_remove(MultiplexChannelSet * set, unsigned int channelId);
+void multiplex_channel_set_clear(MultiplexChannelSet * set);
+void multiplex_deadline(struct timespec * deadline, int timeoutMs);
+int multiplex_select_set(Multiplex * c, MultiplexChannelSet * set, struct timespec const * deadline);
+int multiplex_receive_set(Multiplex * c, MultiplexChannelSet * set, struct timespec const * deadline,
+                          unsigned int * channelId, char * dst, int offset, int length);
+void multiplex_wakeup(Multiplex * c);
+
+// -- batch receive: waits like 'multiplex_receive_set', then fills up to
+//    'count' messages from the channels of the set in turn (one frame each
+//    in frame mode, otherwise what is buffered, up to 'capacity'), including
+//    frames that can be read from the fd without waiting, all while taking
+//    the mutex once. Returns the number of messages, CHANNEL_TIMEOUT,
+//    CHANNEL_CLOSED or CHANNEL_WAKEUP
+typedef struct MultiplexMessage {
+    char * data;             // buffer provided by the caller
+    int capacity;            // size of 'data'
+    int length;              // bytes received
+    unsigned int channelId;  // channel they were received on
+} MultiplexMessage;
+
+int multiplex_receive_batch(Multiplex * c, MultiplexChannelSet * set, MultiplexMessage * messages, int count,
+                            struct timespec const * deadline);
+
+// -- forward the payload of every frame received on the channel to 'fd'
+//    instead of buffering it (enabling the channel if needed, -1 = stop).
+//    With the poll engine on Linux, payload bytes not read yet are moved
+//    from the multiplexed fd to a 'fd' that is not a socket using splice(),
+//    without copying them to user space. If writing to 'fd' fails (or it takes no bytes for
+//    MULTIPLEX_FORWARD_TIMEOUT ms), the rest of the payload is dropped and
+//    forwarding stops. Returns 0 or -1.
+int multiplex_forward(Multiplex * c, unsigned int channelId, int fd);
 
 // -- get length of channel buffer
-int multiplex_length(Multiplex * c, unsigned char channelId);
+int multiplex_length(Multiplex * c, unsigned int channelId);
 
 // -- get length of data received in last select
-int multiplex_last_received(Multiplex * c, unsigned char channelId);
+int multiplex_last_received(Multiplex * c, unsigned int channelId);
 
-// -- get channel buffer
-char const * multiplex_get(Multiplex * c, unsigned char channelId);
+// -- get channel buffer (with ring buffers: a copy, valid until the next call)
+char const * multiplex_get(Multiplex * c, unsigned int channelId);
 
 // -- create copy of (part of) channel buffer
-char * multiplex_strdup(Multiplex * c, unsigned char channelId);
+char * multiplex_strdup(Multiplex * c, unsigned int channelId);
 
 // -- write to/read from channel buffer
-void multiplex_write(Multiplex * c, unsigned char channelId, char * data, int offset, int length);
-int multiplex_read(Multiplex * c, unsigned char channelId, char * dst, int offset, int length);
-int multiplex_copy(Multiplex * c, unsigned char channelId, char * dst, int offset, int length);
+void multiplex_write(Multiplex * c, unsigned int channelId, char * data, int offset, int length);
+int multiplex_read(Multiplex * c, unsigned int channelId, char * dst, int offset, int length);
+int multiplex_copy(Multiplex * c, unsigned int channelId, char * dst, int offset, int length);
 
 // -- clear buffer
-void multiplex_clear(Multiplex * c, unsigned char channelId);
+void multiplex_clear(Multiplex * c, unsigned int channelId);
 
 // -- remove select status, keep data
-void multiplex_ignore(Multiplex * c, unsigned char channelId);
+void multiplex_ignore(Multiplex * c, unsigned int channelId);
+
+// -- frame mode: keep frame boundaries; reading from such a channel returns
+//    (at most) one frame. A read shorter than the frame returns its first
+//    bytes and leaves the rest for the next read, which returns no bytes
+//    of the following frame. 'multiplex_acquire_frame' gives access to the
+//    next frame (or its unread rest) in place, valid until
+//    'multiplex_release_frame' (returns 1 if a frame was available, 0 if
+//    not, or CHANNEL_IGNORED). While a frame is leased, reading the channel
+//    returns 0 and clearing it keeps all frames; disabling the channel frees
+//    the leased frame, too
+void multiplex_enable_frames(Multiplex * c, unsigned int channelId);
+int multiplex_acquire_frame(Multiplex * c, unsigned int channelId, char const ** ptr, int * length);
+void multiplex_release_frame(Multiplex * c, unsigned int channelId);
+
+// -- limit the payload size accepted on a channel (in frame mode, of the
+//    reassembled frame; 'maxBytes' <= 0: no limit); larger frames are dropped
+//    without being buffered. Returns 0, or -1 if the channel is not enabled
+int multiplex_set_max_frame(Multiplex * c, unsigned int channelId, int maxBytes);
+
+// -- traffic capture: every frame received and every payload sent (by
+//    'multiplex_send*' and 'multiplex_broadcast') is recorded to the file at
+//    'path' (created or truncated) with its time, channel and length, but not
+//    its content. A background thread writes the records, so the data path
+//    never waits for the disk; records that do not fit the buffers in time
+//    are dropped. 'path' = 0 stops recording (as does 'multiplex_free') and
+//    returns the number of dropped records; starting returns 0 or -1. Start
+//    and stop it while no other thread uses the multiplexer. A trace is
+//    "MXTR", a version byte, then per record a kind byte (MULTIPLEX_TRACE_*)
+//    followed by three varints (7 bits per byte, least significant first):
+//    nanoseconds since the previous record, channel ID, payload length
+int multiplex_record(Multiplex * c, char const * path);
+
+// -- statistics of a channel (receive counters start over when it is enabled
+//    again) or of the whole multiplexer; returns 0, or -1 if the channel was
+//    never used or the library was built with NO_STATS ('out' is zeroed)
+int multiplex_stats(Multiplex * c, unsigned int channelId, MultiplexStats * out);
+int multiplex_stats_all(Multiplex * c, MultiplexStats * out);
+
+// Reactor (Linux only): services many multiplexers from one thread using
+// epoll. Registered file descriptors are switched to non-blocking mode.
+#ifdef __linux__
+typedef struct MultiplexEvent {
+    Multiplex * multiplex;   // multiplexer that received data
+    int channelId;           // channel with new data, or CHANNEL_CLOSED
+} MultiplexEvent;
+
+typedef struct MultiplexReactor {
+    int epfd;                // epoll instance
+    Multiplex ** pending;    // multiplexers with unreported events
+    int pendingCount;        // entries in 'pending'
+    int pendingCapacity;     // capacity of 'pending'
+    Multiplex ** blocked;    // multiplexers waiting for pool memory (fd disarmed)
+    int blockedCount;        // entries in 'blocked'
+    int blockedCapacity;     // capacity of 'blocked'
+} MultiplexReactor;
+
+// -- (these are not thread-safe!)
+MultiplexReactor * multiplex_reactor_new(void);
+int multiplex_reactor_add(MultiplexReactor * r, Multiplex * c);
+int multiplex_reactor_remove(MultiplexReactor * r, Multiplex * c);
+void multiplex_reactor_free(MultiplexReactor * r);
+
+// -- read from all readable multiplexers; returns the number of events (0 after the
+//    timeout) or -1
+int multiplex_reactor_wait(MultiplexReactor * r, MultiplexEvent * events, int maxEvents, int timeoutMs);
+#endif
 
 #endif
@@ -0,0 +1,176 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2013 Yannick Scherer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <multiplex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+// ----------------------------------------------------------------------
+//
+//   TESTS
+//
+// ----------------------------------------------------------------------
+// Regression tests for the library ('make test'). Every test connects
+// two multiplexers with a socket pair; a test that hangs is ended by the
+// alarm set in 'main'.
+#define CHANNEL 1
+
+typedef struct Pair {
+    int fds[2];
+    Multiplex * a;   // sending side
+    Multiplex * b;   // receiving side
+} Pair;
+
+typedef struct Sender {
+    Multiplex * m;
+    int frames;      // number of frames to send
+    int length;      // bytes per frame
+    int failed;      // 1 = a send failed
+} Sender;
+
+static int failures = 0;
+
+static void check(int ok, char const * name) {
+    printf("%s %s\n", ok ? "ok  " : "FAIL", name);
+    if (!ok) ++failures;
+}
+
+static int pair_open(Pair * p, int window) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, p->fds) != 0) return 0;
+    p->a = multiplex_new(p->fds[0]);
+    p->b = multiplex_new(p->fds[1]);
+    if (p->a == 0 || p->b == 0) return 0;
+    if (window > 0 && (multiplex_set_flow_control(p->a, window) != 0 || multiplex_set_flow_control(p->b, window) != 0))
+        return 0;
+    multiplex_enable(p->a, CHANNEL, 0);
+    return 1;
+}
+
+static void pair_close(Pair * p) {
+    multiplex_free(p->a);
+    multiplex_free(p->b);
+    close(p->fds[0]);
+    if (p->fds[1] >= 0) close(p->fds[1]);
+}
+
+static void * send_thread(void * ptr) {
+    Sender * s = (Sender *)ptr;
+    char * frame = (char *)calloc(1, s->length);
+    int i = 0;
+    for (; frame != 0 && i < s->frames && !s->failed; ++i) {
+        memset(frame, 'a' + i % 26, s->length);
+        if (multiplex_send(s->m, CHANNEL, frame, s->length) < 0) s->failed = 1;
+    }
+    free(frame);
+    return 0;
+}
+
+// -- a read shorter than a frame still returns credit for all of it
+static void test_frame_short_read_credit(void) {
+    Pair p;
+    Sender s;
+    pthread_t t;
+    char data[10];
+    int i = 0, j = 0, ok = 1;
+    if (!pair_open(&p, 100)) {
+        check(0, "frame mode: short reads return the frame's credit");
+        return;
+    }
+    multiplex_enable_frames(p.b, CHANNEL);
+    s.m = p.a;
+    s.frames = 5;
+    s.length = 80;
+    s.failed = 0;
+    pthread_create(&t, 0, send_thread, &s);
+    for (; i < s.frames && ok; ++i)
+        for (j = 0; j < s.length && ok; j += sizeof(data))
+            ok = multiplex_receive(p.b, 5000, CHANNEL, data, 0, sizeof(data)) == (int)sizeof(data) && data[0] == 'a' + i;
+    pthread_join(t, 0);
+    check(ok && !s.failed, "frame mode: short reads return the frame's credit");
+    pair_close(&p);
+}
+
+// -- a read shorter than a frame keeps the rest of it for the next reads
+static void test_frame_short_read_rest(void) {
+    Pair p;
+    char data[10];
+    char const * rest = 0;
+    int length = 0, ok = 0;
+    if (!pair_open(&p, 0)) {
+        check(0, "frame mode: short reads keep the rest of the frame");
+        return;
+    }
+    multiplex_enable_frames(p.b, CHANNEL);
+    multiplex_send_string(p.a, CHANNEL, "0123456789abcdefghijklmno");
+    multiplex_send_string(p.a, CHANNEL, "ABCDE");
+    multiplex_send_string(p.a, CHANNEL, "pqrstuvwxyz");
+    ok = multiplex_receive(p.b, 5000, CHANNEL, data, 0, sizeof(data)) == 10 && memcmp(data, "0123456789", 10) == 0;
+    ok = ok && multiplex_receive(p.b, 5000, CHANNEL, data, 0, sizeof(data)) == 10 && memcmp(data, "abcdefghij", 10) == 0;
+    ok = ok && multiplex_receive(p.b, 5000, CHANNEL, data, 0, sizeof(data)) == 5 && memcmp(data, "klmno", 5) == 0;
+    ok = ok && multiplex_receive(p.b, 5000, CHANNEL, data, 0, 3) == 3 && memcmp(data, "ABC", 3) == 0;
+    ok = ok && multiplex_acquire_frame(p.b, CHANNEL, &rest, &length) == 1 && length == 2 && memcmp(rest, "DE", 2) == 0;
+    multiplex_release_frame(p.b, CHANNEL);
+    ok = ok && multiplex_receive(p.b, 5000, CHANNEL, data, 0, 4) == 4 && memcmp(data, "pqrs", 4) == 0;
+    ok = ok && multiplex_length(p.b, CHANNEL) == 7;
+    multiplex_clear(p.b, CHANNEL);
+    ok = ok && multiplex_length(p.b, CHANNEL) == 0;
+    check(ok, "frame mode: short reads keep the rest of the frame");
+    pair_close(&p);
+}
+
+// -- a broadcast that fails to write gives back the credit it took
+static void test_broadcast_failure_credit(void) {
+    Pair p;
+    Multiplex * targets[1];
+    char frame[80];
+    int ok = 0;
+    if (!pair_open(&p, 100)) {
+        check(0, "broadcast: a failed write returns the credit");
+        return;
+    }
+    memset(frame, 'x', sizeof(frame));
+    close(p.fds[1]);
+    p.fds[1] = -1;
+    targets[0] = p.a;
+    ok = multiplex_broadcast(targets, 1, CHANNEL, frame, sizeof(frame)) == 0;
+    // without the credit, this would fail with EAGAIN before writing
+    errno = 0;
+    ok = ok && multiplex_send_flags(p.a, CHANNEL, frame, sizeof(frame), MULTIPLEX_NONBLOCK) < 0 && errno != EAGAIN;
+    check(ok, "broadcast: a failed write returns the credit");
+    pair_close(&p);
+}
+
+int main(void) {
+    signal(SIGPIPE, SIG_IGN);
+    alarm(60);
+    test_frame_short_read_credit();
+    test_frame_short_read_rest();
+    test_broadcast_failure_credit();
+    if (failures > 0) printf("%d test(s) failed\n", failures);
+    return failures > 0 ? 1 : 0;
+}